@@ -0,0 +1,604 @@
+/*
+ * File: bench/bench.c
+ * Author: Jack Huang
+ * Created: 2026-10-17
+ * Updated: 2026-10-17
+ * Description: Macro benchmark runner. Generates a corpus of scripts, runs each
+ *              one under smallsh, dash and bash, and reports throughput,
+ *              the mean time per command with its spread across runs, less
+ *              the startup of the shell, and peak RSS as a table and JSON.
+ *              With -s, measures startup instead: the time from execve of
+ *              the shell to its first command, with -c and with a script.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef BENCH_RUNS
+#define BENCH_RUNS 20
+#endif
+
+/*
+ * Startup benchmark:
+ * STARTUP_SAMPLES: Samples per shell and mode for each run asked for
+ * STARTUP_BUDGET_US: Default limit on the median startup overhead of the
+ *                    first shell, in microseconds, over which -s fails
+ */
+#define STARTUP_SAMPLES 10
+#ifndef STARTUP_BUDGET_US
+#define STARTUP_BUDGET_US 1000
+#endif
+
+/*
+ * Corpus:
+ * script: A benchmark script: setup once, then body repeated reps times.
+ *         body may hold several commands separated by newlines; @ stands for
+ *         the corpus directory, and the body's first line gets nwords extra
+ *         words of ${HOME}.
+ */
+struct script
+{
+    char const *name;
+    char const *desc;
+    char const *setup;
+    char const *body;
+    size_t reps;
+    size_t nwords;
+};
+
+struct script const corpus[] = {
+    {"fork", "external command per line", "", "/bin/true", 500, 0},
+    {"builtin", "cd and read, no processes", "", "cd /\nread -r line < @/data", 2000, 0},
+    {"longline", "500 expanded words per line", "", "/bin/true", 200, 500},
+    {"background", "background jobs", "", "/bin/true &", 200, 0},
+    {"large", "20000-line script", "", "cd ${HOME:-/}", 20000, 0},
+};
+
+#define NSCRIPTS (sizeof corpus / sizeof *corpus)
+
+/*
+ * Result of one script under one shell:
+ * startup_s: Median wall time of the shell on an empty script, subtracted
+ *            from each run
+ * run_mean: Wall time of each run less startup_s, divided by its number of
+ *           commands, in microseconds. Commands are not timed one by one:
+ *           a marker process between them would cost more than most of
+ *           them, so only the mean of a run and its spread across runs
+ *           are reported.
+ */
+struct result
+{
+    char const *shell;
+    char const *script;
+    size_t ncmds;
+    size_t runs;
+    int failed;
+    double startup_s;
+    double run_mean[BENCH_RUNS * 8];
+    double mean_us;
+    double sd_us;
+    long max_rss_kb;
+};
+
+char corpus_dir[] = "/tmp/smallsh-bench-XXXXXX";
+
+char *find_shell(char const *name);
+
+size_t write_script(struct script const *s, char const *path);
+
+int run_once(char const *shell, char const *path, double *secs, long *rss_kb);
+
+int cmp_double(void const *a, void const *b);
+
+double percentile(double const *sorted, size_t n, double p);
+
+void summarize(struct result *r);
+
+void json_string(FILE *out, char const *s);
+
+int remove_entry(char const *path, struct stat const *st, int flag, struct FTW *ftw);
+
+void cleanup();
+
+int startup_bench(char **shells, size_t nshells, size_t runs, double budget_us, char const *json_path);
+
+int startup_once(char *const argv[], double *us);
+
+int64_t monotonic_ns();
+
+int main(int argc, char *argv[])
+{
+    // The first command of the startup benchmark: report when it started
+    if (argc == 2 && strcmp(argv[1], "--mark") == 0)
+    {
+        printf("%" PRId64 "\n", monotonic_ns());
+        return 0;
+    }
+
+    size_t runs = BENCH_RUNS;
+    char const *json_path = NULL;
+    int startup = 0;
+    double budget_us = STARTUP_BUDGET_US;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:o:st:")) != -1)
+    {
+        if (opt == 'n')
+            runs = strtoul(optarg, NULL, 10);
+        else if (opt == 'o')
+            json_path = optarg;
+        else if (opt == 's')
+            startup = 1;
+        else if (opt == 't')
+            budget_us = strtod(optarg, NULL);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n runs] [-o results.json] [-s [-t budget_us]] [shell...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (runs == 0 || runs > BENCH_RUNS * 8)
+        errx(2, "runs must be 1 to %d", BENCH_RUNS * 8);
+
+    // Shells: the arguments, or ./smallsh and whichever of dash and bash exist
+    char *shells[16];
+    size_t nshells = 0;
+    for (int i = optind; i < argc && nshells < 16; ++i)
+        shells[nshells++] = argv[i];
+    if (nshells == 0)
+    {
+        char *found;
+        shells[nshells++] = "./smallsh";
+        if ((found = find_shell("dash")))
+            shells[nshells++] = found;
+        if ((found = find_shell("bash")))
+            shells[nshells++] = found;
+    }
+
+    if (!mkdtemp(corpus_dir))
+        err(1, "mkdtemp");
+    atexit(cleanup);
+    char *data_path;
+    if (asprintf(&data_path, "%s/data", corpus_dir) < 0)
+        err(1, "asprintf");
+    FILE *data = fopen(data_path, "w");
+    if (!data)
+        err(1, "%s", data_path);
+    fputs("one line of input\n", data);
+    fclose(data);
+    if (startup)
+        return startup_bench(shells, nshells, runs, budget_us, json_path);
+
+    size_t ncmds[NSCRIPTS];
+    char *paths[NSCRIPTS];
+    for (size_t i = 0; i < NSCRIPTS; ++i)
+    {
+        if (asprintf(&paths[i], "%s/%s.sh", corpus_dir, corpus[i].name) < 0)
+            err(1, "asprintf");
+        ncmds[i] = write_script(&corpus[i], paths[i]);
+    }
+
+    // Startup of each shell: the median wall time of an empty script
+    char *empty;
+    double startup_s[16];
+    if (asprintf(&empty, "%s/empty.sh", corpus_dir) < 0)
+        err(1, "asprintf");
+    FILE *f = fopen(empty, "w");
+    if (!f || fclose(f) != 0)
+        err(1, "%s", empty);
+    for (size_t k = 0; k < nshells; ++k)
+    {
+        double samples[BENCH_RUNS * 8];
+        long rss;
+        size_t n = 0;
+        while (n < runs && run_once(shells[k], empty, &samples[n], &rss) == 0)
+            ++n;
+        qsort(samples, n, sizeof *samples, cmp_double);
+        startup_s[k] = n == runs ? percentile(samples, n, 0.5) : 0;
+    }
+
+    struct result *results = calloc(nshells * NSCRIPTS, sizeof *results);
+    if (!results)
+        err(1, "calloc");
+    printf("%-10s %-14s %8s %12s %10s %10s %10s %10s\n",
+           "script", "shell", "cmds", "cmds/s", "mean us", "sd us", "startup us", "rss KiB");
+    for (size_t i = 0; i < NSCRIPTS; ++i)
+    {
+        for (size_t k = 0; k < nshells; ++k)
+        {
+            struct result *r = &results[i * nshells + k];
+            r->shell = shells[k];
+            r->script = corpus[i].name;
+            r->ncmds = ncmds[i];
+            r->startup_s = startup_s[k];
+
+            // One warm-up run, not counted
+            double secs;
+            long rss;
+            r->failed = run_once(shells[k], paths[i], &secs, &rss) < 0;
+            for (size_t n = 0; n < runs && !r->failed; ++n)
+            {
+                if (run_once(shells[k], paths[i], &secs, &rss) < 0)
+                {
+                    r->failed = 1;
+                    break;
+                }
+                r->run_mean[r->runs++] = (secs - r->startup_s) * 1e6 / r->ncmds;
+                if (rss > r->max_rss_kb)
+                    r->max_rss_kb = rss;
+            }
+            if (r->failed)
+            {
+                printf("%-10s %-14s %8zu %12s\n", r->script, r->shell, r->ncmds, "failed");
+                continue;
+            }
+            summarize(r);
+            printf("%-10s %-14s %8zu %12.0f %10.2f %10.2f %10.1f %10ld\n", r->script, r->shell, r->ncmds,
+                   1e6 / r->mean_us, r->mean_us, r->sd_us, r->startup_s * 1e6, r->max_rss_kb);
+            fflush(stdout);
+        }
+    }
+
+    if (json_path)
+    {
+        FILE *out = fopen(json_path, "w");
+        if (!out)
+            err(1, "%s", json_path);
+        fprintf(out, "{\n  \"runs\": %zu,\n  \"results\": [", runs);
+        for (size_t i = 0; i < nshells * NSCRIPTS; ++i)
+        {
+            struct result *r = &results[i];
+            fprintf(out, "%s\n    {\"script\": ", i ? "," : "");
+            json_string(out, r->script);
+            fprintf(out, ", \"shell\": ");
+            json_string(out, r->shell);
+            fprintf(out, ", \"commands\": %zu, ", r->ncmds);
+            if (r->failed)
+                fprintf(out, "\"failed\": true}");
+            else
+                fprintf(out, "\"commands_per_s\": %.1f, \"mean_us\": %.3f, \"sd_us\": %.3f, "
+                        "\"min_us\": %.3f, \"max_us\": %.3f, \"startup_us\": %.3f, \"max_rss_kb\": %ld}",
+                        1e6 / r->mean_us, r->mean_us, r->sd_us, r->run_mean[0], r->run_mean[r->runs - 1],
+                        r->startup_s * 1e6, r->max_rss_kb);
+        }
+        fprintf(out, "\n  ]\n}\n");
+        fclose(out);
+    }
+    return 0;
+}
+
+/*
+ * Path of an executable called name in $PATH, as a new string, or NULL
+ */
+char *find_shell(char const *name)
+{
+    char const *path = getenv("PATH");
+    for (char const *dir = path ? path : "/bin:/usr/bin", *end; ; dir = end + 1)
+    {
+        end = strchrnul(dir, ':');
+        char *file;
+        if (asprintf(&file, "%.*s/%s", (int)(end - dir), dir, name) < 0)
+            err(1, "asprintf");
+        if (end > dir && access(file, X_OK) == 0)
+            return file;
+        free(file);
+        if (*end == '\0')
+            return NULL;
+    }
+}
+
+/*
+ * Write script s to path. Returns the number of commands in it.
+ */
+size_t write_script(struct script const *s, char const *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        err(1, "%s", path);
+    size_t ncmds = 0;
+    fputs(s->setup, f);
+    for (size_t i = 0; i < s->reps; ++i)
+    {
+        int first = 1;
+        for (char const *c = s->body; *c; ++c)
+        {
+            if (*c == '@')
+                fputs(corpus_dir, f);
+            else if (*c == '\n')
+            {
+                for (size_t w = 0; first && w < s->nwords; ++w)
+                    fputs(" ${HOME}", f);
+                first = 0;
+                fputc('\n', f);
+                ++ncmds;
+            }
+            else
+                fputc(*c, f);
+        }
+        for (size_t w = 0; first && w < s->nwords; ++w)
+            fputs(" ${HOME}", f);
+        fputc('\n', f);
+        ++ncmds;
+    }
+    if (fclose(f) != 0)
+        err(1, "%s", path);
+    return ncmds;
+}
+
+/*
+ * Run shell on the script at path with output discarded. Sets *secs to the
+ * wall time and *rss_kb to the peak RSS of the shell or of any process it
+ * waited for. Returns 0, or -1 if the shell could not run or failed.
+ */
+int run_once(char const *shell, char const *path, double *secs, long *rss_kb)
+{
+    struct timespec start, end;
+    struct rusage ru;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0)
+        err(1, "fork");
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(shell, shell, path, (char *)NULL);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0)
+        err(1, "wait4");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    *rss_kb = ru.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) != 127 ? 0 : -1;
+}
+
+/*
+ * qsort comparison for doubles in increasing order
+ */
+int cmp_double(void const *a, void const *b)
+{
+    double x = *(double const *)a, y = *(double const *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Value at fraction p of the n sorted values, by the nearest-rank method
+ */
+double percentile(double const *sorted, size_t n, double p)
+{
+    size_t rank = (size_t)(p * n + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/*
+ * Sort the per-run means of r and set its mean and sample standard
+ * deviation across runs
+ */
+void summarize(struct result *r)
+{
+    double sum = 0, sq = 0;
+    qsort(r->run_mean, r->runs, sizeof *r->run_mean, cmp_double);
+    for (size_t i = 0; i < r->runs; ++i)
+        sum += r->run_mean[i];
+    r->mean_us = sum / r->runs;
+    for (size_t i = 0; i < r->runs; ++i)
+        sq += (r->run_mean[i] - r->mean_us) * (r->run_mean[i] - r->mean_us);
+    r->sd_us = r->runs > 1 ? sqrt(sq / (r->runs - 1)) : 0;
+}
+
+/*
+ * Write s to out as a JSON string, quoted and escaped
+ */
+void json_string(FILE *out, char const *s)
+{
+    fputc('"', out);
+    for (unsigned char const *c = (unsigned char const *)s; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+/*
+ * nftw callback removing each entry of the corpus, directories after their
+ * contents
+ */
+int remove_entry(char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    if ((flag == FTW_DP ? rmdir(path) : unlink(path)) < 0)
+        warn("%s", path);
+    return 0;
+}
+
+/*
+ * Remove the generated corpus
+ */
+void cleanup()
+{
+    if (nftw(corpus_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS) < 0)
+        warn("%s", corpus_dir);
+}
+
+/*
+ * Measure the startup of each shell: the time from its execve to the start
+ * of its first command, "bench --mark", run with -c and as a script. The
+ * time to start that command directly is subtracted, leaving the
+ * overhead of the shell. Returns 1 if the median overhead of the first
+ * shell is over budget_us in either mode, 0 otherwise.
+ */
+int startup_bench(char **shells, size_t nshells, size_t runs, double budget_us, char const *json_path)
+{
+    static char const *const modes[] = {"-c", "script"};
+    char self[PATH_MAX], *cmd, *script;
+    ssize_t len = readlink("/proc/self/exe", self, sizeof self - 1);
+    if (len < 0)
+        err(1, "/proc/self/exe");
+    self[len] = '\0';
+    if (asprintf(&cmd, "%s --mark", self) < 0 || asprintf(&script, "%s/startup.sh", corpus_dir) < 0)
+        err(1, "asprintf");
+    FILE *f = fopen(script, "w");
+    if (!f || fprintf(f, "%s\n", cmd) < 0 || fclose(f) != 0)
+        err(1, "%s", script);
+
+    size_t n = runs * STARTUP_SAMPLES;
+    double *samples = malloc(sizeof *samples * n);
+    double *p50 = calloc(nshells * 2, sizeof *p50), *p99 = calloc(nshells * 2, sizeof *p99);
+    if (!samples || !p50 || !p99)
+        err(1, "malloc");
+
+    // Starting the command without a shell, as the baseline
+    char *direct[] = {self, "--mark", NULL};
+    double base = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (startup_once(direct, &samples[i]) < 0)
+            errx(1, "%s --mark failed", self);
+    qsort(samples, n, sizeof *samples, cmp_double);
+    base = percentile(samples, n, 0.5);
+    printf("startup: execve to first command, %zu samples, direct start p50 %.1f us\n", n, base);
+    printf("%-14s %-8s %10s %10s %14s\n", "shell", "mode", "p50 us", "p99 us", "overhead us");
+
+    int failed = 0;
+    for (size_t k = 0; k < nshells; ++k)
+    {
+        for (size_t m = 0; m < 2; ++m)
+        {
+            char *argv[] = {shells[k], m == 0 ? "-c" : script, m == 0 ? cmd : NULL, NULL};
+            size_t i = 0;
+            while (i < n && startup_once(argv, &samples[i]) == 0)
+                ++i;
+            if (i < n)
+            {
+                printf("%-14s %-8s %10s\n", shells[k], modes[m], "failed");
+                p50[k * 2 + m] = p99[k * 2 + m] = -1;
+                failed |= k == 0;
+                continue;
+            }
+            qsort(samples, n, sizeof *samples, cmp_double);
+            p50[k * 2 + m] = percentile(samples, n, 0.5);
+            p99[k * 2 + m] = percentile(samples, n, 0.99);
+            printf("%-14s %-8s %10.1f %10.1f %14.1f\n", shells[k], modes[m], p50[k * 2 + m],
+                   p99[k * 2 + m], p50[k * 2 + m] - base);
+            if (k == 0 && p50[k * 2 + m] - base > budget_us)
+            {
+                printf("%s %s: startup overhead %.1f us is over the budget of %.1f us\n", shells[k],
+                       modes[m], p50[k * 2 + m] - base, budget_us);
+                failed = 1;
+            }
+        }
+    }
+
+    if (json_path)
+    {
+        FILE *out = fopen(json_path, "w");
+        if (!out)
+            err(1, "%s", json_path);
+        fprintf(out, "{\n  \"samples\": %zu,\n  \"direct_p50_us\": %.3f,\n  \"budget_us\": %.3f,\n  \"startup\": [",
+                n, base, budget_us);
+        for (size_t i = 0; i < nshells * 2; ++i)
+        {
+            fprintf(out, "%s\n    {\"shell\": ", i ? "," : "");
+            json_string(out, shells[i / 2]);
+            fprintf(out, ", \"mode\": \"%s\", ", modes[i % 2]);
+            if (p50[i] < 0)
+                fprintf(out, "\"failed\": true}");
+            else
+                fprintf(out, "\"p50_us\": %.3f, \"p99_us\": %.3f, \"overhead_us\": %.3f}", p50[i], p99[i],
+                        p50[i] - base);
+        }
+        fprintf(out, "\n  ]\n}\n");
+        fclose(out);
+    }
+    free(samples);
+    free(p50);
+    free(p99);
+    free(cmd);
+    free(script);
+    return failed;
+}
+
+/*
+ * Run argv, a command whose first command is "bench --mark", and set *us to
+ * the time from its execve to the start of that command.
+ * Returns 0, or -1 if it did not report a time.
+ */
+int startup_once(char *const argv[], double *us)
+{
+    int start[2], out[2];
+    if (pipe2(start, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+        err(1, "pipe");
+    pid_t pid = fork();
+    if (pid < 0)
+        err(1, "fork");
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        int64_t t0 = monotonic_ns();
+        write(start[1], &t0, sizeof t0);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(start[1]);
+    close(out[1]);
+
+    int64_t t0 = 0;
+    char buf[64];
+    size_t len = 0;
+    ssize_t k;
+    if (read(start[0], &t0, sizeof t0) != sizeof t0)
+        t0 = 0;
+    while (len < sizeof buf - 1 && (k = read(out[0], buf + len, sizeof buf - 1 - len)) > 0)
+        len += k;
+    buf[len] = '\0';
+    close(start[0]);
+    close(out[0]);
+    waitpid(pid, NULL, 0);
+
+    char *end;
+    int64_t t1 = strtoll(buf, &end, 10);
+    if (!t0 || end == buf)
+        return -1;
+    *us = (t1 - t0) / 1e3;
+    return 0;
+}
+
+/*
+ * Nanoseconds on the monotonic clock
+ */
+int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -2,8 +2,11 @@
  * File: smallsh.c
  * Author: Jack Huang
  * Created: 2023-05-02
- * Updated: 2023-05-19
- * Description: A simple shell program that supports built-in commands cd and exit, and non-built-in commands.
+ * Updated: 2026-10-17
+ * Description: A simple shell program that supports built-in commands cd, exit, exec, memo, jobs, output,
+ *              read, mapfile, waitfor, watch, limit, declare, unset, coproc, echo, and with SMALLSH_FS_BUILTINS
+ *              mkdir, rm, cp, mv, touch and ln,
+ *              and non-built-in commands.
  */
 
 #define _POSIX_C_SOURCE 200809L
@@ -20,6 +23,21 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
 
 #ifndef MAX_WORDS
 #define MAX_WORDS 512
@@ -28,26 +46,683 @@
 /*
  * Global Variables:
  * words: An array of words read from input
+ * word_pats: For each word with escaped pattern characters, the word with
+ *            a \ kept before them, for pathname expansion, or NULL
  * int_buf: A buffer for converting integer to string
  * bg_flag: A flag for background process
- * ppgid: Parent process group id
+ * ppgid: Parent process group id, taken when the first child is reaped
  */
 char *words[MAX_WORDS];
+char *word_pats[MAX_WORDS];
 char int_buf[21];
 int bg_flag = 0;
 pid_t ppgid;
 
+/*
+ * Redirections:
+ * redir_op: Redirection operators, file-opening operators first
+ * redirs: Redirections of the current command, applied in order
+ * nredirs: Number of redirections in redirs
+ * saved_fds: Descriptors saved while a builtin runs with redirections
+ */
+enum redir_op
+{
+    REDIR_IN,     // [n]< file
+    REDIR_OUT,    // [n]> file
+    REDIR_APPEND, // [n]>> file
+    REDIR_DUP,    // [n]>&m, [n]<&m
+    REDIR_CLOSE   // [n]>&-, [n]<&-
+};
+
+struct redir
+{
+    int fd;           // Descriptor being redirected
+    enum redir_op op; // Operator
+    char *target;     // File name for REDIR_IN, REDIR_OUT and REDIR_APPEND
+    int src;          // Source descriptor for REDIR_DUP
+};
+
+struct redir redirs[MAX_WORDS];
+size_t nredirs = 0;
+int saved_fds[MAX_WORDS];
+int const redir_flags[] = {
+    [REDIR_IN] = O_RDONLY,
+    [REDIR_OUT] = O_WRONLY | O_CREAT | O_TRUNC,
+    [REDIR_APPEND] = O_WRONLY | O_CREAT | O_APPEND,
+};
+
+/*
+ * Glob patterns for ${name#pat} and friends:
+ * pat_tok: One element of a compiled pattern: a character, ?, *, or a
+ *          [...] bracket expression as a set of 256 bits
+ * pattern: Compiled pattern; literal is set when it has no wildcards
+ * pat_cache: Recently compiled patterns, keyed by their text
+ */
+#define PAT_CACHE_SIZE 32
+enum pat_type
+{
+    PAT_CHAR,
+    PAT_ANY,
+    PAT_STAR,
+    PAT_SET
+};
+
+struct pat_tok
+{
+    enum pat_type type;
+    unsigned char c;
+    unsigned char set[32];
+};
+
+struct pattern
+{
+    char *src;
+    size_t len;
+    struct pat_tok *tok;
+    size_t ntok;
+    int literal;
+};
+
+struct pattern pat_cache[PAT_CACHE_SIZE];
+size_t pat_cache_next = 0;
+
+/*
+ * Arithmetic expansion $((...)) and the ((...)) command:
+ * ar_token: Token of an arithmetic expression
+ * ar_insn: Instruction of a compiled expression for a stack machine;
+ *          arg is a number, an index into names or a jump target
+ * arith: Compiled expression, with the names of the variables it uses, or
+ *        the error it failed to compile with
+ * arith_cache: Recently compiled expressions, keyed by their text
+ */
+#define ARITH_CACHE_SIZE 64
+#define ARITH_STACK 256
+enum ar_tok_type
+{
+    AR_END,
+    AR_NUM,
+    AR_NAME,
+    AR_OP
+};
+
+struct ar_token
+{
+    enum ar_tok_type type;
+    char const *start;
+    size_t len;
+    uint64_t num;
+};
+
+enum ar_opcode
+{
+    AR_NOP, AR_PUSH, AR_POP, AR_LOAD, AR_STORE,
+    AR_PREINC, AR_PREDEC, AR_POSTINC, AR_POSTDEC,
+    AR_NEG, AR_NOT, AR_BNOT, AR_BOOL,
+    AR_JZ, AR_JMP, AR_JZ_KEEP, AR_JNZ_KEEP,
+    AR_ADD, AR_SUB, AR_MUL, AR_DIV, AR_MOD, AR_POW, AR_SHL, AR_SHR,
+    AR_LT, AR_LE, AR_GT, AR_GE, AR_EQ, AR_NE, AR_BAND, AR_BXOR, AR_BOR,
+    AR_AND, AR_OR
+};
+
+struct ar_insn
+{
+    enum ar_opcode op;
+    int64_t arg;
+};
+
+struct arith
+{
+    char *src;
+    size_t len;
+    struct ar_insn *code;
+    size_t ncode, cap;
+    char **names;
+    size_t nnames;
+    char const *error;
+};
+
+struct arith arith_cache[ARITH_CACHE_SIZE];
+size_t arith_cache_next = 0;
+
+/*
+ * Shell variables:
+ * var: A variable set by the shell. A scalar is kept in the environment as
+ *      entry, a "name=value" string of cap bytes owned by the shell, so that
+ *      it can be replaced or appended to in place. An array is a vector of
+ *      n values, NULL for an unset element of an indexed array. An
+ *      associative array keeps the key of each value in keys, in insertion
+ *      order, and finds them through index, a hash table of index_cap slots
+ *      holding a position + 1, or 0 if empty. joined caches ${name[*]}.
+ *      sizes holds the length and allocated size of each value, so that
+ *      appending to an element grows it geometrically; a cap of 0 means
+ *      they are not known yet.
+ * vars: Hash table of vars_cap slots keyed by name, holding nvars variables;
+ *       vars_used counts the slots in use, including var_tombstone in the
+ *       slots of removed variables
+ * ARRAY_GAP_MAX: How far past its end an indexed array may be assigned to
+ * args: The words of the current line after expansion, which outnumber the
+ *       words read when ${name[@]} splices an array into them
+ */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define ARRAY_GAP_MAX ((size_t)1 << 24)
+enum var_type
+{
+    VAR_SCALAR,
+    VAR_ARRAY,
+    VAR_ASSOC
+};
+
+struct val_size
+{
+    size_t len;
+    size_t cap;
+};
+
+struct var
+{
+    char *name;
+    enum var_type type;
+    char *entry;
+    size_t len;
+    size_t cap;
+    char **vals;
+    char **keys;
+    struct val_size *sizes;
+    size_t n;
+    size_t vals_cap;
+    size_t *index;
+    size_t index_cap;
+    char *joined;
+};
+
+struct var **vars = NULL;
+size_t vars_cap = 0;
+size_t nvars = 0;
+size_t vars_used = 0;
+struct var var_tombstone;
+char **args = NULL;
+size_t nargs = 0;
+size_t args_cap = 0;
+
+/*
+ * Read-ahead for the read builtin:
+ * read_buf: Block read from a regular file past the end of a line. off is the
+ *           file offset of buf[0]. After each line the descriptor is seeked
+ *           back to off + pos, and the block is reused while the descriptor
+ *           is still at that offset of the same, unmodified file.
+ * read_bufs: Read-ahead of descriptors 0 to READ_BUF_FDS - 1
+ */
+#define READ_BUF_SIZE 4096
+#define READ_BUF_FDS 16
+struct read_buf
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    off_t off;
+    size_t pos;
+    size_t len;
+    char buf[READ_BUF_SIZE];
+};
+
+struct read_buf *read_bufs[READ_BUF_FDS];
+
+/*
+ * File watching for the watch builtin:
+ * WATCH_SETTLE_MS: Quiet time after a change before the command is run again
+ */
+#define WATCH_SETTLE_MS 50
+
+/*
+ * Persistent descriptors:
+ * shell_fds: Descriptors 3-9 opened by exec. They stay close-on-exec in the
+ *            shell and are inherited by children only while spawning.
+ * nshell_fds: Number of descriptors in shell_fds
+ */
+#define SHELL_FD_MAX 9
+int shell_fds[SHELL_FD_MAX + 1];
+size_t nshell_fds = 0;
+
+/*
+ * Process substitution:
+ * procsub: Helper process of <(cmd) or >(cmd), and the shell's end of its
+ *          pipe, open while the command using it runs
+ * procsubs: Helpers not yet reaped. They are reaped silently.
+ * procsub_spawning: Set while a helper is spawned, so that it does not
+ *                   inherit the pipes of other helpers
+ */
+struct procsub
+{
+    pid_t pid;
+    int fd;
+};
+struct procsub *procsubs = NULL;
+size_t nprocsubs = 0, procsubs_cap = 0;
+int procsub_spawning = 0;
+
+/*
+ * Append cache, enabled by setting SMALLSH_APPEND_CACHE to its size:
+ * append_cache: Open descriptors for >> redirections keyed by path, reused
+ *               while the path still names the same file (device, inode)
+ * nappend_cache: Number of entries in append_cache
+ * append_clock: Use counter for least-recently-used eviction
+ */
+#ifndef APPEND_CACHE_MAX
+#define APPEND_CACHE_MAX 64
+#endif
+struct append_entry
+{
+    char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    unsigned long used;
+};
+struct append_entry append_cache[APPEND_CACHE_MAX];
+size_t nappend_cache = 0;
+unsigned long append_clock = 0;
+
+/*
+ * File builtins, enabled by setting SMALLSH_FS_BUILTINS:
+ * fs_cmd: A file builtin, with the option letters it supports. Option i
+ *         sets bit FS_OPT(i) of the flags passed to run.
+ * rm_task: A directory being removed by rm -r, entry name of its parent's
+ *          directory. fd is open from when it is listed until it is
+ *          removed, for its entries; path is only for messages. pending
+ *          counts its subdirectories not yet removed, plus one while it is
+ *          listed.
+ * rm_pool: Threads emptying the directories queued in head
+ */
+#define FS_OPT(i) (1 << (i))
+#define RM_THREADS 8
+struct fs_cmd
+{
+    char const *name;
+    char const *options;
+    size_t min_operands;
+    int (*run)(int flags, char **ops, size_t n);
+};
+
+struct rm_task
+{
+    struct rm_task *parent;
+    struct rm_task *next;
+    char *name;
+    char *path;
+    int fd;
+    int pending;
+};
+
+struct rm_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct rm_task *head;
+    int done;
+    int status;
+    pthread_t threads[RM_THREADS];
+    size_t nthreads;
+    size_t max_threads;
+};
+
+int fs_mkdir(int flags, char **ops, size_t n);
+int fs_rm(int flags, char **ops, size_t n);
+int fs_cp(int flags, char **ops, size_t n);
+int fs_mv(int flags, char **ops, size_t n);
+int fs_touch(int flags, char **ops, size_t n);
+int fs_ln(int flags, char **ops, size_t n);
+
+struct fs_cmd const fs_cmds[] = {
+    {"mkdir", "p", 1, fs_mkdir},
+    {"rm", "rRf", 1, fs_rm},
+    {"cp", "", 2, fs_cp},
+    {"mv", "f", 2, fs_mv},
+    {"touch", "c", 1, fs_touch},
+    {"ln", "sf", 1, fs_ln},
+};
+
+/*
+ * Text builtins, enabled by setting SMALLSH_TEXT_BUILTINS:
+ * text_cmd: A run of wc -l, head, tail or grep -F. lines is the count of
+ *           -n, left to output or to skip, from_start is set for tail -n +N,
+ *           and pattern is the fixed string of grep. Per file, name is the
+ *           name printed, whole is set while the input is one mapping of
+ *           all of it, and count and lineno are the lines counted or
+ *           selected and the lines seen. keep holds the last lines of tail
+ *           read from a pipe.
+ * TEXT_BUF_SIZE: Size of the reads from inputs that cannot be mapped
+ */
+#define TEXT_BUF_SIZE 131072
+struct text_cmd
+{
+    char const *cmd;
+    uint64_t lines;
+    int from_start;
+    char const *pattern;
+    size_t pattern_len;
+    int count_only, quiet, invert, number, prefix, shown;
+    char const *name;
+    int whole;
+    uint64_t left, count, lineno;
+    char *keep;
+    size_t keep_len, keep_cap, keep_trimmed;
+};
+
+/*
+ * Pathname expansion of words with *, ? or [...] bracket expressions, and
+ * ** for any number of directories:
+ * glob_task: A directory to read, with the component of the pattern its
+ *            entries are matched against
+ * glob_worker: A thread of the walk. Its deque of tasks holds tasks[top]
+ *              to tasks[bottom - 1]: the worker pushes and pops at the
+ *              bottom, and idle workers steal from the top. matches holds
+ *              the paths it found.
+ * glob_pool: The walk of one pattern, split into its components, with
+ *            workers started as tasks are queued, up to GLOB_THREADS.
+ *            pending counts the tasks not yet done, queued those in deques;
+ *            idle workers sleep on cond until there is more to take.
+ * linux_dirent64: A directory entry read by getdents64
+ */
+#define GLOB_THREADS 8
+#define GLOB_BUF_SIZE 32768
+struct glob_task
+{
+    char *dir;
+    size_t comp;
+};
+
+struct glob_pool;
+struct glob_worker
+{
+    struct glob_pool *pool;
+    pthread_mutex_t lock;
+    struct glob_task *tasks;
+    size_t top, bottom, cap;
+    char **matches;
+    size_t nmatches, matches_cap;
+    pthread_t thread;
+};
+
+struct glob_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pattern *comps;
+    char *globstar;
+    size_t ncomps;
+    int dir_only;
+    size_t pending;
+    size_t queued;
+    size_t idle;
+    int done;
+    struct glob_worker workers[GLOB_THREADS];
+    size_t nworkers;
+};
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * Shared command path cache, enabled by setting SMALLSH_PATH_CACHE to a file:
+ * path_slot: Path of a command name found under a PATH, keyed by a hash of
+ *            both. seq is odd while a writer updates the slot; readers
+ *            retry if it changed while they copied the slot (a seqlock).
+ * path_cache: Open-addressed table of slots, mapped MAP_SHARED from the
+ *             file by every shell using it
+ */
+#define PATH_CACHE_MAGIC 0x736d616c6c706331ULL
+#define PATH_CACHE_SLOTS 4096
+#define PATH_CACHE_PROBE 8
+struct path_slot
+{
+    uint32_t seq;
+    uint32_t unused;
+    uint64_t key;
+    uint64_t path_hash;
+    char name[64];
+    char path[424];
+};
+
+struct path_cache
+{
+    uint64_t magic;
+    char unused[56];
+    struct path_slot slots[PATH_CACHE_SLOTS];
+};
+
+struct path_cache *path_cache = NULL;
+int path_cache_ready = 0;
+
+/*
+ * Resource limits:
+ * limits: Limits for a command; 0 means none. mem (bytes), cpu (seconds) and
+ *         nofile are set with setrlimit, mem and cpu_max (percent of a CPU)
+ *         also on the cgroup of a background job.
+ * limit_override: Limits set by the limit builtin for the command it runs
+ * spawn_limits: Limits for spawn_cmd to use instead of the current ones
+ * spawn_cgroup: Cgroup for spawn_cmd to start the command in
+ * spawn_env: Environment for spawn_cmd to use instead of environ
+ */
+struct limits
+{
+    uint64_t mem;
+    uint64_t cpu;
+    uint64_t nofile;
+    uint64_t cpu_max;
+};
+
+struct limits limit_override = {0};
+struct limits const *spawn_limits = NULL;
+char const *spawn_cgroup = NULL;
+char **spawn_env = NULL;
+
+/*
+ * Background jobs:
+ * ring: Bounded buffer of captured output; total counts all bytes written
+ * job: A background job, with its output captured if SMALLSH_CAPTURE is set.
+ *      A coprocess has the name it was started with and the shell's ends
+ *      of its pipes, to read its output from and to write its input to.
+ *      Once it finishes, it is kept until its output has been read.
+ * pending: Command of a job whose start is delayed by admission control,
+ *          with the working directory and environment of its line
+ * jobs: Background jobs in start order; finished jobs with captured output
+ *       stay until it has been shown with the output builtin
+ * ndelayed: Number of jobs waiting to be started; at the end of input, the
+ *           shell waits for them from DRAIN_MIN_NS between checks,
+ *           doubling up to DRAIN_MAX_NS, or until a child exits
+ * capture_*: Epoll loop thread moving job output into the ring buffers.
+ *            capture_lock guards the rings and the capture descriptors.
+ */
+#define RING_SIZE (64 * 1024)
+#define SPILL_SIZE (16 * 1024 * 1024)
+#define MAX_DONE_JOBS 64
+#define DRAIN_MIN_NS 10000000LL
+#define DRAIN_MAX_NS 1000000000LL
+struct ring
+{
+    char *buf;
+    size_t cap;
+    size_t head;
+    size_t len;
+    uint64_t total;
+    int spilled;
+};
+
+struct job;
+struct capture
+{
+    struct job *job;
+    int fd;
+};
+
+struct pending
+{
+    char **argv;
+    struct redir *redirs;
+    size_t nredirs;
+    int cwd;
+    char **env;
+};
+
+struct job
+{
+    int id;
+    pid_t pid;
+    char *cmd;
+    struct pending *pending;
+    int token;
+    int done;
+    int status;
+    int captured;
+    struct capture cap[2];
+    struct ring out;
+    struct limits limits;
+    char *cgroup;
+    char *coproc;
+    int coproc_fds[2];
+};
+
+struct job **jobs = NULL;
+size_t njobs = 0, jobs_cap = 0;
+int next_job_id = 1;
+size_t ndelayed = 0;
+
+pthread_t capture_thread;
+int capture_thread_started = 0;
+int capture_epoll = -1;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * GNU make jobserver, set up on the first background job:
+ * jobserver_rfd: Non-blocking descriptor to take tokens from, -1 if none
+ * jobserver_wfd: Descriptor to return tokens to
+ * jobserver_auth_rfd: Read end named in MAKEFLAGS by the make that started
+ *                     this process, kept open for children, or -1
+ * jobserver_implicit: Whether a job holds this process's implicit token
+ * JOB_*_TOKEN: Values of job.token other than a token byte
+ */
+#define JOB_NO_TOKEN (-1)
+#define JOB_IMPLICIT_TOKEN 256
+int jobserver_ready = 0;
+int jobserver_rfd = -1;
+int jobserver_wfd = -1;
+int jobserver_auth_rfd = -1;
+int jobserver_implicit = 0;
+
+/*
+ * Script profiling with --profile:
+ * prof_line: Costs of a script line: wall time, CPU time of the shell and of
+ *            waited-for children, in nanoseconds, and processes spawned
+ * profile_lines: Costs indexed by line number, for profile_cap lines
+ * profile_cur: Line being run, with the counters at its start in profile_mark
+ * spawn_count: Processes spawned so far
+ */
+struct prof_line
+{
+    uint64_t count;
+    int64_t wall;
+    int64_t shell;
+    int64_t children;
+    uint64_t forks;
+    char *text;
+};
+
+char const *profile_path = NULL;
+char const *profile_script = NULL;
+struct prof_line *profile_lines = NULL;
+size_t profile_cap = 0;
+struct prof_line *profile_cur = NULL;
+struct prof_line profile_mark;
+uint64_t spawn_count = 0;
+
+/*
+ * Script journal with --journal, and --resume:
+ * journal_rec: A completed line of the script: its number, the hash of the
+ *              script up to and including it, and its exit status, or
+ *              JOURNAL_BACKGROUND for a line started in the background
+ * journal_recs: Lines that succeeded in the journaled run being resumed,
+ *               up to the first one that did not; journal_next is the next
+ *               one expected
+ * journal_hash: Hash of the script read so far
+ * journal_replaying: Set while a line is run again to restore shell state
+ * journal_unsynced: Records written since the last fdatasync, at
+ *                   journal_synced_at; they are synced in batches
+ */
+#define JOURNAL_SYNC_RECORDS 256
+#define JOURNAL_SYNC_NS 1000000000LL
+#define JOURNAL_BACKGROUND -1
+enum journal_action
+{
+    JOURNAL_RUN,    // Run the line and record it
+    JOURNAL_SKIP,   // Skip the line, which succeeded before
+    JOURNAL_REPLAY  // Run the line again without recording it, to restore shell state
+};
+
+struct journal_rec
+{
+    size_t lineno;
+    uint64_t hash;
+    int status;
+};
+
+char const *journal_path = NULL;
+int journal_resume = 0;
+int journal_fd = -1;
+struct journal_rec *journal_recs = NULL;
+size_t njournal_recs = 0, journal_next = 0;
+uint64_t journal_hash = FNV_OFFSET;
+int journal_replaying = 0;
+size_t journal_unsynced = 0;
+int64_t journal_synced_at = 0;
+
+/*
+ * Buffered output of builtins:
+ * out_buf: Output for stdout or stderr, written when full, before the shell
+ *          spawns a command or reads interactive input, when its descriptor
+ *          is redirected, and at exit. dev and ino identify the file the
+ *          descriptor referred to when the output was buffered; tty is set
+ *          for a terminal, which is written to directly.
+ * out_bufs: Buffers of stdout and stderr. stderr is a stream writing into
+ *           the second one, so it carries the messages of the shell.
+ */
+#define OUT_BUF_SIZE 8192
+struct out_buf
+{
+    int fd;
+    int tty;
+    dev_t dev;
+    ino_t ino;
+    size_t len;
+    char buf[OUT_BUF_SIZE];
+};
+
+struct out_buf out_bufs[2] = {{.fd = STDOUT_FILENO}, {.fd = STDERR_FILENO}};
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Sinal Handling
  * SIGTSTP_default: Default SIGTSTP action
  * SIGTSTP_action: New SIGTSTP action
  * SIGINT_default: Default SIGINT action
  * SIGINT_action: New SIGINT action
+ * interactive: Set when commands are read from stdin. Handlers are only
+ *              installed then; otherwise the signal dispositions inherited
+ *              by the shell are left, and inherited, as they are.
  */
+int interactive = 0;
 struct sigaction SIGTSTP_default = {0};
 struct sigaction SIGTSTP_action = {0};
 struct sigaction SIGINT_default = {0};
 struct sigaction SIGINT_action = {0};
+volatile sig_atomic_t interrupted = 0;
 
 void SIGTSTP_setup();
 
@@ -55,596 +730,8232 @@ void SIGINT_setup();
 
 void SIGINT_handler(int signo);
 
+void SIGINT_interrupt_handler(int signo);
+
 void print_prompt();
 
 /* Words processing */
 size_t wordsplit(char const *line);
 
+size_t wordsplit_into(char const *line, char **out, size_t max);
+
+size_t wordsplit_pats(char const *line, char **out, char **pats, size_t max);
+
 char *expand(char const *word);
 
-size_t parse_command(size_t nwords, char **argv);
+void expand_brace(char const *s, char const *e);
+
+char *expand_range(char const *s, char const *e);
+
+struct pattern const *pat_compile(char const *src, size_t n);
+
+void pat_build(struct pattern *p, char const *src, size_t n);
+
+int pat_match(struct pattern const *p, char const *s, size_t n);
+
+size_t pat_match_longest(struct pattern const *p, char const *s, size_t n);
+
+char const *var_get(char const *name);
+
+void var_set(char const *name, char const *value);
+
+void var_unset(char const *name);
+
+int is_name(char const *s);
+
+struct var *var_find(char const *name, size_t len, int create);
+
+void var_remove(struct var *v);
+
+int var_store(char const *name, char const *s, size_t k, int append);
+
+int var_subscript(char const *name, size_t *len, char const **sub, size_t *sublen);
+
+char *var_key(char const *sub, size_t n);
+
+struct var *array_get(char const *name, size_t len, enum var_type type);
+
+char **array_slot(struct var *v, char const *sub, size_t n, int create);
+
+void array_push(struct var *v, char *key, char *val);
+
+void array_unset(struct var *v, char const *sub, size_t n);
+
+void array_clear(struct var *v);
+
+size_t assoc_find(struct var const *v, char const *key);
+
+void assoc_reindex(struct var *v);
+
+char const *array_join(struct var *v, int keys);
+
+size_t array_count(struct var const *v);
+
+size_t splice_name(char const *s, char const *e, int *keys);
+
+size_t expand_args(char const *word, char ***out, size_t *n, size_t *cap);
+
+void vec_push(char ***v, size_t *n, size_t *cap, char *word);
+
+size_t assign_name(char const *word);
+
+int assign_words(size_t nwords);
+
+int assign(char const *word);
+
+int assign_list(char const *name, char const *s, size_t n, int append);
+
+void builtin_declare(char **argv, size_t argc);
+
+void builtin_unset(char **argv, size_t argc);
+
+uint64_t fnv1a(uint64_t h, void const *data, size_t n);
+
+int arith(char const *s, size_t n, int64_t *result);
+
+struct arith *ar_compile(char const *src, size_t n);
+
+int ar_eval(struct arith const *a, int64_t *result);
+
+int ar_lex(char const **s, struct ar_token *t);
+
+int ar_is(struct ar_token const *t, char const *op);
+
+size_t ar_emit(struct arith *a, enum ar_opcode op, int64_t arg);
+
+int64_t ar_name(struct arith *a, struct ar_token const *t);
+
+int ar_prec(struct ar_token const *t, enum ar_opcode *op);
+
+int ar_comma(struct arith *a, char const **s, struct ar_token *t);
+
+int ar_assign(struct arith *a, char const **s, struct ar_token *t);
+
+int ar_binary(struct arith *a, char const **s, struct ar_token *t, int min_prec);
+
+int ar_unary(struct arith *a, char const **s, struct ar_token *t);
+
+int64_t ar_var(char const *name);
+
+void builtin_arith(char **argv, size_t argc);
+
+size_t parse_command(char **w, size_t nwords, char **argv);
+
+int parse_redir(char const *word, struct redir *r);
 
 /* Command processing */
 void builtin_cd(char **argv, size_t argc);
 
 void builtin_exit(char **argv, size_t argc);
 
-void execute_cmds(char **words_argv, size_t words_argc);
+void builtin_memo(char **argv, size_t argc);
 
-void execute_nonbuiltin_cmds(char **argv);
+void builtin_exec(char **argv, size_t argc);
 
-int bg_handler();
+void shell_fds_inherit(int inherit);
 
-int main(int argc, char *argv[])
-{
-smallsh:;
-    FILE *input = stdin;
-    char *input_fn = "(stdin)";
-    if (argc == 2)
-    {
-        input_fn = argv[1];
-        input = fopen(input_fn, "re");
-        if (!input)
-            err(1, "%s", input_fn);
-    }
-    else if (argc > 2)
-    {
-        errx(1, "too many arguments");
-    }
+char *proc_subst(char const *word);
 
-    // Initialize line and n for getline outside the loop
-    char *line = NULL;
-    size_t n = 0;
+void procsub_close();
+
+int procsub_reap(pid_t pid);
+
+void set_status(int status);
+
+int apply_redirections(struct redir const *r, size_t nr);
+
+int shell_fd_move(int fd);
+
+int shell_fd_used(int fd);
+
+int save_fds();
+
+void restore_fds();
+
+pid_t spawn_cmd(char **argv, struct redir const *r, size_t nr);
+
+int spawn_path(pid_t *pid, char **argv, posix_spawn_file_actions_t const *actions, posix_spawnattr_t const *attr);
+
+struct path_cache *path_cache_get();
+
+uint64_t path_cache_key(uint64_t path_hash, char const *name);
+
+int path_cache_find(struct path_cache *c, uint64_t path_hash, char const *name, char *buf);
+
+void path_cache_store(struct path_cache *c, uint64_t path_hash, char const *name, char const *path);
+
+int path_search(char const *name, char *buf, size_t size);
+
+int append_cache_get(char const *path);
+
+void append_cache_evict(size_t i);
+
+void append_cache_shrink(size_t n);
+
+int copy_fd(int in_fd, int out_fd);
+
+int write_all(int fd, char const *buf, size_t n);
+
+void out_write(int fd, char const *s, size_t n);
+
+void out_printf(int fd, char const *fmt, ...);
+
+void out_drain(struct out_buf *b);
+
+void out_flush();
+
+void out_flush_input(int fd);
+
+ssize_t out_stderr_write(void *cookie, char const *buf, size_t n);
+
+void out_init();
+
+void builtin_echo(char **argv, size_t argc);
+
+/* Jobs */
+struct job *job_add(pid_t pid, char **argv);
+
+void job_remove(struct job *j);
+
+struct job *job_find(char const *spec);
+
+void job_done(pid_t pid, int status);
+
+int job_start(struct job *j, char **argv, struct redir const *r, size_t nr);
+
+void job_delay(struct job *j, char **argv, struct redir const *r, size_t nr);
+
+void jobs_admit(size_t max);
+
+void pending_free(struct pending *p);
+
+void jobs_drain();
+
+int64_t jobs_pause(int64_t interval);
+
+int admit_job(struct job *j);
+
+void jobserver_init();
+
+int jobserver_acquire(struct job *j);
+
+void jobserver_release(struct job *j);
+
+double pressure(char const *resource);
+
+int parse_size(char const *s, uint64_t *out);
+
+void limits_current(struct limits *l);
+
+void builtin_limit(char **argv, size_t argc);
+
+void set_limit(int resource, uint64_t value, uint64_t slack);
+
+int spawn_fork(pid_t *pid, char **argv, struct redir const *r, size_t nr,
+               struct limits const *l, char const *cgroup);
+
+int spawn_find(char const *name, char *path, size_t size);
+
+char *cgroup_create(struct job *j);
+
+int cgroup_write(char const *dir, char const *name, char const *value);
+
+int64_t cgroup_read(char const *dir, char const *name, char const *key);
+
+void job_accounting(pid_t pid, char *report, size_t size);
 
-    ppgid = getpgrp();
+void builtin_jobs(char **argv, size_t argc);
 
-    // Initialize $$, $?, and $$
-    sprintf(int_buf, "%d", getpid());
-    setenv("$", int_buf, 1);
-    setenv("?", "0", 1);
-    setenv("!", "", 1);
+void builtin_coproc(char **argv, size_t argc);
+
+void coproc_close(struct job *j);
+
+void coproc_done(struct job *j);
+
+void coproc_unset(struct job *j, int k);
+
+int coproc_forget(int fd);
+
+void coproc_eof(int fd);
+
+void builtin_output(char **argv, size_t argc);
+
+int str_append(char **s, size_t *n, size_t *cap, char const *src, size_t k);
+
+size_t read_options(char **argv, size_t argc, char flag, int *set, int *fd);
+
+int read_line(int fd, char **line, size_t *n, size_t *cap);
+
+int ifs_class(char c, char const *ifs);
+
+void builtin_read(char **argv, size_t argc);
+
+void builtin_mapfile(char **argv, size_t argc);
+
+char *path_parent(char const *path);
+
+ssize_t inotify_wait(int fd, char *buf, size_t size, int timeout);
+
+void builtin_waitfor(char **argv, size_t argc);
+
+void builtin_watch(char **argv, size_t argc);
+
+int fs_builtins_enabled();
+
+int builtin_fs(char **argv, size_t argc);
+
+int fs_error(char const *name, char const *path);
+
+char *path_into(char const *dir, char const *path);
+
+int is_dir(char const *path);
+
+int copy_file(char const *src, char const *dst);
+
+int rm_tree(char const *path);
+
+void *rm_worker(void *arg);
+
+void rm_dir(struct rm_pool *pool, struct rm_task *t);
+
+void rm_finish(struct rm_pool *pool, struct rm_task *t);
+
+void rm_fail(struct rm_pool *pool, char const *path);
+
+int text_builtins_enabled();
+
+int builtin_text(char **argv, size_t argc);
+
+int text_args(struct text_cmd *c, char **argv, size_t argc, size_t *first);
+
+int text_file(struct text_cmd *c, char const *path);
+
+int text_scan(struct text_cmd *c, int fd, size_t (*fn)(struct text_cmd *, char const *, size_t));
+
+size_t count_lines(char const *s, size_t n);
+
+size_t skip_lines(char const *s, size_t n, uint64_t *lines);
+
+size_t tail_start(char const *s, size_t n, uint64_t lines);
+
+size_t text_wc(struct text_cmd *c, char const *s, size_t n);
+
+size_t text_head(struct text_cmd *c, char const *s, size_t n);
+
+size_t text_tail(struct text_cmd *c, char const *s, size_t n);
+
+size_t text_grep(struct text_cmd *c, char const *s, size_t n);
+
+void grep_out(struct text_cmd *c, char const *s, size_t n);
+
+int glob_chars(char const *word);
+
+void glob_args(size_t first, int escaped);
+
+void glob_unescape(char *s);
+
+size_t glob_word(char const *word, char ***out, size_t *n, size_t *cap);
+
+int glob_cmp(void const *a, void const *b);
+
+void glob_push(struct glob_worker *w, char *dir, size_t comp);
+
+int glob_take(struct glob_worker *w, struct glob_task *t);
+
+void *glob_run(void *arg);
+
+void glob_dir(struct glob_worker *w, struct glob_task const *t);
+
+char *glob_join(char const *dir, char const *name, size_t len);
+
+void glob_match(struct glob_worker *w, char *path);
+
+int capture_enabled();
+
+void capture_start(struct job *j, int fds[2]);
+
+int capture_closed(struct job *j);
+
+void *capture_loop(void *arg);
+
+void ring_write(struct ring *r, char const *data, size_t n);
+
+void ring_spill(struct ring *r);
+
+size_t ring_read(struct ring const *r, uint64_t *pos, char *dst, size_t n);
+
+void ring_free(struct ring *r);
+
+int64_t rusage_ns(struct rusage const *ru);
+
+int64_t monotonic_ns();
+
+void profile_start(size_t lineno, char const *line);
+
+void profile_end();
+
+int profile_cmp(void const *a, void const *b);
+
+void profile_write();
+
+void journal_open();
+
+enum journal_action journal_check(size_t lineno, size_t nwords);
+
+void journal_record(size_t lineno, int background);
+
+void journal_wait(pid_t pid);
+
+void journal_sync();
+
+int compile_script(char const *path, char const *out);
+
+void compile_string(FILE *c, char const *s);
+
+size_t compile_word(char *const *w, size_t n, char const *word);
+
+int compile_build(char const *c_path, char const *out);
+
+void compiled_init(int argc, char **argv);
+
+void compiled_begin();
+
+void compiled_cmd(char **argv, size_t argc, int const *r, char **targets, size_t nr, int bg);
+
+void compiled_line(char **w, size_t nwords);
+
+int compiled_end();
+
+void execute_cmds(char **words_argv, size_t words_argc);
+
+void execute_nonbuiltin_cmds(char **argv);
+
+int bg_handler();
+
+char const *shell_pid();
+
+void run_line(size_t nwords);
+
+#ifndef SMALLSH_RUNTIME
+int main(int argc, char *argv[])
+{
+    out_init();
+smallsh:;
+    FILE *input = stdin;
+    char *input_fn = "(stdin)";
+    size_t lineno = 0;
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0)
+    {
+        if (argc != 5 || strcmp(argv[3], "-o") != 0)
+            errx(1, "usage: %s --compile script -o program", argv[0]);
+        return compile_script(argv[2], argv[4]);
+    }
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0)
+    {
+        if (strcmp(argv[1], "--resume") == 0)
+        {
+            journal_resume = 1;
+            argc -= 1;
+            argv += 1;
+            continue;
+        }
+        if (argc < 3 || (strcmp(argv[1], "--profile") != 0 && strcmp(argv[1], "--journal") != 0))
+            errx(1, "%s: unknown option", argv[1]);
+        if (argv[1][2] == 'p')
+            profile_path = argv[2];
+        else
+            journal_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+    if ((profile_path || journal_path) && argc != 2)
+        errx(1, "%s: a script is required", profile_path ? "--profile" : "--journal");
+    if (profile_path && !profile_script)
+    {
+        profile_script = argv[1];
+        atexit(profile_write);
+    }
+    if (journal_resume && !journal_path)
+        errx(1, "--resume: --journal is required");
+    if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        // The string is read as a script
+        input_fn = "-c";
+        input = fmemopen(argv[2], strlen(argv[2]), "r");
+        if (!input)
+            err(1, "-c");
+    }
+    else if (argc == 2)
+    {
+        input_fn = argv[1];
+        input = fopen(input_fn, "re");
+        if (!input)
+            err(1, "%s", input_fn);
+
+        // Move the script out of the way of descriptors opened by exec
+        int fd = fcntl(fileno(input), F_DUPFD_CLOEXEC, SHELL_FD_MAX + 1);
+        FILE *moved = fd < 0 ? NULL : fdopen(fd, "re");
+        if (moved)
+        {
+            fclose(input);
+            input = moved;
+        }
+        else if (fd >= 0)
+            close(fd);
+    }
+    else if (argc > 2)
+    {
+        errx(1, "too many arguments");
+    }
+    if (journal_path && journal_fd < 0)
+        journal_open();
+
+    // Initialize line and n for getline outside the loop. Everything else,
+    // from $$ to the caches, is set up on first use.
+    char *line = NULL;
+    size_t n = 0;
+    interactive = input == stdin;
+
+    for (;;)
+    {
+        // Setup signal handler, in interactive mode
+        if (interactive)
+        {
+            SIGTSTP_setup();
+            SIGINT_setup();
+        }
+
+    /* Input */
+    prompt:;
+
+        // Manage background process
+        if (bg_handler())
+            errx(1, "bg_handler");
+
+        // Input is stdin: Interactive mode -> Print prompt, and show all output before waiting
+        if (input == stdin)
+        {
+            print_prompt();
+            out_flush();
+        }
+
+        // Otherwise, read from a file: Non-interactive mode
+
+        // Read a line from input
+        ssize_t line_len = getline(&line, &n, input);
+        if (line_len < 0)
+        {
+            // Handle EOF, once delayed background jobs have started
+            if (feof(input))
+            {
+                jobs_drain();
+                return 0;
+            }
+            // Handle EINTR
+            if (errno == EINTR)
+            {
+                clearerr(stdin);
+                goto smallsh;
+            }
+            err(1, "getline %s", input_fn);
+        }
+
+        // Done reading, set SIGINT to SIG_IGN
+        if (interactive)
+        {
+            SIGINT_action.sa_handler = SIG_IGN;
+            sigaction(SIGINT, &SIGINT_action, NULL);
+        }
+
+        /* Word Splitting */
+        ++lineno;
+        if (journal_fd >= 0)
+            journal_hash = fnv1a(journal_hash, line, line_len);
+        size_t nwords = wordsplit(line);
+        if (nwords == 0)
+            goto prompt;
+        if (profile_path)
+            profile_start(lineno, line);
+
+        enum journal_action action = journal_fd >= 0 ? journal_check(lineno, nwords) : JOURNAL_RUN;
+        // A background line has not completed when run_line returns
+        int background = strcmp(words[nwords - 1], "&") == 0;
+        journal_replaying = action == JOURNAL_REPLAY;
+        if (action != JOURNAL_SKIP)
+            run_line(nwords);
+        journal_replaying = 0;
+        if (action == JOURNAL_RUN && journal_fd >= 0)
+            journal_record(lineno, background);
+        if (profile_path)
+            profile_end();
+
+        // Clean up
+        for (size_t i = 0; i < nwords; ++i)
+        {
+            free(words[i]);
+            free(word_pats[i]);
+            words[i] = word_pats[i] = 0;
+        }
+    }
+}
+#endif
+
+/*
+ * Value of $$, the process ID, set in the environment on first use. A $
+ * inherited from a parent shell is overwritten.
+ */
+char const *shell_pid()
+{
+    static char pid[21];
+    if (pid[0])
+        return pid;
+    snprintf(pid, sizeof pid, "%jd", (intmax_t)getpid());
+    if (setenv("$", pid, 1) < 0)
+        err(1, "setenv");
+    return pid;
+}
+
+/*
+ * Run the nwords words of a line split into words[]: perform its
+ * assignments, or expand, parse and execute it as a command
+ */
+void run_line(size_t nwords)
+{
+    /* Assignments */
+    if (assign_words(nwords))
+        return;
+
+    /* Expansion */
+    nargs = 0;
+    for (size_t i = 0; i < nwords; ++i)
+    {
+        char *exp_word = proc_subst(words[i]);
+        if (exp_word)
+            vec_push(&args, &nargs, &args_cap, exp_word);
+        else
+        {
+            // Words of a ((...)) command and file names of redirections are not globbed.
+            // Others are expanded with their escaped pattern characters kept.
+            struct redir r[2];
+            size_t first = nargs;
+            int glob = strncmp(words[i], "((", 2) != 0 &&
+                       !(i > 0 && parse_redir(words[i - 1], r) > 0 && r[0].op < REDIR_DUP);
+            expand_args(glob && word_pats[i] ? word_pats[i] : words[i], &args, &nargs, &args_cap);
+            if (glob)
+                glob_args(first, word_pats[i] != NULL);
+        }
+    }
+
+    /* Parsing */
+    char **words_argv = malloc(sizeof(*args) * (nargs + 1));
+    if (!words_argv)
+        err(1, "malloc");
+    size_t words_argc = parse_command(args, nargs, words_argv);
+
+    /* Execution */
+    execute_cmds(words_argv, words_argc);
+    procsub_close();
+    free(words_argv);
+    for (size_t i = 0; i < nargs; ++i)
+        free(args[i]);
+}
+
+/*
+ * Setup SIGTSTP signal handler:
+ * Store default SIGTSTP action in SIGTSTP_default
+ * Set SIGTSTP action to SIG_IGN
+ */
+void SIGTSTP_setup()
+{
+    sigaction(SIGTSTP, NULL, &SIGTSTP_default);
+
+    SIGTSTP_action.sa_handler = SIG_IGN;
+    sigfillset(&SIGTSTP_action.sa_mask);
+    sigaction(SIGTSTP, &SIGTSTP_action, &SIGTSTP_default);
+}
+
+/*
+ * Setup SIGINT signal handler:
+ * Store default SIGINT action in SIGINT_default
+ * Set SIGINT action to SIGINT_handler
+ */
+void SIGINT_setup()
+{
+    // Save default SIGINT action
+    sigaction(SIGINT, NULL, &SIGINT_default);
+    // Add new SIGINT handler
+    SIGINT_action.sa_handler = SIGINT_handler;
+    sigfillset(&SIGINT_action.sa_mask);
+    sigaction(SIGINT, &SIGINT_action, &SIGINT_default);
+}
+
+/*
+ * SIGINT_handler:
+ * Print a new line to stderr
+ */
+void SIGINT_handler(int signo)
+{
+    fprintf(stderr, "\n");
+}
+
+/*
+ * Print prompt: ps1
+ */
+void print_prompt()
+{
+    char *ps1 = getenv("PS1");
+    if (!ps1)
+        ps1 = "";
+    fprintf(stderr, "%s", ps1);
+}
+
+char *words[MAX_WORDS] = {0};
+
+/* Splits a string into words delimited by whitespace. Recognizes
+ * comments as '#' at the beginning of a word, and backslash escapes.
+ * Whitespace inside ${...}, $((...)), a ((...)) command, a <(...) or
+ * >(...) process substitution and the list of an array assignment
+ * name=(...) does not end a word.
+ *
+ * Returns number of words parsed, and updates the words[] array
+ * with pointers to the words, each as an allocated string.
+ */
+size_t wordsplit(char const *line)
+{
+    return wordsplit_pats(line, words, word_pats, MAX_WORDS);
+}
+
+/*
+ * wordsplit into the array out of max words
+ */
+size_t wordsplit_into(char const *line, char **out, size_t max)
+{
+    return wordsplit_pats(line, out, NULL, max);
+}
+
+/*
+ * wordsplit into the array out of max words. Unless pats is NULL, pats[i]
+ * is set to word i with a \ kept before each escaped *, ?, [, ] or \, for
+ * pathname expansion, or to NULL if it has none.
+ */
+size_t wordsplit_pats(char const *line, char **out, char **pats, size_t max)
+{
+    size_t wlen = 0, plen = 0;
+    size_t wind = 0;
+    char *pat = NULL;
+    int escapes = 0;
+
+    char const *c = line;
+    for (; *c && isspace(*c); ++c)
+        ; /* discard leading space */
+
+    for (; *c;)
+    {
+        if (wind == max)
+            break;
+        /* read a word */
+        if (*c == '#')
+            break;
+        int brace = 0, paren = 0;
+        for (; *c && (brace || paren || !isspace(*c)); ++c)
+        {
+            int escaped = 0;
+            if (*c == '\\' && c[1])
+            {
+                ++c;
+                escaped = strchr("*?[]\\", *c) != NULL;
+            }
+            else if (c[0] == '$' && c[1] == '{')
+                brace = 1;
+            else if (*c == '}')
+                brace = 0;
+            else if (paren && (*c == '(' || *c == ')'))
+                paren += *c == '(' ? 1 : -1;
+            else if (c[0] == '(' && c[1] == '(' && (wlen == 0 || c[-1] == '$'))
+                paren = 1;
+            else if (*c == '(' && wlen == 1 && (out[wind][0] == '<' || out[wind][0] == '>'))
+                paren = 1;
+            else if (*c == '(' && wlen > 0 && out[wind][wlen - 1] == '=' && assign_name(out[wind]))
+                paren = 1;
+            void *tmp = realloc(out[wind], sizeof **out * (wlen + 2));
+            if (!tmp)
+                err(1, "realloc");
+            out[wind] = tmp;
+            out[wind][wlen++] = *c;
+            out[wind][wlen] = '\0';
+            if (pats)
+            {
+                tmp = realloc(pat, plen + 3);
+                if (!tmp)
+                    err(1, "realloc");
+                pat = tmp;
+                if (escaped)
+                    pat[plen++] = '\\';
+                pat[plen++] = *c;
+                pat[plen] = '\0';
+                escapes |= escaped;
+            }
+        }
+        if (pats)
+        {
+            pats[wind] = escapes ? pat : NULL;
+            if (!escapes)
+                free(pat);
+            pat = NULL;
+            plen = 0;
+            escapes = 0;
+        }
+        ++wind;
+        wlen = 0;
+        for (; *c && isspace(*c); ++c)
+            ;
+    }
+    return wind;
+}
+
+/* Find next instance of a parameter within a word. Sets
+ * start and end pointers to the start and end of the parameter
+ * token.
+ */
+char param_scan(char const *word, char const **start, char const **end)
+{
+    static char const *prev;
+    if (!word)
+        word = prev;
+
+    char ret = 0;
+    *start = 0;
+    *end = 0;
+    for (char const *s = word; *s && !ret; ++s)
+    {
+        s = strchr(s, '$');
+        if (!s)
+            break;
+        switch (s[1])
+        {
+        case '$':
+        case '!':
+        case '?':
+            ret = s[1];
+            *start = s;
+            *end = s + 2;
+            break;
+        case '{':;
+            char *e = strchr(s + 2, '}');
+            if (e)
+            {
+                ret = s[1];
+                *start = s;
+                *end = e + 1;
+            }
+            break;
+        case '(':
+            // $((...)), up to the )) matching its parentheses
+            if (s[2] != '(')
+                break;
+            int depth = 0;
+            for (char const *p = s + 3; *p; ++p)
+            {
+                if (*p == '(')
+                    ++depth;
+                else if (*p == ')' && depth > 0)
+                    --depth;
+                else if (*p == ')' && p[1] == ')')
+                {
+                    ret = s[1];
+                    *start = s;
+                    *end = p + 2;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    prev = *end;
+    return ret;
+}
+
+/* Simple string-builder function. Builds up a base
+ * string by appending supplied strings/character ranges
+ * to it.
+ */
+char *build_str(char const *start, char const *end)
+{
+    static size_t base_len = 0;
+    static size_t base_cap = 0;
+    static char *base = 0;
+
+    if (!start)
+    {
+        /* Reset; new base string, return old one */
+        char *ret = base;
+        base = NULL;
+        base_len = 0;
+        base_cap = 0;
+        return ret;
+    }
+    /* Append [start, end) to base string
+     * If end is NULL, append whole start string to base string.
+     * Returns a newly allocated string that the caller must free.
+     * The string grows geometrically, so a word built from many pieces
+     * is copied a constant number of times on average.
+     */
+    size_t n = end ? end - start : strlen(start);
+    if (base_len + n + 1 > base_cap)
+    {
+        size_t cap = base_cap ? base_cap : 32;
+        while (cap < base_len + n + 1)
+            cap *= 2;
+        void *tmp = realloc(base, sizeof *base * cap);
+        if (!tmp)
+            err(1, "realloc");
+        base = tmp;
+        base_cap = cap;
+    }
+    memcpy(base + base_len, start, n);
+    base_len += n;
+    base[base_len] = '\0';
+
+    return base;
+}
+
+/* Expands all instances of $! $$ $? ${param} and $((expression)) in a
+ * string, including the ${param} operators handled by expand_brace.
+ * Returns a newly allocated string that the caller must free
+ */
+char *expand(char const *word)
+{
+    char const *pos = word;
+    char const *start, *end;
+    char c = param_scan(pos, &start, &end);
+    build_str(NULL, NULL);
+    build_str(pos, start);
+
+    while (c)
+    {
+        switch (c)
+        {
+        case '$':
+        {
+            // Process ID
+            build_str(shell_pid(), NULL);
+            break;
+        }
+        case '!':
+        {
+            // Background PID most recent bg process, default "" if no background process ID available
+            char *pid = getenv("!");
+            if (!pid)
+                build_str("", NULL);
+            else
+                build_str(pid, NULL);
+            break;
+        }
+
+        case '?':
+        {
+            // Exit status of the last fg command, 0 by default
+            char *status = getenv("?");
+            if (!status)
+                build_str("0", NULL);
+            else
+                build_str(status, NULL);
+            break;
+        }
+
+        case '{':
+        {
+            // Parameter, with an optional operator
+            expand_brace(start + 2, end - 1);
+            break;
+        }
+
+        case '(':
+        {
+            // Arithmetic expansion
+            int64_t value;
+            if (arith(start + 3, end - start - 5, &value) == 0)
+            {
+                char num[21];
+                snprintf(num, sizeof num, "%" PRId64, value);
+                build_str(num, NULL);
+            }
+            break;
+        }
+        }
+        pos = end;
+        c = param_scan(pos, &start, &end);
+        build_str(pos, start);
+    }
+    return build_str(start, NULL);
+}
+
+/*
+ * Length of the name of a ${name[@]} or ${!name[@]} parameter with contents
+ * [s, e), which splice the elements or keys (setting *keys) of an array
+ * into separate words; 0 for other parameters.
+ */
+size_t splice_name(char const *s, char const *e, int *keys)
+{
+    *keys = s < e && *s == '!';
+    s += *keys;
+    char const *p = s;
+    while (p < e && (isalnum((unsigned char)*p) || *p == '_'))
+        ++p;
+    return p > s && e - p == 3 && memcmp(p, "[@]", 3) == 0 ? (size_t)(p - s) : 0;
+}
+
+/*
+ * Expand word into one or more words, appended to the vector *out of *n
+ * words and *cap allocated. Each ${name[@]} stands for the elements of an
+ * array as separate words, the first joined to the text before it and the
+ * last to the text after it; an empty array alone expands to no word.
+ * Returns the number of words added.
+ */
+size_t expand_args(char const *word, char ***out, size_t *n, size_t *cap)
+{
+    if (!strstr(word, "[@]}"))
+    {
+        vec_push(out, n, cap, expand(word));
+        return 1;
+    }
+
+    size_t first = *n, len = 0, ccap = 0;
+    char *cur = NULL;
+    int text = 0, spliced = 0;
+    char const *pos = word, *start, *end;
+    for (;;)
+    {
+        int keys = 0;
+        size_t nl = 0;
+        char c = param_scan(pos, &start, &end);
+        while (c && !(c == '{' && (nl = splice_name(start + 2, end - 1, &keys))))
+            c = param_scan(end, &start, &end);
+
+        // The text up to the splice, or the rest of the word, expands as usual
+        char *piece = strndup(pos, c ? (size_t)(start - pos) : strlen(pos));
+        if (!piece)
+            err(1, "strndup");
+        char *exp = expand(piece);
+        free(piece);
+        text |= *exp != '\0';
+        if (str_append(&cur, &len, &ccap, exp, strlen(exp)) < 0)
+            err(1, "realloc");
+        free(exp);
+        if (!c)
+            break;
+
+        spliced = 1;
+        char const *name = start + 2 + keys;
+        struct var *v = nvars ? var_find(name, nl, 0) : NULL;
+        size_t count = 0;
+        for (size_t i = 0; v && v->type != VAR_SCALAR && i < v->n; ++i)
+        {
+            char num[21];
+            char const *el = v->vals[i];
+            if (!el)
+                continue;
+            if (keys && v->type == VAR_ASSOC)
+                el = v->keys[i];
+            else if (keys)
+            {
+                snprintf(num, sizeof num, "%zu", i);
+                el = num;
+            }
+            if (count++ > 0)
+            {
+                vec_push(out, n, cap, cur);
+                cur = NULL;
+                len = ccap = 0;
+            }
+            if (str_append(&cur, &len, &ccap, el, strlen(el)) < 0)
+                err(1, "realloc");
+            text = 1;
+        }
+        if (!v || v->type == VAR_SCALAR)
+        {
+            // A set scalar is an array of one element
+            char *scalar = strndup(name, nl);
+            if (!scalar)
+                err(1, "strndup");
+            char const *val = getenv(scalar);
+            free(scalar);
+            if (val)
+            {
+                val = keys ? "0" : val;
+                if (str_append(&cur, &len, &ccap, val, strlen(val)) < 0)
+                    err(1, "realloc");
+                text = 1;
+            }
+        }
+        pos = end;
+    }
+
+    if (text || !spliced)
+        vec_push(out, n, cap, cur ? cur : strdup(""));
+    else
+        free(cur);
+    return *n - first;
+}
+
+/*
+ * Append word to the vector *v of *n words and *cap allocated, growing it
+ * geometrically. A NULL word means the allocation of the word failed.
+ */
+void vec_push(char ***v, size_t *n, size_t *cap, char *word)
+{
+    if (!word)
+        err(1, "malloc");
+    if (*n == *cap)
+    {
+        *cap = *cap ? *cap * 2 : MAX_WORDS;
+        *v = realloc(*v, sizeof **v * *cap);
+        if (!*v)
+            err(1, "realloc");
+    }
+    (*v)[(*n)++] = word;
+}
+
+/*
+ * Length of the variable name, or array element name[sub], assigned to by
+ * word if it is an assignment word name=value or name+=value, or 0
+ */
+size_t assign_name(char const *word)
+{
+    char const *p = word;
+    if (!isalpha((unsigned char)*p) && *p != '_')
+        return 0;
+    while (isalnum((unsigned char)*p) || *p == '_')
+        ++p;
+    if (*p == '[')
+    {
+        char const *close = strchr(p, ']');
+        if (!close || close == p + 1)
+            return 0;
+        p = close + 1;
+    }
+    size_t len = p - word;
+    if (*p == '+')
+        ++p;
+    return *p == '=' ? len : 0;
+}
+
+/*
+ * If every one of the nwords words of the line is an assignment word,
+ * perform the assignments in order, set $?, and return 1. Otherwise the
+ * words are a command: return 0.
+ */
+int assign_words(size_t nwords)
+{
+    int status = 0;
+    for (size_t i = 0; i < nwords; ++i)
+        if (!assign_name(words[i]))
+            return 0;
+    for (size_t i = 0; i < nwords; ++i)
+        if (assign(words[i]) < 0)
+            status = 1;
+    set_status(status);
+    return 1;
+}
+
+/*
+ * Perform the assignment word: name=value, name+=value, and for arrays
+ * name[sub]=value, name=(value...) and name+=(value...). The value is
+ * expanded. Returns 0, or -1 after printing a message.
+ */
+int assign(char const *word)
+{
+    size_t len = assign_name(word);
+    int append = word[len] == '+';
+    char const *value = word + len + 1 + append;
+    size_t vlen = strlen(value);
+    char *name = strndup(word, len);
+    int rc;
+    if (!name)
+        err(1, "strndup");
+    if (vlen >= 2 && value[0] == '(' && value[vlen - 1] == ')')
+    {
+        if (strchr(name, '['))
+        {
+            fprintf(stderr, "smallsh: %s: cannot assign a list to an array element\n", name);
+            rc = -1;
+        }
+        else
+            rc = assign_list(name, value + 1, vlen - 2, append);
+    }
+    else
+    {
+        char *exp = expand(value);
+        rc = var_store(name, exp, strlen(exp), append);
+        free(exp);
+    }
+    free(name);
+    return rc;
+}
+
+/*
+ * Assign the list [s, s + n) to array name, or with append add it to the
+ * array. Each word of the list is an element, or [sub]=value to set an
+ * element; ${name[@]} in it splices an array. An associative array must
+ * be declared first, with declare -A. Returns 0, or -1 after printing a
+ * message.
+ */
+int assign_list(char const *name, char const *s, size_t n, int append)
+{
+    char *list = strndup(s, n);
+    char *sub[MAX_WORDS] = {0};
+    char **vals = NULL, **subs = NULL;
+    size_t nvals = 0, vals_cap = 0, nsubs = 0, subs_cap = 0;
+    int rc = 0;
+    if (!list)
+        err(1, "strndup");
+    size_t nsub = wordsplit_into(list, sub, MAX_WORDS);
+    free(list);
+
+    // Expand the whole list before assigning, so it can refer to the array
+    for (size_t i = 0; i < nsub; ++i)
+    {
+        char const *close = sub[i][0] == '[' ? strstr(sub[i], "]=") : NULL;
+        if (close && close > sub[i] + 1)
+        {
+            vec_push(&subs, &nsubs, &subs_cap, strndup(sub[i] + 1, close - sub[i] - 1));
+            vec_push(&vals, &nvals, &vals_cap, expand(close + 2));
+        }
+        else
+        {
+            size_t added = expand_args(sub[i], &vals, &nvals, &vals_cap);
+            for (size_t k = 0; k < added; ++k)
+                vec_push(&subs, &nsubs, &subs_cap, strdup(""));
+        }
+        free(sub[i]);
+    }
+
+    size_t len = strlen(name);
+    struct var *v = nvars ? var_find(name, len, 0) : NULL;
+    v = array_get(name, len, v && v->type == VAR_ASSOC ? VAR_ASSOC : VAR_ARRAY);
+    if (!append)
+        array_clear(v);
+    for (size_t i = 0; i < nvals; ++i)
+    {
+        char **slot = NULL;
+        if (*subs[i])
+            slot = array_slot(v, subs[i], strlen(subs[i]), 1);
+        else if (v->type == VAR_ASSOC)
+            fprintf(stderr, "smallsh: %s: %s: a subscript is required for an associative array\n",
+                    name, vals[i]);
+        else
+        {
+            array_push(v, NULL, NULL);
+            slot = &v->vals[v->n - 1];
+        }
+        if (slot)
+        {
+            free(*slot);
+            *slot = vals[i];
+            v->sizes[slot - v->vals].cap = 0;
+        }
+        else
+        {
+            free(vals[i]);
+            rc = -1;
+        }
+        free(subs[i]);
+    }
+    free(vals);
+    free(subs);
+    return rc;
+}
+
+/*
+ * Recognize a redirection operator word: [n]<, [n]>, [n]>>, [n]<&m, [n]>&m,
+ * [n]<&-, [n]>&-, &> and &>>. Fills in r and returns the number of
+ * redirections it stands for (&> is a redirection of stdout followed by
+ * 2>&1), or 0 if word is not a redirection operator. Operators that open a
+ * file take their file name from the following word.
+ */
+int parse_redir(char const *word, struct redir *r)
+{
+    char const *s = word;
+    int fd = -1;
+
+    if (s[0] == '&' && s[1] == '>')
+    {
+        // &> file, &>> file
+        if (parse_redir(s + 1, r) != 1 || r->op == REDIR_DUP || r->op == REDIR_CLOSE)
+            return 0;
+        r[1] = (struct redir){.fd = STDERR_FILENO, .op = REDIR_DUP, .src = STDOUT_FILENO};
+        return 2;
+    }
+
+    if (isdigit((unsigned char)*s))
+    {
+        for (fd = 0; isdigit((unsigned char)*s) && fd < 1024; ++s)
+            fd = fd * 10 + (*s - '0');
+    }
+
+    *r = (struct redir){0};
+    switch (*s++)
+    {
+    case '<':
+        r->fd = fd < 0 ? STDIN_FILENO : fd;
+        r->op = REDIR_IN;
+        break;
+    case '>':
+        r->fd = fd < 0 ? STDOUT_FILENO : fd;
+        r->op = REDIR_OUT;
+        if (*s == '>')
+        {
+            r->op = REDIR_APPEND;
+            ++s;
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    if (*s == '\0')
+        return 1;
+    if (*s != '&' || r->op == REDIR_APPEND)
+        return 0;
+
+    // Duplicate or close: [n]>&m, [n]<&m, [n]>&-, [n]<&-
+    ++s;
+    if (s[0] == '-' && s[1] == '\0')
+    {
+        r->op = REDIR_CLOSE;
+        return 1;
+    }
+    if (!isdigit((unsigned char)*s))
+        return 0;
+    for (r->src = 0; isdigit((unsigned char)*s) && r->src < 1024; ++s)
+        r->src = r->src * 10 + (*s - '0');
+    if (*s != '\0')
+        return 0;
+    r->op = REDIR_DUP;
+    return 1;
+}
+
+/*
+ * Expand the contents [s, e) of a ${...} parameter: ${name}, ${#name},
+ * ${name:-word}, ${name:=word}, ${name:+word}, ${name#pat}, ${name##pat},
+ * ${name%pat}, ${name%%pat}, ${name/pat/rep}, ${name//pat/rep} and
+ * ${name:off[:len]}. name may be an array element name[sub]; ${#name[@]}
+ * is the number of elements of an array and ${!name[@]} its keys. The
+ * result is appended with build_str.
+ */
+void expand_brace(char const *s, char const *e)
+{
+    char const *n = s;
+    int length = 0, keys;
+    size_t nl = splice_name(s, e, &keys);
+
+    if (keys && nl)
+    {
+        // ${!name[@]}: the keys of an array, joined by spaces
+        struct var *v = nvars ? var_find(s + 1, nl, 0) : NULL;
+        if (v && v->type != VAR_SCALAR)
+            build_str(array_join(v, 1), NULL);
+        return;
+    }
+    if (*n == '#' && n + 1 < e)
+    {
+        // ${#name}
+        length = 1;
+        ++n;
+    }
+    char const *op = n;
+    while (op < e && (isalnum((unsigned char)*op) || *op == '_'))
+        ++op;
+    if (op > n && op < e && *op == '[' && memchr(op, ']', e - op))
+        op = (char const *)memchr(op, ']', e - op) + 1;
+    if (op == n && op < e && strchr("$?!", *op))
+        ++op;
+
+    if (op == n || (op < e && (length || !strchr(":#%/", *op))))
+    {
+        // Not an operator: the whole of ${...} names the parameter
+        char *name = strndup(s, e - s);
+        if (!name)
+            err(1, "strndup");
+        char const *val = var_get(name);
+        if (val)
+            build_str(val, NULL);
+        free(name);
+        return;
+    }
+
+    if (length && op == e && (nl = splice_name(n, e, &keys)) > 0 && !keys)
+    {
+        // ${#name[@]}: the number of elements
+        struct var *v = nvars ? var_find(n, nl, 0) : NULL;
+        char *scalar = strndup(n, nl);
+        char num[21];
+        if (!scalar)
+            err(1, "strndup");
+        snprintf(num, sizeof num, "%zu", v && v->type != VAR_SCALAR ? array_count(v) : getenv(scalar) != NULL);
+        build_str(num, NULL);
+        free(scalar);
+        return;
+    }
+
+    char *name = strndup(n, op - n);
+    if (!name)
+        err(1, "strndup");
+    char const *val = var_get(name);
+    size_t len = val ? strlen(val) : 0;
+
+    if (length)
+    {
+        char num[21];
+        snprintf(num, sizeof num, "%zu", len);
+        build_str(num, NULL);
+    }
+    else if (op == e)
+    {
+        if (val)
+            build_str(val, NULL);
+    }
+    else if (op[0] == ':' && op + 1 < e && strchr("-=+", op[1]))
+    {
+        // Default, assign or alternative value, for unset or empty name.
+        // The word is expanded only when it is used.
+        if (op[1] == '+' ? len > 0 : len == 0)
+        {
+            char *value = expand_range(op + 2, e);
+            if (op[1] == '=')
+                var_set(name, value);
+            build_str(value, NULL);
+            free(value);
+        }
+        else if (op[1] != '+')
+            build_str(val, NULL);
+    }
+    else if (op[0] == ':')
+    {
+        // Substring: ${name:off} or ${name:off:len}, negative from the end
+        char *p;
+        long off = strtol(op + 1, &p, 10);
+        long cnt = (long)len;
+        if (off < 0)
+            off = (long)len + off < 0 ? 0 : (long)len + off;
+        if (off > (long)len)
+            off = len;
+        if (p < e && *p == ':')
+        {
+            cnt = strtol(p + 1, NULL, 10);
+            if (cnt < 0)
+                cnt = (long)len + cnt - off;
+        }
+        if (cnt > (long)len - off)
+            cnt = (long)len - off;
+        if (cnt > 0)
+            build_str(val + off, val + off + cnt);
+    }
+    else if (op[0] == '#' || op[0] == '%')
+    {
+        // Remove the shortest or (doubled operator) longest matching prefix or suffix
+        int longest = op + 1 < e && op[1] == op[0];
+        char const *ps = op + 1 + longest;
+        struct pattern const *pat = pat_compile(ps, e - ps);
+        size_t cut = 0;
+        for (size_t i = 0; i <= len; ++i)
+        {
+            size_t k = longest ? len - i : i;
+            if (op[0] == '#' ? pat_match(pat, val, k) : pat_match(pat, val + len - k, k))
+            {
+                cut = k;
+                break;
+            }
+        }
+        if (len > 0)
+        {
+            if (op[0] == '#')
+                build_str(val + cut, val + len);
+            else
+                build_str(val, val + len - cut);
+        }
+    }
+    else
+    {
+        // Replace the first or (with //) every longest match of pat with rep
+        int all = op + 1 < e && op[1] == '/';
+        char const *ps = op + 1 + all;
+        char const *pe = ps;
+        while (pe < e && *pe != '/')
+            ++pe;
+        char const *rep = pe < e ? pe + 1 : e;
+        struct pattern const *pat = pat_compile(ps, pe - ps);
+        size_t i = 0;
+        while (i < len && pat->ntok > 0)
+        {
+            // Longest non-empty match starting at i
+            size_t k = pat_match_longest(pat, val + i, len - i);
+            if (k == 0)
+            {
+                // No match here
+                build_str(val + i, val + i + 1);
+                ++i;
+                continue;
+            }
+            build_str(rep, e);
+            i += k;
+            if (!all)
+                break;
+        }
+        if (i < len)
+            build_str(val + i, val + len);
+    }
+    free(name);
+}
+
+/*
+ * Expand [s, e), a word inside ${...}, on its own, keeping the string being
+ * built with build_str. Returns a newly allocated string.
+ */
+char *expand_range(char const *s, char const *e)
+{
+    char *word = strndup(s, e - s);
+    if (!word)
+        err(1, "strndup");
+    if (!strchr(word, '$'))
+        return word;
+    char *saved = build_str(NULL, NULL);
+    char *value = expand(word);
+    build_str(NULL, NULL);
+    if (saved)
+        build_str(saved, NULL);
+    free(saved);
+    free(word);
+    return value;
+}
+
+/*
+ * Compile the glob pattern [src, src + n) with *, ? and [...] bracket
+ * expressions, and \ to quote a character. Compiled patterns are kept in
+ * a small cache keyed by their text, so a pattern used on every line of a
+ * script is compiled once.
+ */
+struct pattern const *pat_compile(char const *src, size_t n)
+{
+    for (size_t i = 0; i < PAT_CACHE_SIZE; ++i)
+    {
+        struct pattern *p = &pat_cache[i];
+        if (p->src && p->len == n && memcmp(p->src, src, n) == 0)
+            return p;
+    }
+
+    struct pattern *p = &pat_cache[pat_cache_next];
+    pat_cache_next = (pat_cache_next + 1) % PAT_CACHE_SIZE;
+    free(p->src);
+    free(p->tok);
+    pat_build(p, src, n);
+    return p;
+}
+
+/*
+ * Compile the pattern [src, src + n) into p, outside the cache
+ */
+void pat_build(struct pattern *p, char const *src, size_t n)
+{
+    p->src = strndup(src, n);
+    p->tok = malloc(sizeof *p->tok * (n + 1));
+    if (!p->src || !p->tok)
+        err(1, "malloc");
+    p->len = n;
+    p->ntok = 0;
+    p->literal = 1;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct pat_tok *t = &p->tok[p->ntok];
+        *t = (struct pat_tok){.type = PAT_CHAR, .c = src[i]};
+        if (src[i] == '\\' && i + 1 < n)
+            t->c = src[++i];
+        else if (src[i] == '?')
+            t->type = PAT_ANY;
+        else if (src[i] == '*')
+        {
+            if (p->ntok > 0 && t[-1].type == PAT_STAR)
+                continue;
+            t->type = PAT_STAR;
+        }
+        else if (src[i] == '[')
+        {
+            // Bracket expression, or a literal [ if it is not closed
+            size_t j = i + 1;
+            int negate = j < n && (src[j] == '!' || src[j] == '^');
+            j += negate;
+            size_t first = j;
+            while (j < n && (src[j] != ']' || j == first))
+                ++j;
+            if (j < n)
+            {
+                t->type = PAT_SET;
+                for (size_t k = first; k < j; ++k)
+                {
+                    unsigned char lo = src[k], hi = lo;
+                    if (k + 2 < j && src[k + 1] == '-')
+                    {
+                        hi = src[k + 2];
+                        k += 2;
+                    }
+                    for (unsigned c = lo; c <= hi; ++c)
+                        t->set[c / 8] |= 1 << (c % 8);
+                }
+                if (negate)
+                    for (size_t k = 0; k < sizeof t->set; ++k)
+                        t->set[k] = ~t->set[k];
+                i = j;
+            }
+        }
+        if (t->type != PAT_CHAR)
+            p->literal = 0;
+        ++p->ntok;
+    }
+}
+
+/*
+ * Whether compiled pattern p matches all of [s, s + n)
+ */
+int pat_match(struct pattern const *p, char const *s, size_t n)
+{
+    if (p->literal)
+    {
+        if (n != p->ntok)
+            return 0;
+        for (size_t i = 0; i < n; ++i)
+            if (p->tok[i].c != (unsigned char)s[i])
+                return 0;
+        return 1;
+    }
+
+    // Backtrack to the most recent * on a mismatch
+    size_t ti = 0, si = 0, star = (size_t)-1, star_si = 0;
+    while (si < n)
+    {
+        struct pat_tok const *t = ti < p->ntok ? &p->tok[ti] : NULL;
+        unsigned char c = s[si];
+        if (t && t->type == PAT_STAR)
+        {
+            star = ti++;
+            star_si = si;
+        }
+        else if (t && (t->type == PAT_ANY || (t->type == PAT_CHAR && t->c == c) ||
+                       (t->type == PAT_SET && (t->set[c / 8] >> (c % 8) & 1))))
+        {
+            ++ti;
+            ++si;
+        }
+        else if (star != (size_t)-1)
+        {
+            ti = star + 1;
+            si = ++star_si;
+        }
+        else
+            return 0;
+    }
+    while (ti < p->ntok && p->tok[ti].type == PAT_STAR)
+        ++ti;
+    return ti == p->ntok;
+}
+
+/*
+ * Length of the longest non-empty prefix of [s, s + n) that compiled
+ * pattern p matches, or 0 if there is none. The pattern is run once over
+ * s, as the set of its token positions reachable after each character.
+ */
+size_t pat_match_longest(struct pattern const *p, char const *s, size_t n)
+{
+    if (p->literal)
+        return p->ntok > 0 && p->ntok <= n && pat_match(p, s, p->ntok) ? p->ntok : 0;
+
+    static unsigned char *states = NULL;
+    static size_t states_cap = 0;
+    size_t m = p->ntok + 1;
+    if (2 * m > states_cap)
+    {
+        states_cap = 2 * m;
+        free(states);
+        if (!(states = malloc(states_cap)))
+            err(1, "malloc");
+    }
+
+    // cur[ti]: the first ti tokens match the characters read so far. A *
+    // also matches nothing, so reaching it reaches the token after it.
+    unsigned char *cur = states, *next = states + m;
+    size_t best = 0;
+    memset(cur, 0, m);
+    cur[0] = 1;
+    for (size_t ti = 0; ti < p->ntok; ++ti)
+        if (cur[ti] && p->tok[ti].type == PAT_STAR)
+            cur[ti + 1] = 1;
+    for (size_t si = 0; si < n; ++si)
+    {
+        unsigned char c = s[si];
+        int alive = 0;
+        memset(next, 0, m);
+        for (size_t ti = 0; ti < p->ntok; ++ti)
+        {
+            struct pat_tok const *t = &p->tok[ti];
+            if (!cur[ti])
+                continue;
+            if (t->type == PAT_STAR)
+                alive = next[ti] = 1;
+            else if (t->type == PAT_ANY || (t->type == PAT_CHAR && t->c == c) ||
+                     (t->type == PAT_SET && (t->set[c / 8] >> (c % 8) & 1)))
+                alive = next[ti + 1] = 1;
+        }
+        if (!alive)
+            break;
+        for (size_t ti = 0; ti < p->ntok; ++ti)
+            if (next[ti] && p->tok[ti].type == PAT_STAR)
+                next[ti + 1] = 1;
+        unsigned char *tmp = cur;
+        cur = next;
+        next = tmp;
+        if (cur[p->ntok])
+            best = si + 1;
+    }
+    return best;
+}
+
+/*
+ * Value of shell parameter name, or NULL if it is unset. name may be an
+ * array element name[sub]; name[@] and name[*] are the elements joined by
+ * spaces, and the name of an array alone is its element 0.
+ */
+char const *var_get(char const *name)
+{
+    if (name[0] == '$' && name[1] == '\0')
+        return shell_pid();
+    if (name[0] == '?' && name[1] == '\0')
+    {
+        // 0 before the first command
+        char const *status = getenv("?");
+        return status ? status : "0";
+    }
+    size_t len, sublen;
+    char const *sub;
+    int subscripted = var_subscript(name, &len, &sub, &sublen);
+    struct var *v = nvars ? var_find(name, len, 0) : NULL;
+    if (!v || v->type == VAR_SCALAR)
+    {
+        // A scalar is an array of one element
+        if (!subscripted)
+            return getenv(name);
+        if (sublen != 1 || !strchr("0@*", *sub))
+            return NULL;
+        char *scalar = strndup(name, len);
+        if (!scalar)
+            err(1, "strndup");
+        char const *val = getenv(scalar);
+        free(scalar);
+        return val;
+    }
+    if (!subscripted)
+    {
+        sub = "0";
+        sublen = 1;
+    }
+    if (sublen == 1 && (*sub == '@' || *sub == '*'))
+        return array_join(v, 0);
+    char **slot = array_slot(v, sub, sublen, 0);
+    return slot ? *slot : NULL;
+}
+
+/*
+ * Set shell parameter name, which may be an array element, to value
+ */
+void var_set(char const *name, char const *value)
+{
+    var_store(name, value, strlen(value), 0);
+}
+
+/*
+ * Unset shell parameter name, or the array element name[sub]
+ */
+void var_unset(char const *name)
+{
+    size_t len, sublen;
+    char const *sub;
+    int subscripted = var_subscript(name, &len, &sub, &sublen);
+    struct var *v = nvars ? var_find(name, len, 0) : NULL;
+    if (subscripted)
+    {
+        if (v && v->type != VAR_SCALAR)
+            array_unset(v, sub, sublen);
+        return;
+    }
+    unsetenv(name);
+    if (v)
+        var_remove(v);
+}
+
+/*
+ * Whether s is a valid variable name: a letter or _ followed by letters, digits and _
+ */
+int is_name(char const *s)
+{
+    if (!isalpha((unsigned char)*s) && *s != '_')
+        return 0;
+    while (isalnum((unsigned char)*s) || *s == '_')
+        ++s;
+    return *s == '\0';
+}
+
+/*
+ * Find the shell variable called [name, name + len), creating it as an
+ * unset scalar if create is set. Returns NULL if it does not exist.
+ */
+struct var *var_find(char const *name, size_t len, int create)
+{
+    if (create && (vars_used + 1) * 2 > vars_cap)
+    {
+        // Grow, or just drop the tombstones, keeping the table at most half full
+        size_t cap = 16;
+        while (cap < (nvars + 1) * 4)
+            cap *= 2;
+        struct var **t = calloc(cap, sizeof *t);
+        if (!t)
+            err(1, "calloc");
+        for (size_t i = 0; i < vars_cap; ++i)
+        {
+            if (!vars[i] || vars[i] == &var_tombstone)
+                continue;
+            size_t k = fnv1a(FNV_OFFSET, vars[i]->name, strlen(vars[i]->name)) & (cap - 1);
+            while (t[k])
+                k = (k + 1) & (cap - 1);
+            t[k] = vars[i];
+        }
+        free(vars);
+        vars = t;
+        vars_cap = cap;
+        vars_used = nvars;
+    }
+    if (vars_cap == 0)
+        return NULL;
+
+    struct var **slot = NULL;
+    size_t i = fnv1a(FNV_OFFSET, name, len) & (vars_cap - 1);
+    for (; vars[i]; i = (i + 1) & (vars_cap - 1))
+    {
+        if (vars[i] == &var_tombstone)
+        {
+            if (!slot)
+                slot = &vars[i];
+        }
+        else if (strncmp(vars[i]->name, name, len) == 0 && vars[i]->name[len] == '\0')
+            return vars[i];
+    }
+    if (!create)
+        return NULL;
+    if (!slot)
+    {
+        slot = &vars[i];
+        ++vars_used;
+    }
+    struct var *v = calloc(1, sizeof *v);
+    if (!v || !(v->name = strndup(name, len)))
+        err(1, "calloc");
+    *slot = v;
+    ++nvars;
+    return v;
+}
+
+/*
+ * Remove shell variable v, once it is no longer in the environment
+ */
+void var_remove(struct var *v)
+{
+    size_t i = fnv1a(FNV_OFFSET, v->name, strlen(v->name)) & (vars_cap - 1);
+    while (vars[i] != v)
+        i = (i + 1) & (vars_cap - 1);
+    vars[i] = &var_tombstone;
+    --nvars;
+    array_clear(v);
+    free(v->vals);
+    free(v->keys);
+    free(v->sizes);
+    free(v->index);
+    free(v->entry);
+    free(v->name);
+    free(v);
+}
+
+/*
+ * Set shell parameter name to [s, s + k), or with append add it to the end
+ * of its value. A scalar's environment entry is reused while it has room,
+ * and grows geometrically, so that appending is amortized constant time.
+ * Returns 0, or -1 after printing a message for a bad array subscript.
+ */
+int var_store(char const *name, char const *s, size_t k, int append)
+{
+    size_t len, sublen;
+    char const *sub;
+    int subscripted = var_subscript(name, &len, &sub, &sublen);
+    struct var *v = subscripted ? array_get(name, len, VAR_ARRAY) : var_find(name, len, 1);
+    if (v->type != VAR_SCALAR)
+    {
+        // An array name alone stands for element 0
+        char **slot = subscripted ? array_slot(v, sub, sublen, 1) : array_slot(v, "0", 1, 1);
+        if (!slot)
+            return -1;
+        struct val_size *z = &v->sizes[slot - v->vals];
+        if (!append || !*slot)
+        {
+            free(*slot);
+            *slot = NULL;
+            z->len = z->cap = 0;
+        }
+        else if (z->cap == 0)
+            z->cap = (z->len = strlen(*slot)) + 1;
+        if (z->len + k + 1 > z->cap)
+        {
+            // Exact for an assignment, geometric for an append
+            size_t cap = z->len + k + 1;
+            if (append)
+            {
+                cap = z->cap > 16 ? z->cap : 16;
+                while (cap < z->len + k + 1)
+                    cap *= 2;
+            }
+            char *val = realloc(*slot, cap);
+            if (!val)
+                err(1, "realloc");
+            *slot = val;
+            z->cap = cap;
+        }
+        memcpy(*slot + z->len, s, k);
+        z->len += k;
+        (*slot)[z->len] = '\0';
+        return 0;
+    }
+
+    // An entry replaced or removed behind the shell's back is no longer ours
+    char const *cur = getenv(name);
+    if (v->entry && cur != v->entry + len + 1)
+    {
+        free(v->entry);
+        v->entry = NULL;
+        v->len = v->cap = 0;
+    }
+    size_t old = !append ? 0 : v->entry ? v->len - len - 1 : cur ? strlen(cur) : 0;
+    size_t need = len + 1 + old + k + 1;
+    if (!v->entry || need > v->cap)
+    {
+        size_t cap = v->cap > 16 ? v->cap : 16;
+        while (cap < need)
+            cap *= 2;
+        char *entry = malloc(cap);
+        if (!entry)
+            err(1, "malloc");
+        memcpy(entry, name, len);
+        entry[len] = '=';
+        memcpy(entry + len + 1, v->entry ? v->entry + len + 1 : cur, old);
+        memcpy(entry + len + 1 + old, s, k);
+        entry[need - 1] = '\0';
+        if (putenv(entry) != 0)
+            err(1, "putenv");
+        free(v->entry);
+        v->entry = entry;
+        v->cap = cap;
+    }
+    else
+    {
+        memmove(v->entry + len + 1 + old, s, k);
+        v->entry[need - 1] = '\0';
+    }
+    v->len = need - 1;
+    return 0;
+}
+
+/*
+ * Split name into the length of the variable name and, if it is an array
+ * element name[sub], the subscript [*sub, *sub + *sublen). Returns whether
+ * it is.
+ */
+int var_subscript(char const *name, size_t *len, char const **sub, size_t *sublen)
+{
+    char const *open = strchr(name, '[');
+    size_t n = strlen(name);
+    if (!open || open == name || name[n - 1] != ']')
+    {
+        *len = n;
+        return 0;
+    }
+    *len = open - name;
+    *sub = open + 1;
+    *sublen = n - *len - 2;
+    return 1;
+}
+
+/*
+ * Key of an associative array from subscript [sub, sub + n), with $name
+ * and ${name} replaced by their values, as a new string
+ */
+char *var_key(char const *sub, size_t n)
+{
+    char *key = NULL;
+    size_t len = 0, cap = 0;
+    if (str_append(&key, &len, &cap, "", 0) < 0)
+        err(1, "realloc");
+    for (size_t i = 0; i < n;)
+    {
+        size_t start = i + 1 + (i + 1 < n && sub[i + 1] == '{'), end = start;
+        while (sub[i] == '$' && end < n && (isalnum((unsigned char)sub[end]) || sub[end] == '_'))
+            ++end;
+        if (end == start || (start > i + 1 && (end == n || sub[end] != '}')))
+        {
+            if (str_append(&key, &len, &cap, sub + i, 1) < 0)
+                err(1, "realloc");
+            ++i;
+            continue;
+        }
+        char *name = strndup(sub + start, end - start);
+        if (!name)
+            err(1, "strndup");
+        char const *val = var_get(name);
+        if (val && str_append(&key, &len, &cap, val, strlen(val)) < 0)
+            err(1, "realloc");
+        free(name);
+        i = end + (start > i + 1);
+    }
+    return key;
+}
+
+/*
+ * The array variable called [name, name + len), created with type if it
+ * does not exist. The value of a scalar of that name becomes element 0.
+ */
+struct var *array_get(char const *name, size_t len, enum var_type type)
+{
+    struct var *v = var_find(name, len, 1);
+    if (v->type != VAR_SCALAR)
+        return v;
+    char const *cur = getenv(v->name);
+    char *val = cur ? strdup(cur) : NULL;
+    unsetenv(v->name);
+    free(v->entry);
+    v->entry = NULL;
+    v->len = v->cap = 0;
+    v->type = type;
+    if (val)
+        array_push(v, type == VAR_ASSOC ? strdup("0") : NULL, val);
+    return v;
+}
+
+/*
+ * The value slot of element [sub, sub + n) of array v, or NULL if it does
+ * not exist. With create, a missing element is added as NULL; an indexed
+ * array grows to include it. The subscript of an indexed array is an
+ * arithmetic expression, negative to count from the end.
+ */
+char **array_slot(struct var *v, char const *sub, size_t n, int create)
+{
+    if (v->type == VAR_ASSOC)
+    {
+        char *key = var_key(sub, n);
+        size_t pos = assoc_find(v, key);
+        if (pos == (size_t)-1)
+        {
+            if (!create)
+            {
+                free(key);
+                return NULL;
+            }
+            array_push(v, key, NULL);
+            return &v->vals[v->n - 1];
+        }
+        free(key);
+        return &v->vals[pos];
+    }
+
+    int64_t i;
+    if (arith(sub, n, &i) < 0)
+        return NULL;
+    if (i < 0)
+        i += (int64_t)v->n;
+    if (i < 0 || i >= (int64_t)(v->n + ARRAY_GAP_MAX))
+    {
+        if (create)
+            fprintf(stderr, "smallsh: %s[%.*s]: bad array subscript\n", v->name, (int)n, sub);
+        return NULL;
+    }
+    if ((size_t)i >= v->n)
+    {
+        if (!create)
+            return NULL;
+        while (v->n <= (size_t)i)
+            array_push(v, NULL, NULL);
+    }
+    return &v->vals[i];
+}
+
+/*
+ * Append value val, which the array takes, to array v; key is the key for
+ * an associative array, NULL for an indexed one
+ */
+void array_push(struct var *v, char *key, char *val)
+{
+    if (v->n == v->vals_cap)
+    {
+        v->vals_cap = v->vals_cap ? v->vals_cap * 2 : 8;
+        v->vals = realloc(v->vals, sizeof *v->vals * v->vals_cap);
+        v->sizes = realloc(v->sizes, sizeof *v->sizes * v->vals_cap);
+        if (!v->vals || !v->sizes || (v->type == VAR_ASSOC &&
+                         !(v->keys = realloc(v->keys, sizeof *v->keys * v->vals_cap))))
+            err(1, "realloc");
+    }
+    v->vals[v->n] = val;
+    v->sizes[v->n] = (struct val_size){0};
+    if (v->type == VAR_ASSOC)
+        v->keys[v->n] = key;
+    ++v->n;
+    if (v->type != VAR_ASSOC)
+        return;
+    if (v->n * 2 > v->index_cap)
+        assoc_reindex(v);
+    else
+    {
+        size_t i = fnv1a(FNV_OFFSET, key, strlen(key)) & (v->index_cap - 1);
+        while (v->index[i])
+            i = (i + 1) & (v->index_cap - 1);
+        v->index[i] = v->n;
+    }
+}
+
+/*
+ * Unset element [sub, sub + n) of array v
+ */
+void array_unset(struct var *v, char const *sub, size_t n)
+{
+    char **slot = array_slot(v, sub, n, 0);
+    if (!slot)
+        return;
+    size_t pos = slot - v->vals;
+    free(*slot);
+    *slot = NULL;
+    if (v->type == VAR_ASSOC)
+    {
+        free(v->keys[pos]);
+        memmove(v->vals + pos, v->vals + pos + 1, sizeof *v->vals * (v->n - pos - 1));
+        memmove(v->keys + pos, v->keys + pos + 1, sizeof *v->keys * (v->n - pos - 1));
+        memmove(v->sizes + pos, v->sizes + pos + 1, sizeof *v->sizes * (v->n - pos - 1));
+        --v->n;
+        assoc_reindex(v);
+    }
+    while (v->n > 0 && !v->vals[v->n - 1])
+        --v->n;
+}
+
+/*
+ * Remove the elements of array v
+ */
+void array_clear(struct var *v)
+{
+    for (size_t i = 0; i < v->n; ++i)
+    {
+        free(v->vals[i]);
+        if (v->type == VAR_ASSOC)
+            free(v->keys[i]);
+    }
+    v->n = 0;
+    if (v->index)
+        memset(v->index, 0, sizeof *v->index * v->index_cap);
+    free(v->joined);
+    v->joined = NULL;
+}
+
+/*
+ * Position of key in associative array v, or (size_t)-1
+ */
+size_t assoc_find(struct var const *v, char const *key)
+{
+    if (v->index_cap == 0)
+        return (size_t)-1;
+    size_t i = fnv1a(FNV_OFFSET, key, strlen(key)) & (v->index_cap - 1);
+    for (; v->index[i]; i = (i + 1) & (v->index_cap - 1))
+        if (strcmp(v->keys[v->index[i] - 1], key) == 0)
+            return v->index[i] - 1;
+    return (size_t)-1;
+}
+
+/*
+ * Rebuild the index of associative array v, at most half full
+ */
+void assoc_reindex(struct var *v)
+{
+    size_t cap = 16;
+    while (cap < v->n * 2 + 2)
+        cap *= 2;
+    free(v->index);
+    v->index = calloc(cap, sizeof *v->index);
+    if (!v->index)
+        err(1, "calloc");
+    v->index_cap = cap;
+    for (size_t pos = 0; pos < v->n; ++pos)
+    {
+        size_t i = fnv1a(FNV_OFFSET, v->keys[pos], strlen(v->keys[pos])) & (cap - 1);
+        while (v->index[i])
+            i = (i + 1) & (cap - 1);
+        v->index[i] = pos + 1;
+    }
+}
+
+/*
+ * The set elements of array v, or with keys their keys or indexes, joined
+ * by spaces. The string is kept in v until the next call.
+ */
+char const *array_join(struct var *v, int keys)
+{
+    char *s = NULL;
+    size_t len = 0, cap = 0;
+    if (str_append(&s, &len, &cap, "", 0) < 0)
+        err(1, "realloc");
+    for (size_t i = 0, count = 0; i < v->n; ++i)
+    {
+        char num[21];
+        char const *el = v->vals[i];
+        if (!el)
+            continue;
+        if (keys && v->type == VAR_ASSOC)
+            el = v->keys[i];
+        else if (keys)
+        {
+            snprintf(num, sizeof num, "%zu", i);
+            el = num;
+        }
+        if ((count++ > 0 && str_append(&s, &len, &cap, " ", 1) < 0) ||
+            str_append(&s, &len, &cap, el, strlen(el)) < 0)
+            err(1, "realloc");
+    }
+    free(v->joined);
+    v->joined = s;
+    return s;
+}
+
+/*
+ * Number of set elements of array v
+ */
+size_t array_count(struct var const *v)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < v->n; ++i)
+        count += v->vals[i] != NULL;
+    return count;
+}
+
+/*
+ * Arithmetic lexer: read the next token of *s into t. Parameters written
+ * $name, ${name}, $?, $$ or $! read like plain names, and $( like (.
+ * Returns 0, or -1 on an invalid character.
+ */
+int ar_lex(char const **s, struct ar_token *t)
+{
+    static char const *const ops[] = {
+        "**=", "<<=", ">>=", "**", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+        "++", "--", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=",
+        "+", "-", "*", "/", "%", "<", ">", "&", "^", "|", "!", "~", "?", ":",
+        "=", "(", ")", ","};
+    char const *p = *s;
+
+    while (isspace((unsigned char)*p))
+        ++p;
+    *t = (struct ar_token){.start = p};
+    if (*p == '\0')
+    {
+        t->type = AR_END;
+        *s = p;
+        return 0;
+    }
+    if (p[0] == '$' && p[1] == '(')
+        ++p;
+
+    if (isdigit((unsigned char)*p))
+    {
+        char *e;
+        t->type = AR_NUM;
+        t->num = strtoull(p, &e, 0);
+        if (isalnum((unsigned char)*e) || *e == '_')
+            return -1;
+        *s = e;
+        return 0;
+    }
+    if (isalpha((unsigned char)*p) || *p == '_' || *p == '$')
+    {
+        // Name: a, $a, ${a}, $?, $$ or $!
+        int dollar = *p == '$';
+        int brace = dollar && p[1] == '{';
+        p += dollar + brace;
+        t->start = p;
+        if (dollar && !brace && strchr("?$!", *p) && *p)
+            ++p;
+        else
+            while (isalnum((unsigned char)*p) || *p == '_')
+                ++p;
+        t->len = p - t->start;
+        if (t->len == 0 || (brace && *p++ != '}'))
+            return -1;
+        t->type = AR_NAME;
+        *s = p;
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof ops / sizeof *ops; ++i)
+    {
+        size_t n = strlen(ops[i]);
+        if (strncmp(p, ops[i], n) == 0)
+        {
+            t->type = AR_OP;
+            t->start = ops[i];
+            t->len = n;
+            *s = p + n;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Whether token t is the operator op
+ */
+int ar_is(struct ar_token const *t, char const *op)
+{
+    return t->type == AR_OP && strcmp(t->start, op) == 0;
+}
+
+/*
+ * Append an instruction to the code of a and return its index
+ */
+size_t ar_emit(struct arith *a, enum ar_opcode op, int64_t arg)
+{
+    if (a->ncode == a->cap)
+    {
+        a->cap = a->cap ? a->cap * 2 : 16;
+        void *tmp = realloc(a->code, sizeof *a->code * a->cap);
+        if (!tmp)
+            err(1, "realloc");
+        a->code = tmp;
+    }
+    a->code[a->ncode] = (struct ar_insn){.op = op, .arg = arg};
+    return a->ncode++;
+}
+
+/*
+ * Index of the name in token t in the name table of a, adding it if new
+ */
+int64_t ar_name(struct arith *a, struct ar_token const *t)
+{
+    for (size_t i = 0; i < a->nnames; ++i)
+        if (strlen(a->names[i]) == t->len && strncmp(a->names[i], t->start, t->len) == 0)
+            return i;
+    void *tmp = realloc(a->names, sizeof *a->names * (a->nnames + 1));
+    if (!tmp)
+        err(1, "realloc");
+    a->names = tmp;
+    if (!(a->names[a->nnames] = strndup(t->start, t->len)))
+        err(1, "strndup");
+    return a->nnames++;
+}
+
+/*
+ * Binary operators by precedence, lowest first, for precedence climbing.
+ * Returns the precedence of operator token t, or 0 if it is not binary.
+ */
+int ar_prec(struct ar_token const *t, enum ar_opcode *op)
+{
+    static struct
+    {
+        char const *s;
+        int prec;
+        enum ar_opcode op;
+    } const binops[] = {
+        {"||", 1, AR_OR}, {"&&", 2, AR_AND}, {"|", 3, AR_BOR}, {"^", 4, AR_BXOR},
+        {"&", 5, AR_BAND}, {"==", 6, AR_EQ}, {"!=", 6, AR_NE}, {"<", 7, AR_LT},
+        {"<=", 7, AR_LE}, {">", 7, AR_GT}, {">=", 7, AR_GE}, {"<<", 8, AR_SHL},
+        {">>", 8, AR_SHR}, {"+", 9, AR_ADD}, {"-", 9, AR_SUB}, {"*", 10, AR_MUL},
+        {"/", 10, AR_DIV}, {"%", 10, AR_MOD}, {"**", 11, AR_POW}};
+
+    for (size_t i = 0; t->type == AR_OP && i < sizeof binops / sizeof *binops; ++i)
+    {
+        if (strcmp(t->start, binops[i].s) == 0)
+        {
+            *op = binops[i].op;
+            return binops[i].prec;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Compile a comma-separated list of assignment expressions
+ */
+int ar_comma(struct arith *a, char const **s, struct ar_token *t)
+{
+    if (ar_assign(a, s, t) < 0)
+        return -1;
+    while (ar_is(t, ","))
+    {
+        ar_emit(a, AR_POP, 0);
+        if (ar_lex(s, t) < 0 || ar_assign(a, s, t) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compile an assignment (name = expr, name op= expr) or a conditional
+ * expression c ? x : y. Both are right-associative.
+ */
+int ar_assign(struct arith *a, char const **s, struct ar_token *t)
+{
+    if (t->type == AR_NAME)
+    {
+        // Look ahead for an assignment operator
+        char const *save = *s;
+        struct ar_token name = *t, next;
+        if (ar_lex(s, &next) == 0 && next.type == AR_OP && next.start[next.len - 1] == '=' &&
+            !ar_is(&next, "==") && !ar_is(&next, "!=") && !ar_is(&next, "<=") && !ar_is(&next, ">="))
+        {
+            int64_t var = ar_name(a, &name);
+            enum ar_opcode op = AR_NOP;
+            if (next.len > 1)
+            {
+                // Compound: name op= expr is name = name op expr
+                char opstr[4] = {0};
+                memcpy(opstr, next.start, next.len - 1);
+                struct ar_token bin = {.type = AR_OP, .start = opstr, .len = next.len - 1};
+                ar_prec(&bin, &op);
+                ar_emit(a, AR_LOAD, var);
+            }
+            if (ar_lex(s, t) < 0 || ar_assign(a, s, t) < 0)
+                return -1;
+            if (op != AR_NOP)
+                ar_emit(a, op, 0);
+            ar_emit(a, AR_STORE, var);
+            return 0;
+        }
+        *s = save;
+        *t = name;
+    }
+
+    if (ar_binary(a, s, t, 1) < 0)
+        return -1;
+    if (!ar_is(t, "?"))
+        return 0;
+
+    // c ? x : y
+    size_t jz = ar_emit(a, AR_JZ, 0);
+    if (ar_lex(s, t) < 0 || ar_assign(a, s, t) < 0 || !ar_is(t, ":"))
+        return -1;
+    size_t jmp = ar_emit(a, AR_JMP, 0);
+    a->code[jz].arg = a->ncode;
+    if (ar_lex(s, t) < 0 || ar_assign(a, s, t) < 0)
+        return -1;
+    a->code[jmp].arg = a->ncode;
+    return 0;
+}
+
+/*
+ * Compile binary operators of precedence min_prec and above by precedence
+ * climbing. && and || short-circuit.
+ */
+int ar_binary(struct arith *a, char const **s, struct ar_token *t, int min_prec)
+{
+    enum ar_opcode op;
+    int prec;
+
+    if (ar_unary(a, s, t) < 0)
+        return -1;
+    while ((prec = ar_prec(t, &op)) >= min_prec)
+    {
+        size_t jump = 0;
+        if (op == AR_AND || op == AR_OR)
+            jump = ar_emit(a, op == AR_AND ? AR_JZ_KEEP : AR_JNZ_KEEP, 0);
+        // ** is right-associative
+        if (ar_lex(s, t) < 0 || ar_binary(a, s, t, op == AR_POW ? prec : prec + 1) < 0)
+            return -1;
+        if (op == AR_AND || op == AR_OR)
+        {
+            ar_emit(a, AR_BOOL, 0);
+            a->code[jump].arg = a->ncode;
+        }
+        else
+            ar_emit(a, op, 0);
+    }
+    return 0;
+}
+
+/*
+ * Compile unary operators, ++ and -- on names, and primaries: numbers,
+ * names and parenthesized expressions
+ */
+int ar_unary(struct arith *a, char const **s, struct ar_token *t)
+{
+    if (ar_is(t, "-") || ar_is(t, "+") || ar_is(t, "!") || ar_is(t, "~"))
+    {
+        char c = t->start[0];
+        if (ar_lex(s, t) < 0 || ar_unary(a, s, t) < 0)
+            return -1;
+        if (c != '+')
+            ar_emit(a, c == '-' ? AR_NEG : c == '!' ? AR_NOT : AR_BNOT, 0);
+        return 0;
+    }
+    if (ar_is(t, "++") || ar_is(t, "--"))
+    {
+        enum ar_opcode op = t->start[0] == '+' ? AR_PREINC : AR_PREDEC;
+        if (ar_lex(s, t) < 0 || t->type != AR_NAME)
+            return -1;
+        ar_emit(a, op, ar_name(a, t));
+        return ar_lex(s, t);
+    }
+    if (ar_is(t, "("))
+    {
+        if (ar_lex(s, t) < 0 || ar_comma(a, s, t) < 0 || !ar_is(t, ")"))
+            return -1;
+        return ar_lex(s, t);
+    }
+    if (t->type == AR_NUM)
+    {
+        ar_emit(a, AR_PUSH, (int64_t)t->num);
+        return ar_lex(s, t);
+    }
+    if (t->type == AR_NAME)
+    {
+        int64_t var = ar_name(a, t);
+        if (ar_lex(s, t) < 0)
+            return -1;
+        if (ar_is(t, "++") || ar_is(t, "--"))
+        {
+            ar_emit(a, t->start[0] == '+' ? AR_POSTINC : AR_POSTDEC, var);
+            return ar_lex(s, t);
+        }
+        ar_emit(a, AR_LOAD, var);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Compile the arithmetic expression [src, src + n), or find it in the
+ * cache of compiled expressions, which is keyed by the expression text.
+ * Returns NULL after printing a message on a syntax error; a cached
+ * failure prints it again.
+ */
+struct arith *ar_compile(char const *src, size_t n)
+{
+    for (size_t i = 0; i < ARITH_CACHE_SIZE; ++i)
+    {
+        struct arith *a = &arith_cache[i];
+        if (!a->src || a->len != n || memcmp(a->src, src, n) != 0)
+            continue;
+        if (a->error)
+        {
+            fprintf(stderr, "smallsh: %s: %s\n", a->src, a->error);
+            return NULL;
+        }
+        return a;
+    }
+
+    struct arith *a = &arith_cache[arith_cache_next];
+    arith_cache_next = (arith_cache_next + 1) % ARITH_CACHE_SIZE;
+    free(a->src);
+    free(a->code);
+    for (size_t i = 0; i < a->nnames; ++i)
+        free(a->names[i]);
+    free(a->names);
+    *a = (struct arith){.len = n};
+    if (!(a->src = strndup(src, n)))
+        err(1, "strndup");
+
+    char const *s = a->src;
+    struct ar_token t;
+    int rc = ar_lex(&s, &t);
+    if (rc == 0 && t.type == AR_END)
+        ar_emit(a, AR_PUSH, 0); // An empty expression is 0
+    else if (rc < 0 || ar_comma(a, &s, &t) < 0 || t.type != AR_END)
+        a->error = "arithmetic syntax error";
+    if (!a->error && a->ncode > ARITH_STACK)
+        a->error = "expression too long";
+    if (a->error)
+    {
+        fprintf(stderr, "smallsh: %s: %s\n", a->src, a->error);
+        a->ncode = 0;
+        return NULL;
+    }
+    return a;
+}
+
+/*
+ * Value of arithmetic variable name: its value as an integer, or 0 if it
+ * is unset, empty or not a number
+ */
+int64_t ar_var(char const *name)
+{
+    char const *val = var_get(name);
+    return val ? (int64_t)strtoll(val, NULL, 0) : 0;
+}
+
+/*
+ * Evaluate compiled expression a over 64-bit integers, wrapping on
+ * overflow. Returns 0 and sets *result, or -1 after printing a message.
+ */
+int ar_eval(struct arith const *a, int64_t *result)
+{
+    int64_t stack[ARITH_STACK + 1];
+    size_t sp = 0;
+    char num[21];
+
+    for (size_t pc = 0; pc < a->ncode; ++pc)
+    {
+        struct ar_insn const *in = &a->code[pc];
+        int64_t x = sp > 0 ? stack[sp - 1] : 0;
+        int64_t y = sp > 1 ? stack[sp - 2] : 0;
+        uint64_t ux = x, uy = y;
+
+        switch (in->op)
+        {
+        case AR_NOP:
+            break;
+        case AR_PUSH:
+            stack[sp++] = in->arg;
+            break;
+        case AR_POP:
+            --sp;
+            break;
+        case AR_LOAD:
+            stack[sp++] = ar_var(a->names[in->arg]);
+            break;
+        case AR_STORE:
+            snprintf(num, sizeof num, "%" PRId64, x);
+            var_set(a->names[in->arg], num);
+            break;
+        case AR_PREINC:
+        case AR_PREDEC:
+        case AR_POSTINC:
+        case AR_POSTDEC:
+        {
+            int64_t old = ar_var(a->names[in->arg]);
+            int64_t new = (int64_t)((uint64_t)old + (in->op == AR_PREINC || in->op == AR_POSTINC ? 1 : -1));
+            snprintf(num, sizeof num, "%" PRId64, new);
+            var_set(a->names[in->arg], num);
+            stack[sp++] = in->op == AR_PREINC || in->op == AR_PREDEC ? new : old;
+            break;
+        }
+        case AR_NEG:
+            stack[sp - 1] = (int64_t)(0 - ux);
+            break;
+        case AR_NOT:
+            stack[sp - 1] = !x;
+            break;
+        case AR_BNOT:
+            stack[sp - 1] = ~x;
+            break;
+        case AR_BOOL:
+            stack[sp - 1] = x != 0;
+            break;
+        case AR_JZ:
+            --sp;
+            if (!x)
+                pc = in->arg - 1;
+            break;
+        case AR_JMP:
+            pc = in->arg - 1;
+            break;
+        case AR_JZ_KEEP:
+        case AR_JNZ_KEEP:
+            // Short-circuit: keep the result as 0 or 1, or evaluate the right side
+            if ((x != 0) == (in->op == AR_JNZ_KEEP))
+            {
+                stack[sp - 1] = x != 0;
+                pc = in->arg - 1;
+            }
+            else
+                --sp;
+            break;
+        default:
+        {
+            // Binary: y op x
+            int64_t r;
+            switch (in->op)
+            {
+            case AR_ADD:
+                r = (int64_t)(uy + ux);
+                break;
+            case AR_SUB:
+                r = (int64_t)(uy - ux);
+                break;
+            case AR_MUL:
+                r = (int64_t)(uy * ux);
+                break;
+            case AR_DIV:
+            case AR_MOD:
+                if (x == 0)
+                {
+                    fprintf(stderr, "smallsh: %s: division by zero\n", a->src);
+                    return -1;
+                }
+                if (x == -1)
+                    r = in->op == AR_DIV ? (int64_t)(0 - uy) : 0;
+                else
+                    r = in->op == AR_DIV ? y / x : y % x;
+                break;
+            case AR_POW:
+                if (x < 0)
+                {
+                    fprintf(stderr, "smallsh: %s: exponent less than 0\n", a->src);
+                    return -1;
+                }
+                r = 1;
+                for (uint64_t b = uy, e = ux; e; e >>= 1, b *= b)
+                    if (e & 1)
+                        r = (int64_t)((uint64_t)r * b);
+                break;
+            case AR_SHL:
+                r = (int64_t)(uy << (ux & 63));
+                break;
+            case AR_SHR:
+                r = y >> (ux & 63);
+                break;
+            case AR_LT:
+                r = y < x;
+                break;
+            case AR_LE:
+                r = y <= x;
+                break;
+            case AR_GT:
+                r = y > x;
+                break;
+            case AR_GE:
+                r = y >= x;
+                break;
+            case AR_EQ:
+                r = y == x;
+                break;
+            case AR_NE:
+                r = y != x;
+                break;
+            case AR_BAND:
+                r = y & x;
+                break;
+            case AR_BXOR:
+                r = y ^ x;
+                break;
+            case AR_BOR:
+                r = y | x;
+                break;
+            default:
+                r = 0;
+                break;
+            }
+            stack[--sp - 1] = r;
+            break;
+        }
+        }
+    }
+    *result = sp > 0 ? stack[sp - 1] : 0;
+    return 0;
+}
+
+/*
+ * Evaluate the arithmetic expression [s, s + n). Returns 0 and sets
+ * *result, or -1 after printing a message.
+ */
+int arith(char const *s, size_t n, int64_t *result)
+{
+    struct arith *a = ar_compile(s, n);
+    return a ? ar_eval(a, result) : -1;
+}
+
+/*
+ * Built-in commands: ((expression))
+ * Evaluate the expression; $? is 0 if its value is non-zero, 1 otherwise.
+ */
+void builtin_arith(char **argv, size_t argc)
+{
+    size_t n = strlen(argv[0]);
+    int64_t value;
+
+    if (argc > 1 || n < 4 || strcmp(argv[0] + n - 2, "))") != 0)
+    {
+        fprintf(stderr, "smallsh: %s: arithmetic syntax error\n", argv[0]);
+        set_status(1);
+        return;
+    }
+    if (arith(argv[0] + 2, n - 4, &value) < 0)
+        set_status(1);
+    else
+        set_status(value == 0);
+}
+
+/*
+ * Copy the pointers from the nwords words w to words_argv, skipping over
+ * redirection operators and &. The redirections are collected, in order, into redirs.
+ */
+size_t parse_command(char **w, size_t nwords, char **words_argv)
+{
+    size_t words_argc = 0;
+    nredirs = 0;
+    for (size_t i = 0; i < nwords; ++i)
+    {
+        // Collect redirection operators and their file names
+        int n = nredirs + 2 <= MAX_WORDS ? parse_redir(w[i], redirs + nredirs) : 0;
+        if (n > 0)
+        {
+            if (redirs[nredirs].op < REDIR_DUP)
+                redirs[nredirs].target = i + 1 < nwords ? w[++i] : NULL;
+            nredirs += n;
+            continue;
+        }
+        words_argv[words_argc] = w[i];
+        ++words_argc;
+    }
+
+    // Check if bg process
+    if (words_argc > 0 && strcmp(words_argv[words_argc - 1], "&") == 0)
+    {
+        bg_flag = 1;
+        words_argv[words_argc - 1] = NULL;
+        --words_argc;
+    }
+    else
+    {
+        bg_flag = 0;
+        words_argv[words_argc] = NULL;
+    }
+
+    return words_argc;
+}
+
+/*
+ * Built-in commands: cd
+ */
+void builtin_cd(char **argv, size_t argc)
+{
+    if (argc == 1)
+    {
+        // No argument, cd to home directory
+        char *home = getenv("HOME");
+        if (home)
+            chdir(home);
+        else
+        {
+            fprintf(stderr, "smallsh: cd: HOME not set\n");
+            setenv("?", "1", 1);
+        }
+    }
+    else if (argc > 2)
+    {
+        // More than one argument
+        fprintf(stderr, "smallsh: cd: too many arguments\n");
+        setenv("?", "1", 1);
+    }
+    else
+    {
+        // Just one argument
+        if (chdir(argv[1]) != 0)
+        {
+            fprintf(stderr, "smalssh: chdir failed\n");
+            setenv("?", "1", 1);
+        }
+    }
+}
+
+/*
+ * Built-in commands: exit
+ */
+void builtin_exit(char **argv, size_t argc)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "smallsh: exit: too many arguments\n");
+        setenv("?", "1", 1);
+    }
+    int exit_code;
+    if (argc == 2)
+    {
+        char *endptr;
+        exit_code = strtol(argv[1], &endptr, 0);
+        if (*endptr != '\0')
+        {
+            fprintf(stderr, "smallsh: exit: %s: integer argument required\n", argv[1]);
+            setenv("?", "1", 1);
+        }
+    }
+    else
+    {
+        // If no argument is provided, use $?
+        char *status = getenv("?");
+        if (!status)
+            exit_code = 0;
+        else
+            exit_code = strtol(status, NULL, 0);
+    }
+    jobs_drain();
+    exit(exit_code);
+}
+
+/*
+ * FNV-1a hash of [data, data + n), continuing from hash h
+ */
+uint64_t fnv1a(uint64_t h, void const *data, size_t n)
+{
+    unsigned char const *p = data;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Create a directory and any missing parents, like mkdir -p. Each component
+ * is created and opened relative to the one before it with mkdirat and openat.
+ */
+int make_dirs(char const *path)
+{
+    char *buf = strdup(path);
+    if (!buf)
+        err(1, "strdup");
+    int dfd = open(*path == '/' ? "/" : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    char *save = NULL;
+    int ret = dfd < 0 ? -1 : 0;
+    for (char *comp = strtok_r(buf, "/", &save); comp && ret == 0; comp = strtok_r(NULL, "/", &save))
+    {
+        if (mkdirat(dfd, comp, 0777) < 0 && errno != EEXIST)
+            ret = -1;
+        else
+        {
+            // Also checks that an existing component is a directory
+            int next = openat(dfd, comp, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            if (next < 0)
+                ret = -1;
+            close(dfd);
+            dfd = next;
+        }
+    }
+    int saved = errno;
+    if (dfd >= 0)
+        close(dfd);
+    free(buf);
+    errno = saved;
+    return ret;
+}
+
+/*
+ * Directory for memo cache entries: $SMALLSH_MEMO_DIR, or smallsh/memo
+ * under $XDG_CACHE_HOME or ~/.cache. Returns a newly allocated string.
+ */
+char *memo_dir()
+{
+    char *dir = getenv("SMALLSH_MEMO_DIR");
+    char *ret = NULL;
+
+    if (dir && *dir)
+        ret = strdup(dir);
+    else if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+    {
+        if (asprintf(&ret, "%s/smallsh/memo", dir) < 0)
+            ret = NULL;
+    }
+    else if ((dir = getenv("HOME")) && *dir)
+    {
+        if (asprintf(&ret, "%s/.cache/smallsh/memo", dir) < 0)
+            ret = NULL;
+    }
+    else
+        ret = strdup("/tmp/smallsh-memo");
+    if (!ret)
+        err(1, "memo_dir");
+    return ret;
+}
+
+/*
+ * Copy the whole of the regular file in_fd to out_fd. Uses sendfile so
+ * that the data is not copied through user space, falling back to
+ * read/write when out_fd does not support it (e.g. a terminal).
+ */
+int copy_fd(int in_fd, int out_fd)
+{
+    struct stat st;
+    off_t off = 0;
+
+    if (fstat(in_fd, &st) < 0)
+        return -1;
+    while (off < st.st_size)
+    {
+        ssize_t n = sendfile(out_fd, in_fd, &off, st.st_size - off);
+        if (n > 0)
+            continue;
+        if (n == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -1;
+
+        // Fallback: plain copy from the current offset
+        char buf[65536];
+        while ((n = pread(in_fd, buf, sizeof buf, off)) > 0)
+        {
+            if (write_all(out_fd, buf, n) < 0)
+                return -1;
+            off += n;
+        }
+        return n < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+/*
+ * Write all n bytes of buf to fd, retrying short writes
+ */
+int write_all(int fd, char const *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t m = write(fd, buf, n);
+        if (m < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += m;
+        n -= m;
+    }
+    return 0;
+}
+
+/*
+ * Append [s, s + n) to the output buffer of fd, stdout or stderr. Output for
+ * a terminal, or too large for the buffer, is written through, after what
+ * is buffered, and so is stderr, so that no message is lost if the shell
+ * is killed. Output for the file the other buffer holds output for is
+ * written after that output, so the two stay in order.
+ */
+void out_write(int fd, char const *s, size_t n)
+{
+    struct out_buf *b = &out_bufs[fd == STDERR_FILENO];
+    struct out_buf *other = &out_bufs[fd != STDERR_FILENO];
+    pthread_mutex_lock(&out_lock);
+    if (b->len == 0)
+    {
+        struct stat st;
+        b->tty = isatty(fd);
+        b->dev = fstat(fd, &st) == 0 ? st.st_dev : 0;
+        b->ino = b->dev ? st.st_ino : 0;
+    }
+    if (other->len > 0 && other->dev == b->dev && other->ino == b->ino)
+        out_drain(other);
+    int through = b->tty || fd == STDERR_FILENO;
+    if (through || n > OUT_BUF_SIZE - b->len)
+        out_drain(b);
+    if (through || n >= OUT_BUF_SIZE)
+        write_all(fd, s, n);
+    else
+    {
+        memcpy(b->buf + b->len, s, n);
+        b->len += n;
+    }
+    pthread_mutex_unlock(&out_lock);
+}
+
+/*
+ * Format into the output buffer of fd, like fprintf
+ */
+void out_printf(int fd, char const *fmt, ...)
+{
+    char buf[1024], *s = buf;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof buf)
+    {
+        va_start(ap, fmt);
+        if (vasprintf(&s, fmt, ap) < 0)
+            err(1, "vasprintf");
+        va_end(ap);
+    }
+    if (n > 0)
+        out_write(fd, s, n);
+    if (s != buf)
+        free(s);
+}
+
+/*
+ * Write out the contents of b, with out_lock held
+ */
+void out_drain(struct out_buf *b)
+{
+    if (b->len > 0)
+        write_all(b->fd, b->buf, b->len);
+    b->len = 0;
+}
+
+/*
+ * Write out the output buffers: before the shell spawns a command, reads
+ * interactive input or waits, when a buffered descriptor is redirected,
+ * and at exit
+ */
+void out_flush()
+{
+    pthread_mutex_lock(&out_lock);
+    out_drain(&out_bufs[0]);
+    out_drain(&out_bufs[1]);
+    pthread_mutex_unlock(&out_lock);
+}
+
+/*
+ * Write out the output buffers before reading from fd, unless it is a
+ * regular file: input from a terminal, pipe or fifo may be waiting for
+ * that output, such as a prompt
+ */
+void out_flush_input(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        out_flush();
+}
+
+/*
+ * Write function of the stderr stream, through out_write
+ */
+ssize_t out_stderr_write(void *cookie, char const *buf, size_t n)
+{
+    (void)cookie;
+    out_write(STDERR_FILENO, buf, n);
+    return n;
+}
+
+/*
+ * Send stderr, the messages of the shell and of builtins, through
+ * out_write, so that they stay in order with buffered stdout, and flush
+ * the buffers at exit
+ */
+void out_init()
+{
+    FILE *f = fopencookie(NULL, "w", (cookie_io_functions_t){.write = out_stderr_write});
+    if (f)
+    {
+        setvbuf(f, NULL, _IONBF, 0);
+        stderr = f;
+    }
+    atexit(out_flush);
+}
+
+/*
+ * Built-in commands: memo
+ * memo [--inputs file... --] [--content] [--env name]... cmd [args...]
+ *
+ * Runs cmd with its stdout captured into a cache entry keyed by a hash of
+ * argv, the working directory, the declared input files (by device, inode,
+ * size and mtime, or by content with --content) and the named environment
+ * variables. When an entry already exists, its output is replayed and $?
+ * is set to its exit status without running cmd. memo cannot be run with &.
+ */
+void builtin_memo(char **argv, size_t argc)
+{
+    size_t i = 1;
+    size_t inputs = 0, ninputs = 0;
+    int by_content = 0;
+    uint64_t h = FNV_OFFSET;
+
+    // The entry is written and replayed by the shell, which does not wait for jobs
+    if (bg_flag)
+    {
+        fprintf(stderr, "smallsh: memo: cannot run in the background\n");
+        set_status(1);
+        return;
+    }
+
+    // Options
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i)
+    {
+        if (strcmp(argv[i], "--inputs") == 0)
+        {
+            inputs = ++i;
+            for (; i < argc && strcmp(argv[i], "--") != 0; ++i)
+                ++ninputs;
+            if (i == argc)
+            {
+                fprintf(stderr, "smallsh: memo: --inputs must end with --\n");
+                set_status(1);
+                return;
+            }
+        }
+        else if (strcmp(argv[i], "--content") == 0)
+            by_content = 1;
+        else if (strcmp(argv[i], "--env") == 0 && i + 1 < argc)
+        {
+            char *val = getenv(argv[++i]);
+            h = fnv1a(h, argv[i], strlen(argv[i]) + 1);
+            h = fnv1a(h, val ? "=" : "!", 1);
+            if (val)
+                h = fnv1a(h, val, strlen(val) + 1);
+        }
+        else if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        else
+        {
+            fprintf(stderr, "smallsh: memo: %s: invalid option\n", argv[i]);
+            set_status(1);
+            return;
+        }
+    }
+    if (i == argc)
+    {
+        fprintf(stderr, "smallsh: memo: command required\n");
+        set_status(1);
+        return;
+    }
+    char **cmd = argv + i;
+
+    // Key: command words, working directory, inputs and environment
+    for (size_t j = 0; cmd[j]; ++j)
+        h = fnv1a(h, cmd[j], strlen(cmd[j]) + 1);
+    char *cwd = getcwd(NULL, 0);
+    if (cwd)
+        h = fnv1a(h, cwd, strlen(cwd) + 1);
+    free(cwd);
+    for (size_t j = inputs; j < inputs + ninputs; ++j)
+    {
+        struct stat st;
+        h = fnv1a(h, argv[j], strlen(argv[j]) + 1);
+        if (!by_content)
+        {
+            if (stat(argv[j], &st) < 0)
+            {
+                h = fnv1a(h, "!", 1);
+                continue;
+            }
+            uint64_t meta[5] = {st.st_dev, st.st_ino, st.st_size,
+                                st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+            h = fnv1a(h, meta, sizeof meta);
+            continue;
+        }
+        int fd = open(argv[j], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            h = fnv1a(h, "!", 1);
+            continue;
+        }
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof buf)) > 0)
+            h = fnv1a(h, buf, n);
+        close(fd);
+    }
+
+    char *dir = memo_dir();
+    char *out_path, *status_path, *tmp_path;
+    if (asprintf(&out_path, "%s/%016jx", dir, (uintmax_t)h) < 0 ||
+        asprintf(&status_path, "%s.status", out_path) < 0 ||
+        asprintf(&tmp_path, "%s.%jd.tmp", out_path, (intmax_t)getpid()) < 0)
+        err(1, "asprintf");
+
+    /* Hit: replay the cached output */
+    int status = -1;
+    FILE *sf = fopen(status_path, "re");
+    if (sf)
+    {
+        if (fscanf(sf, "%d", &status) != 1)
+            status = -1;
+        fclose(sf);
+    }
+    int fd = status < 0 ? -1 : open(out_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        out_flush();
+        if (copy_fd(fd, STDOUT_FILENO) < 0)
+            warn("memo: %s", out_path);
+        close(fd);
+        set_status(status);
+        goto done;
+    }
+
+    /* Miss: run the command with stdout captured */
+    if (make_dirs(dir) < 0 ||
+        (fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+    {
+        // The cache is unusable; run the command uncached
+        warn("memo: %s", dir);
+        execute_nonbuiltin_cmds(cmd);
+        goto done;
+    }
+
+    struct redir capture = {.fd = STDOUT_FILENO, .op = REDIR_DUP, .src = fd};
+    pid_t pid = spawn_cmd(cmd, &capture, 1);
+    if (pid < 0)
+    {
+        unlink(tmp_path);
+        close(fd);
+        set_status(EXIT_FAILURE);
+        goto done;
+    }
+
+    // Wait for the command, continuing it if it is stopped
+    while (waitpid(pid, &status, WUNTRACED) < 0 || WIFSTOPPED(status))
+    {
+        if (errno == EINTR)
+            continue;
+        fprintf(stderr, "Child process %d stopped. Continuing.\n", pid);
+        if (kill(pid, SIGCONT) < 0)
+        {
+            perror("kill");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (WIFEXITED(status))
+    {
+        // Store the output, then the status which marks the entry complete
+        status = WEXITSTATUS(status);
+        char *st_tmp;
+        if (asprintf(&st_tmp, "%s.status", tmp_path) < 0)
+            err(1, "asprintf");
+        FILE *f = fopen(st_tmp, "we");
+        int ok = f && fprintf(f, "%d\n", status) > 0;
+        if (f && fclose(f) != 0)
+            ok = 0;
+        if (!ok || rename(tmp_path, out_path) < 0 || rename(st_tmp, status_path) < 0)
+        {
+            unlink(st_tmp);
+            unlink(tmp_path);
+        }
+        free(st_tmp);
+    }
+    else
+    {
+        // Signaled: pass the output through but do not cache it
+        status = 128 + WTERMSIG(status);
+        unlink(tmp_path);
+    }
+    out_flush();
+    if (copy_fd(fd, STDOUT_FILENO) < 0)
+        warn("memo");
+    close(fd);
+    set_status(status);
+
+done:
+    free(dir);
+    free(out_path);
+    free(status_path);
+    free(tmp_path);
+}
+
+/*
+ * Built-in commands: exec
+ * With only redirections, apply them to the shell itself. Descriptors 3-9
+ * stay open for later commands, which can refer to them as e.g. >&3.
+ * With a command, replace the shell with it.
+ */
+void builtin_exec(char **argv, size_t argc)
+{
+    out_flush();
+    for (size_t i = 0; i < nredirs; ++i)
+    {
+        // Above the persistent descriptors, only a coprocess pipe may be closed
+        if (redirs[i].fd > SHELL_FD_MAX && !(redirs[i].op == REDIR_CLOSE && coproc_forget(redirs[i].fd)))
+        {
+            fprintf(stderr, "smallsh: exec: %d: bad file descriptor\n", redirs[i].fd);
+            set_status(1);
+            return;
+        }
+        if (redirs[i].fd > STDERR_FILENO && shell_fd_used(redirs[i].fd))
+        {
+            fprintf(stderr, "smallsh: exec: %d: in use by the shell\n", redirs[i].fd);
+            set_status(1);
+            return;
+        }
+        // Replayed on resume, keep what the skipped lines wrote to the file
+        if (journal_replaying && redirs[i].op == REDIR_OUT)
+            redirs[i].op = REDIR_APPEND;
+    }
+    if (apply_redirections(redirs, nredirs) < 0)
+    {
+        set_status(1);
+        return;
+    }
+
+    // Track the persistent descriptors
+    for (size_t i = 0; i < nredirs; ++i)
+    {
+        int fd = redirs[i].fd;
+        if (fd <= STDERR_FILENO)
+            continue;
+        size_t j = 0;
+        while (j < nshell_fds && shell_fds[j] != fd)
+            ++j;
+        if (redirs[i].op == REDIR_CLOSE)
+        {
+            if (j < nshell_fds)
+                shell_fds[j] = shell_fds[--nshell_fds];
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (j == nshell_fds)
+            shell_fds[nshell_fds++] = fd;
+    }
+
+    if (argc == 1)
+    {
+        set_status(0);
+        return;
+    }
+
+    // Replace the shell
+    if (interactive)
+    {
+        sigaction(SIGINT, &SIGINT_default, NULL);
+        sigaction(SIGTSTP, &SIGTSTP_default, NULL);
+    }
+    shell_fds_inherit(1);
+    execvp(argv[1], argv + 1);
+    int errnum = errno;
+    shell_fds_inherit(0);
+    fprintf(stderr, "smallsh: exec: %s: %s\n", argv[1], strerror(errnum));
+    set_status(errnum == ENOENT ? 127 : 126);
+}
+
+/*
+ * Clear (inherit != 0) or set close-on-exec on the descriptors opened by exec,
+ * around spawning a child.
+ */
+void shell_fds_inherit(int inherit)
+{
+    for (size_t i = 0; i < nshell_fds; ++i)
+        fcntl(shell_fds[i], F_SETFD, inherit ? 0 : FD_CLOEXEC);
+    for (size_t i = 0; i < nprocsubs && !procsub_spawning; ++i)
+        if (procsubs[i].fd >= 0)
+            fcntl(procsubs[i].fd, F_SETFD, inherit ? 0 : FD_CLOEXEC);
+}
+
+/*
+ * Process substitution: if word is <(cmd) or >(cmd), start cmd with its
+ * stdout, or stdin, on a pipe and return "/dev/fd/N" naming the shell's end
+ * of the pipe, as a new string. The words of cmd are expanded, and may
+ * include redirections. Returns NULL if word is not a process substitution.
+ */
+char *proc_subst(char const *word)
+{
+    size_t len = strlen(word);
+    if ((word[0] != '<' && word[0] != '>') || word[1] != '(' || len < 3 || word[len - 1] != ')')
+        return NULL;
+    int out = word[0] == '<';
+
+    char *inner = strndup(word + 2, len - 3);
+    char *sub[MAX_WORDS] = {0};
+    struct redir r[MAX_WORDS + 2];
+    char *argv[MAX_WORDS + 1];
+    size_t nr = 1, argc = 0;
+    if (!inner)
+        err(1, "strdup");
+    size_t nsub = wordsplit_into(inner, sub, MAX_WORDS);
+    free(inner);
+    for (size_t i = 0; i < nsub; ++i)
+    {
+        char *exp = expand(sub[i]);
+        free(sub[i]);
+        sub[i] = exp;
+    }
+    for (size_t i = 0; i < nsub; ++i)
+    {
+        int n = parse_redir(sub[i], r + nr);
+        if (n > 0)
+        {
+            if (r[nr].op < REDIR_DUP)
+                r[nr].target = i + 1 < nsub ? sub[++i] : NULL;
+            nr += n;
+        }
+        else
+            argv[argc++] = sub[i];
+    }
+    argv[argc] = NULL;
+
+    // The shell's end of the pipe is moved above the descriptors exec may use
+    int p[2], fd = -1;
+    char *path = NULL;
+    if (argc == 0)
+        fprintf(stderr, "smallsh: %s: empty process substitution\n", word);
+    else if (pipe2(p, O_CLOEXEC) < 0)
+        warn("pipe");
+    else
+    {
+        fd = fcntl(p[!out], F_DUPFD_CLOEXEC, SHELL_FD_MAX + 1);
+        close(p[!out]);
+        r[0] = (struct redir){.fd = out ? STDOUT_FILENO : STDIN_FILENO, .op = REDIR_DUP, .src = p[out]};
+        procsub_spawning = 1;
+        pid_t pid = fd < 0 ? -1 : spawn_cmd(argv, r, nr);
+        procsub_spawning = 0;
+        close(p[out]);
+        if (pid < 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+        else
+        {
+            if (nprocsubs == procsubs_cap)
+            {
+                procsubs_cap = procsubs_cap ? procsubs_cap * 2 : 8;
+                procsubs = realloc(procsubs, sizeof *procsubs * procsubs_cap);
+                if (!procsubs)
+                    err(1, "realloc");
+            }
+            procsubs[nprocsubs++] = (struct procsub){.pid = pid, .fd = fd};
+        }
+    }
+    for (size_t i = 0; i < nsub; ++i)
+        free(sub[i]);
+
+    // A failed substitution stays as it is, and names no file
+    if (fd < 0 ? !(path = strdup(word)) : asprintf(&path, "/dev/fd/%d", fd) < 0)
+        err(1, "asprintf");
+    return path;
+}
+
+/*
+ * Close the shell's end of the pipes of process substitutions once the
+ * command using them has run, and reap the helpers that have finished
+ */
+void procsub_close()
+{
+    for (size_t i = 0; i < nprocsubs; ++i)
+    {
+        if (procsubs[i].fd >= 0)
+            close(procsubs[i].fd);
+        procsubs[i].fd = -1;
+    }
+    for (size_t i = 0; i < nprocsubs;)
+    {
+        int status;
+        if (waitpid(procsubs[i].pid, &status, WNOHANG) != 0)
+            procsubs[i] = procsubs[--nprocsubs];
+        else
+            ++i;
+    }
+}
+
+/*
+ * Forget process substitution helper pid if it is one, once reaped elsewhere.
+ * Returns whether it was.
+ */
+int procsub_reap(pid_t pid)
+{
+    for (size_t i = 0; i < nprocsubs; ++i)
+    {
+        if (procsubs[i].pid == pid)
+        {
+            procsubs[i] = procsubs[--nprocsubs];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Execute commands
+ * If the command is a built-in command, execute it directly.
+ * Otherwise, execute it as a non-built-in command.
+ */
+void execute_cmds(char **words_argv, size_t words_argc)
+{
+    if (words_argc == 0)
+        return;
+
+    if (strcmp(words_argv[0], "cd") == 0)
+        builtin_cd(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "exit") == 0)
+        builtin_exit(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "exec") == 0)
+        builtin_exec(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "jobs") == 0 || strcmp(words_argv[0], "output") == 0)
+    {
+        if (save_fds() < 0)
+            return;
+        if (words_argv[0][0] == 'j')
+            builtin_jobs(words_argv, words_argc);
+        else
+            builtin_output(words_argv, words_argc);
+        restore_fds();
+    }
+    else if (strcmp(words_argv[0], "read") == 0 || strcmp(words_argv[0], "mapfile") == 0)
+    {
+        if (save_fds() < 0)
+            return;
+        if (words_argv[0][0] == 'r')
+            builtin_read(words_argv, words_argc);
+        else
+            builtin_mapfile(words_argv, words_argc);
+        restore_fds();
+    }
+    else if (strcmp(words_argv[0], "waitfor") == 0)
+    {
+        if (save_fds() < 0)
+            return;
+        builtin_waitfor(words_argv, words_argc);
+        restore_fds();
+    }
+    else if (strcmp(words_argv[0], "watch") == 0)
+        builtin_watch(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "limit") == 0)
+        builtin_limit(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "echo") == 0)
+    {
+        if (save_fds() < 0)
+            return;
+        builtin_echo(words_argv, words_argc);
+        restore_fds();
+    }
+    else if (strcmp(words_argv[0], "coproc") == 0)
+        builtin_coproc(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "declare") == 0)
+        builtin_declare(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "unset") == 0)
+        builtin_unset(words_argv, words_argc);
+    else if (strncmp(words_argv[0], "((", 2) == 0)
+        builtin_arith(words_argv, words_argc);
+    else if (strcmp(words_argv[0], "memo") == 0)
+    {
+        // Builtins honor redirections for the duration of the command
+        if (save_fds() < 0)
+            return;
+        builtin_memo(words_argv, words_argc);
+        restore_fds();
+    }
+    else if (builtin_fs(words_argv, words_argc) < 0 && builtin_text(words_argv, words_argc) < 0)
+        execute_nonbuiltin_cmds(words_argv);
+}
+
+/*
+ * Apply redirections to the current process, in order.
+ * Returns 0 on success, or -1 after printing a message to stderr.
+ */
+int apply_redirections(struct redir const *r, size_t nr)
+{
+    for (size_t i = 0; i < nr; ++i)
+    {
+        int fd;
+        switch (r[i].op)
+        {
+        case REDIR_IN:
+        case REDIR_OUT:
+        case REDIR_APPEND:
+            if (!r[i].target)
+            {
+                warnx("no file for redirection");
+                return -1;
+            }
+            if (r[i].op == REDIR_APPEND && (fd = append_cache_get(r[i].target)) >= 0)
+            {
+                if (dup2(fd, r[i].fd) < 0)
+                {
+                    warn("dup2");
+                    return -1;
+                }
+                break;
+            }
+            fd = open(r[i].target, redir_flags[r[i].op] | O_CLOEXEC, 0777);
+            if (fd < 0)
+            {
+                warn("%s", r[i].target);
+                return -1;
+            }
+            if (fd == r[i].fd)
+                fcntl(fd, F_SETFD, 0);
+            else
+            {
+                if (dup2(fd, r[i].fd) < 0)
+                {
+                    warn("dup2");
+                    close(fd);
+                    return -1;
+                }
+                close(fd);
+            }
+            break;
+        case REDIR_DUP:
+            if (r[i].src != r[i].fd && dup2(r[i].src, r[i].fd) < 0)
+            {
+                warn("%d", r[i].src);
+                return -1;
+            }
+            break;
+        case REDIR_CLOSE:
+            close(r[i].fd);
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Move fd, a descriptor the shell keeps, above SHELL_FD_MAX and make it
+ * close-on-exec, out of the way of the descriptors exec and redirections
+ * use. fd is closed. Returns the new descriptor, or -1 with errno set.
+ */
+int shell_fd_move(int fd)
+{
+    if (fd < 0 || fd > SHELL_FD_MAX)
+        return fd;
+    int hi = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MAX + 1);
+    int e = errno;
+    close(fd);
+    errno = e;
+    return hi;
+}
+
+/*
+ * Whether fd is a descriptor the shell uses itself, which exec must not
+ * replace: at most SHELL_FD_MAX, these are the jobserver pipe of a make
+ * that started the shell, whose numbers children find in MAKEFLAGS
+ */
+int shell_fd_used(int fd)
+{
+    jobserver_init();
+    return fd == jobserver_wfd || fd == jobserver_rfd || fd == jobserver_auth_rfd;
+}
+
+/*
+ * Save the descriptors redirected by the current command and apply its
+ * redirections, for a builtin running in the shell process.
+ * On failure the descriptors are restored, $? is set to 1 and -1 is returned.
+ */
+int save_fds()
+{
+    // Buffered output goes where it was written to
+    if (nredirs > 0)
+        out_flush();
+    for (size_t i = 0; i < nredirs; ++i)
+        saved_fds[i] = fcntl(redirs[i].fd, F_DUPFD_CLOEXEC, 10);
+
+    if (apply_redirections(redirs, nredirs) < 0)
+    {
+        restore_fds();
+        set_status(1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Restore the descriptors saved by save_fds, in reverse order so that
+ * a descriptor redirected more than once gets its original back.
+ */
+void restore_fds()
+{
+    if (nredirs > 0)
+        out_flush();
+    for (size_t i = nredirs; i-- > 0;)
+    {
+        if (saved_fds[i] < 0)
+        {
+            // Was not open before the redirection
+            close(redirs[i].fd);
+            continue;
+        }
+        dup2(saved_fds[i], redirs[i].fd);
+        close(saved_fds[i]);
+        if (redirs[i].fd > STDERR_FILENO)
+            fcntl(redirs[i].fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/*
+ * Set $? to the given exit status
+ */
+void set_status(int status)
+{
+    sprintf(int_buf, "%d", status);
+    setenv("?", int_buf, 1);
+}
+
+/*
+ * Spawn argv as a child process with the redirections r applied. The
+ * redirections become posix_spawn file actions, so no fork is needed.
+ * SIGINT and SIGTSTP are restored to their dispositions at startup.
+ * Returns the pid of the child, or -1 after printing a message.
+ */
+pid_t spawn_cmd(char **argv, struct redir const *r, size_t nr)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    pid_t pid;
+    int rc = 0;
+
+    // Builtin output comes before the command's
+    out_flush();
+    int fd;
+
+    // Children see the jobserver in MAKEFLAGS when this shell is the server
+    jobserver_init();
+
+    posix_spawn_file_actions_init(&actions);
+    for (size_t i = 0; i < nr && rc == 0; ++i)
+    {
+        switch (r[i].op)
+        {
+        case REDIR_IN:
+        case REDIR_OUT:
+        case REDIR_APPEND:
+            if (!r[i].target)
+            {
+                warnx("no file for redirection");
+                posix_spawn_file_actions_destroy(&actions);
+                return -1;
+            }
+            if (r[i].op == REDIR_APPEND && (fd = append_cache_get(r[i].target)) >= 0)
+                rc = posix_spawn_file_actions_adddup2(&actions, fd, r[i].fd);
+            else
+                rc = posix_spawn_file_actions_addopen(&actions, r[i].fd, r[i].target, redir_flags[r[i].op], 0777);
+            break;
+        case REDIR_DUP:
+            rc = posix_spawn_file_actions_adddup2(&actions, r[i].src, r[i].fd);
+            break;
+        case REDIR_CLOSE:
+            rc = posix_spawn_file_actions_addclose(&actions, r[i].fd);
+            break;
+        }
+    }
+
+    // Set to default signal handling, unless ignored when we started
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigdefault);
+    if (interactive && SIGINT_default.sa_handler != SIG_IGN)
+        sigaddset(&sigdefault, SIGINT);
+    if (interactive && SIGTSTP_default.sa_handler != SIG_IGN)
+        sigaddset(&sigdefault, SIGTSTP);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    struct limits limits;
+    if (spawn_limits)
+        limits = *spawn_limits;
+    else
+        limits_current(&limits);
+    int forked = limits.mem || limits.cpu || limits.nofile || spawn_cgroup;
+
+    // A delayed job runs, and finds its command, with the environment of its line
+    char **env = environ;
+    if (spawn_env)
+        environ = spawn_env;
+    if (rc == 0)
+    {
+        // Check if contain /: use the path, otherwise search the PATH
+        shell_fds_inherit(1);
+        if (forked)
+            rc = spawn_fork(&pid, argv, r, nr, &limits, spawn_cgroup);
+        else if (strchr(argv[0], '/') != NULL)
+            rc = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+        else
+            rc = spawn_path(&pid, argv, &actions, &attr);
+        shell_fds_inherit(0);
+        // A process is created even if exec fails
+        ++spawn_count;
+    }
+    environ = env;
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rc < 0)
+        return -1; // Reported by spawn_fork
+    if (rc != 0)
+    {
+        // Name the redirection that failed, if it can be told apart
+        for (size_t i = 0; i < nr; ++i)
+        {
+            if (r[i].op == REDIR_IN ? access(r[i].target, R_OK) < 0
+                : r[i].op < REDIR_DUP && access(r[i].target, W_OK) < 0 && errno != ENOENT)
+            {
+                warn("%s", r[i].target);
+                return -1;
+            }
+            if (r[i].op == REDIR_DUP && fcntl(r[i].src, F_GETFD) < 0)
+            {
+                warn("%d", r[i].src);
+                return -1;
+            }
+        }
+        warnx("%s: %s", argv[0], strerror(rc));
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * posix_spawnp, with the PATH search answered from the shared path cache when
+ * it is enabled. A cached path that no longer runs is removed and searched again.
+ */
+int spawn_path(pid_t *pid, char **argv, posix_spawn_file_actions_t const *actions, posix_spawnattr_t const *attr)
+{
+    struct path_cache *c = path_cache_get();
+    if (!c)
+        return posix_spawnp(pid, argv[0], actions, attr, argv, environ);
+
+    char const *env = getenv("PATH");
+    uint64_t h = fnv1a(FNV_OFFSET, env ? env : "", env ? strlen(env) : 0);
+    char path[sizeof c->slots[0].path];
+    if (path_cache_find(c, h, argv[0], path) == 0)
+    {
+        int rc = posix_spawn(pid, path, actions, attr, argv, environ);
+        if (rc != ENOENT && rc != ENOTDIR && rc != EACCES)
+            return rc;
+        path_cache_store(c, h, argv[0], NULL);
+    }
+    if (path_search(argv[0], path, sizeof path) != 0)
+        return posix_spawnp(pid, argv[0], actions, attr, argv, environ);
+    path_cache_store(c, h, argv[0], path);
+    return posix_spawn(pid, path, actions, attr, argv, environ);
+}
+
+/*
+ * Map the shared path cache named by SMALLSH_PATH_CACHE, once.
+ * Returns the table, or NULL if the cache is disabled or unusable.
+ */
+struct path_cache *path_cache_get()
+{
+    if (path_cache_ready)
+        return path_cache;
+    path_cache_ready = 1;
+
+    char *file = getenv("SMALLSH_PATH_CACHE");
+    if (!file || !*file)
+        return NULL;
+    int fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (st.st_size < (off_t)sizeof *path_cache && ftruncate(fd, sizeof *path_cache) < 0))
+    {
+        warn("%s", file);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    struct path_cache *c = mmap(NULL, sizeof *c, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c == MAP_FAILED)
+    {
+        warn("%s", file);
+        return NULL;
+    }
+
+    // A new file is all zeros: empty slots, claimed by the first shell to map it
+    uint64_t magic = 0;
+    __atomic_compare_exchange_n(&c->magic, &magic, PATH_CACHE_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if (magic != 0 && magic != PATH_CACHE_MAGIC)
+    {
+        warnx("%s: not a path cache", file);
+        munmap(c, sizeof *c);
+        return NULL;
+    }
+    path_cache = c;
+    return c;
+}
+
+/*
+ * Key of command name under the PATH with hash path_hash; never 0
+ */
+uint64_t path_cache_key(uint64_t path_hash, char const *name)
+{
+    uint64_t key = fnv1a(path_hash, name, strlen(name));
+    return key ? key : 1;
+}
+
+/*
+ * Look up name in the shared path cache and copy its path to buf.
+ * Returns 0 on a hit, or -1.
+ */
+int path_cache_find(struct path_cache *c, uint64_t path_hash, char const *name, char *buf)
+{
+    uint64_t key = path_cache_key(path_hash, name);
+    for (size_t i = 0; i < PATH_CACHE_PROBE; ++i)
+    {
+        struct path_slot *s = &c->slots[(key + i) & (PATH_CACHE_SLOTS - 1)];
+        for (int tries = 0; tries < 4; ++tries)
+        {
+            uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1)
+                continue;
+            uint64_t k = __atomic_load_n(&s->key, __ATOMIC_RELAXED);
+            if (k == 0)
+                return -1;
+            if (k != key)
+                break;
+            int match = s->path_hash == path_hash && strncmp(s->name, name, sizeof s->name) == 0;
+            memcpy(buf, s->path, sizeof s->path);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+                continue;
+            if (!match)
+                break;
+            buf[sizeof s->path - 1] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Store path for name in the shared path cache, or with path NULL remove it.
+ * A writer owns a slot while its sequence number is odd; a busy slot is
+ * skipped rather than waited for. A new name takes the first empty or
+ * removed slot on its probe sequence, or else replaces the first slot.
+ */
+void path_cache_store(struct path_cache *c, uint64_t path_hash, char const *name, char const *path)
+{
+    uint64_t key = path_cache_key(path_hash, name);
+    struct path_slot *victim = NULL, *unused = NULL;
+
+    if (strlen(name) >= sizeof victim->name || (path && strlen(path) >= sizeof victim->path))
+        return;
+    for (size_t i = 0; i < PATH_CACHE_PROBE && !victim; ++i)
+    {
+        struct path_slot *s = &c->slots[(key + i) & (PATH_CACHE_SLOTS - 1)];
+        uint64_t k = __atomic_load_n(&s->key, __ATOMIC_RELAXED);
+        if (k == key)
+            victim = s;
+        else if (k <= 1 && !unused)
+            unused = s;
+        if (k == 0)
+            break;
+    }
+    if (!victim && !path)
+        return;
+    if (!victim)
+        victim = unused ? unused : &c->slots[key & (PATH_CACHE_SLOTS - 1)];
+
+    uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (path)
+    {
+        __atomic_store_n(&victim->key, key, __ATOMIC_RELAXED);
+        victim->path_hash = path_hash;
+        strncpy(victim->name, name, sizeof victim->name);
+        strncpy(victim->path, path, sizeof victim->path);
+    }
+    else
+    {
+        // Removing leaves a tombstone that does not end the probe sequence
+        __atomic_store_n(&victim->key, 1, __ATOMIC_RELAXED);
+        victim->name[0] = '\0';
+    }
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Find command name in the directories of $PATH, as execvp would, and copy
+ * its path to buf. Returns 0 if found, 1 if the result depends on the
+ * working directory through a relative directory in $PATH (and is not to be
+ * cached), or -1 if not found.
+ */
+int path_search(char const *name, char *buf, size_t size)
+{
+    char const *path = getenv("PATH");
+    if (!path)
+        path = "/bin:/usr/bin";
+    int relative = 0;
+    for (char const *dir = path, *end; ; dir = end + 1)
+    {
+        end = strchrnul(dir, ':');
+        size_t n = end - dir;
+        struct stat st;
+        relative |= dir[0] != '/';
+        if (n + strlen(name) + 2 <= size)
+        {
+            if (n == 0)
+                snprintf(buf, size, "%s", name);
+            else
+                snprintf(buf, size, "%.*s/%s", (int)n, dir, name);
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0)
+                return relative;
+        }
+        if (*end == '\0')
+            return relative ? 1 : -1;
+    }
+}
+
+/*
+ * Look up an O_APPEND descriptor for path in the append cache, opening
+ * and caching one on a miss. An entry is reused only while path still
+ * names the same file, so rotated or deleted files are reopened.
+ * Returns a close-on-exec descriptor owned by the cache, or -1 when the
+ * cache is disabled or path is not a regular file.
+ */
+int append_cache_get(char const *path)
+{
+    char *env = getenv("SMALLSH_APPEND_CACHE");
+    long budget = env ? strtol(env, NULL, 10) : 0;
+    if (budget < 0)
+        budget = 0;
+    else if (budget > APPEND_CACHE_MAX)
+        budget = APPEND_CACHE_MAX;
+
+    // Shrink to the budget, which empties the cache when it is disabled
+    append_cache_shrink(budget);
+    if (budget == 0)
+        return -1;
+
+    struct stat st;
+    int exists = fstatat(AT_FDCWD, path, &st, 0) == 0;
+    if (exists && !S_ISREG(st.st_mode))
+        return -1;
+
+    for (size_t i = 0; i < nappend_cache; ++i)
+    {
+        struct append_entry *e = &append_cache[i];
+        if (strcmp(e->path, path) != 0)
+            continue;
+        if (exists && e->dev == st.st_dev && e->ino == st.st_ino)
+        {
+            e->used = ++append_clock;
+            return e->fd;
+        }
+        // Stale: the path now names another file, or none
+        append_cache_evict(i);
+        break;
+    }
+
+    // Miss: open the file and make room for it
+    int fd = open(path, redir_flags[REDIR_APPEND] | O_CLOEXEC, 0777);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    if ((fd = shell_fd_move(fd)) < 0)
+        return -1;
+    append_cache_shrink(budget - 1);
+
+    char *copy = strdup(path);
+    if (!copy)
+        err(1, "strdup");
+    append_cache[nappend_cache++] = (struct append_entry){
+        .path = copy, .fd = fd, .dev = st.st_dev, .ino = st.st_ino, .used = ++append_clock};
+    return fd;
+}
+
+/*
+ * Close and remove entry i of the append cache
+ */
+void append_cache_evict(size_t i)
+{
+    close(append_cache[i].fd);
+    free(append_cache[i].path);
+    append_cache[i] = append_cache[--nappend_cache];
+}
+
+/*
+ * Evict least-recently-used entries until at most n remain
+ */
+void append_cache_shrink(size_t n)
+{
+    while (nappend_cache > n)
+    {
+        size_t lru = 0;
+        for (size_t i = 1; i < nappend_cache; ++i)
+            if (append_cache[i].used < append_cache[lru].used)
+                lru = i;
+        append_cache_evict(lru);
+    }
+}
+
+/* Execute non-built-in commands. */
+void execute_nonbuiltin_cmds(char **words_argv)
+{
+    int status;
+    pid_t pid;
+
+    if (bg_flag != 0)
+    {
+        // Background process, do not wait for it to finish
+        struct job *j = job_add(0, words_argv);
+        if (ndelayed > 0 || !admit_job(j))
+            job_delay(j, words_argv, redirs, nredirs);
+        else
+            job_start(j, words_argv, redirs, nredirs);
+        return;
+    }
+
+    // A CPU share is enforced by a cgroup, as for background jobs
+    struct job fg = {0};
+    limits_current(&fg.limits);
+    char *cgroup = fg.limits.cpu_max ? cgroup_create(&fg) : NULL;
+    spawn_cgroup = cgroup;
+    pid = spawn_cmd(words_argv, redirs, nredirs);
+    spawn_cgroup = NULL;
+    if (pid < 0)
+    {
+        // Could not start the command: redirection or exec failure
+        if (cgroup)
+            rmdir(cgroup);
+        free(cgroup);
+        set_status(EXIT_FAILURE);
+        return;
+    }
+
+    /* Parent process */
+    // Foreground process, wait for it to finish or stop
+    journal_wait(pid);
+    pid = waitpid(pid, &status, WUNTRACED);
+    // Left in place if the command was stopped and continues
+    if (cgroup)
+        rmdir(cgroup);
+    free(cgroup);
+
+    if (WIFSIGNALED(status))
+    {
+        // Terminated by a signal
+        status = 128 + WTERMSIG(status);
+        sprintf(int_buf, "%d", status);
+        setenv("?", int_buf, 1);
+    }
+    else if (WIFSTOPPED(status))
+    {
+        // Stopped by a signal
+        fprintf(stderr, "Child process %d stopped. Continuing.\n", pid);
+        if (kill(pid, SIGCONT) < 0)
+        {
+            perror("kill");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(int_buf, "%d", pid);
+        setenv("!", int_buf, 1);
+    }
+    else if (WIFEXITED(status))
+    {
+        // Exited normally
+        status = WEXITSTATUS(status);
+        sprintf(int_buf, "%d", status);
+        setenv("?", int_buf, 1);
+    }
+}
+
+/*
+ * Start background job j running argv with redirections r. When output
+ * capture is enabled, stdout and stderr go to pipes ahead of r.
+ * Returns 0, or -1 after removing the job if it could not be started.
+ */
+int job_start(struct job *j, char **argv, struct redir const *r, size_t nr)
+{
+    int status;
+    pid_t pid;
+    int capture[2] = {-1, -1};
+
+    // The job runs with the limits in effect when it was started from the command line
+    j->cgroup = cgroup_create(j);
+    spawn_limits = &j->limits;
+    spawn_cgroup = j->cgroup;
+    if (capture_enabled())
+    {
+        // Give the job stdout and stderr pipes, ahead of its own redirections
+        struct redir *cr = malloc(sizeof *cr * (nr + 2));
+        int out[2], errp[2];
+        if (!cr)
+            err(1, "malloc");
+        if (pipe2(out, O_CLOEXEC) < 0)
+            err(1, "pipe2");
+        if (pipe2(errp, O_CLOEXEC) < 0)
+            err(1, "pipe2");
+        cr[0] = (struct redir){.fd = STDOUT_FILENO, .op = REDIR_DUP, .src = out[1]};
+        cr[1] = (struct redir){.fd = STDERR_FILENO, .op = REDIR_DUP, .src = errp[1]};
+        memcpy(cr + 2, r, sizeof *cr * nr);
+        pid = spawn_cmd(argv, cr, nr + 2);
+        free(cr);
+        close(out[1]);
+        close(errp[1]);
+        // The shell's ends stay open while the job runs, so keep them out of the way of exec
+        capture[0] = shell_fd_move(out[0]);
+        capture[1] = shell_fd_move(errp[0]);
+        if (capture[0] < 0 || capture[1] < 0)
+            err(1, "fcntl");
+        if (pid < 0)
+        {
+            close(capture[0]);
+            close(capture[1]);
+        }
+    }
+    else
+        pid = spawn_cmd(argv, r, nr);
+    spawn_limits = NULL;
+    spawn_cgroup = NULL;
+
+    if (pid < 0)
+    {
+        job_remove(j);
+        return -1;
+    }
+
+    j->pid = pid;
+    if (capture[0] >= 0)
+        capture_start(j, capture);
+    if (waitpid(pid, &status, WNOHANG | WUNTRACED) == pid && !WIFSTOPPED(status))
+        job_done(pid, status);
+    // Set $! to the pid of the last background process
+    sprintf(int_buf, "%d", pid);
+    setenv("!", int_buf, 1);
+    return 0;
+}
+
+/*
+ * Delay the start of job j, keeping a copy of its command, and of the
+ * working directory and environment it is to start with
+ */
+void job_delay(struct job *j, char **argv, struct redir const *r, size_t nr)
+{
+    struct pending *p = calloc(1, sizeof *p);
+    size_t argc = 0, nenv = 0;
+    while (argv[argc])
+        ++argc;
+    while (environ[nenv])
+        ++nenv;
+    if (!p || !(p->argv = calloc(argc + 1, sizeof *p->argv)) ||
+        !(p->redirs = malloc(sizeof *r * (nr + 1))) || !(p->env = calloc(nenv + 1, sizeof *p->env)))
+        err(1, "malloc");
+    // Entries of environ are reused in place when variables change
+    for (size_t i = 0; i < nenv; ++i)
+        if (!(p->env[i] = strdup(environ[i])))
+            err(1, "strdup");
+    p->cwd = shell_fd_move(open(".", O_PATH | O_DIRECTORY | O_CLOEXEC));
+    for (size_t i = 0; i < argc; ++i)
+        if (!(p->argv[i] = strdup(argv[i])))
+            err(1, "strdup");
+    memcpy(p->redirs, r, sizeof *r * nr);
+    for (size_t i = 0; i < nr; ++i)
+        if (r[i].target && !(p->redirs[i].target = strdup(r[i].target)))
+            err(1, "strdup");
+    p->nredirs = nr;
+    j->pending = p;
+    ++ndelayed;
+}
+
+/*
+ * Start up to max delayed jobs, oldest first, while admission allows
+ */
+void jobs_admit(size_t max)
+{
+    for (size_t i = 0; i < njobs && max > 0 && ndelayed > 0;)
+    {
+        struct job *j = jobs[i];
+        if (!j->pending)
+        {
+            ++i;
+            continue;
+        }
+        if (!admit_job(j))
+            return;
+
+        struct pending *p = j->pending;
+        j->pending = NULL;
+        --ndelayed;
+        --max;
+
+        // Relative paths are resolved in the working directory of its line
+        int here = p->cwd >= 0 ? open(".", O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (here >= 0 && fchdir(p->cwd) < 0)
+            warn("fchdir");
+        spawn_env = p->env;
+        int rc = job_start(j, p->argv, p->redirs, p->nredirs);
+        spawn_env = NULL;
+        if (here >= 0 && fchdir(here) < 0)
+            warn("fchdir");
+        if (here >= 0)
+            close(here);
+        if (rc == 0)
+            ++i;
+        pending_free(p);
+    }
+}
+
+/*
+ * Free the saved command of a delayed job
+ */
+void pending_free(struct pending *p)
+{
+    for (size_t i = 0; p->argv[i]; ++i)
+        free(p->argv[i]);
+    for (size_t i = 0; i < p->nredirs; ++i)
+        free(p->redirs[i].target);
+    for (size_t i = 0; p->env[i]; ++i)
+        free(p->env[i]);
+    if (p->cwd >= 0)
+        close(p->cwd);
+    free(p->argv);
+    free(p->redirs);
+    free(p->env);
+    free(p);
+}
+
+/*
+ * Wait until every delayed job has been started
+ */
+void jobs_drain()
+{
+    int64_t interval = DRAIN_MIN_NS;
+    while (ndelayed > 0)
+    {
+        size_t before = ndelayed;
+        bg_handler();
+        if (ndelayed == 0)
+            break;
+        interval = jobs_pause(ndelayed < before ? DRAIN_MIN_NS : interval);
+    }
+}
+
+/*
+ * Wait for up to interval nanoseconds for a job to become admissible. A
+ * child exiting may free a jobserver token, so the shell sleeps in
+ * sigtimedwait for SIGCHLD. Nothing reports pressure falling, so the
+ * interval between checks backs off: returns the next one.
+ */
+int64_t jobs_pause(int64_t interval)
+{
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+
+    // SIGCHLD is queued while blocked, and jobs start with it unblocked.
+    // A child that exited before it was blocked is still waitable.
+    siginfo_t si = {0};
+    pthread_sigmask(SIG_BLOCK, &chld, &old);
+    if (waitid(P_ALL, 0, &si, WEXITED | WNOHANG | WNOWAIT) < 0 || si.si_pid == 0)
+    {
+        struct timespec ts = {interval / 1000000000, interval % 1000000000};
+        sigtimedwait(&chld, NULL, &ts);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return interval * 2 > DRAIN_MAX_NS ? DRAIN_MAX_NS : interval * 2;
+}
+
+/*
+ * Admission control for background job j. Returns 0 while the pressure on
+ * a resource is above its threshold, set as a percentage in
+ * SMALLSH_PSI_CPU, SMALLSH_PSI_MEMORY or SMALLSH_PSI_IO, or while no
+ * jobserver token is available. Otherwise returns 1, with the token taken.
+ */
+int admit_job(struct job *j)
+{
+    static char const *const resources[] = {"cpu", "memory", "io"};
+    static char const *const vars[] = {"SMALLSH_PSI_CPU", "SMALLSH_PSI_MEMORY", "SMALLSH_PSI_IO"};
+
+    for (int i = 0; i < 3; ++i)
+    {
+        char *env = getenv(vars[i]);
+        if (!env || !*env)
+            continue;
+        if (pressure(resources[i]) > strtod(env, NULL))
+            return 0;
+    }
+    return jobserver_acquire(j);
+}
+
+/*
+ * Set up the jobserver on first use. As a client, join the jobserver named
+ * by --jobserver-auth (or --jobserver-fds) in MAKEFLAGS: a fifo:PATH or a
+ * pair of inherited pipe descriptors R,W. Otherwise, if SMALLSH_JOBS is set
+ * to n, act as the server: create a pipe holding n - 1 tokens and export it
+ * to children in MAKEFLAGS. This process holds one more, implicit token.
+ */
+void jobserver_init()
+{
+    if (jobserver_ready)
+        return;
+    jobserver_ready = 1;
+
+    char *flags = getenv("MAKEFLAGS");
+    char *auth = NULL;
+    for (char *p = flags; p && (p = strstr(p, "--jobserver-")); ++p)
+    {
+        if (strncmp(p, "--jobserver-auth=", 17) == 0)
+            auth = p + 17;
+        else if (strncmp(p, "--jobserver-fds=", 16) == 0)
+            auth = p + 16;
+    }
+
+    if (auth)
+    {
+        char path[PATH_MAX];
+        int r, w;
+        if (sscanf(auth, "fifo:%4095[^ ]", path) == 1)
+        {
+            jobserver_rfd = shell_fd_move(open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC));
+            jobserver_wfd = jobserver_rfd;
+        }
+        else if (sscanf(auth, "%d,%d", &r, &w) == 2 && r >= 0 && w >= 0 &&
+                 fcntl(r, F_GETFD) >= 0 && fcntl(w, F_GETFD) >= 0)
+        {
+            // Read through our own open file description so that
+            // O_NONBLOCK does not affect the other jobserver clients
+            snprintf(path, sizeof path, "/proc/self/fd/%d", r);
+            jobserver_rfd = shell_fd_move(open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+            jobserver_wfd = w;
+            jobserver_auth_rfd = r;
+        }
+        if (jobserver_rfd < 0)
+            jobserver_wfd = -1;
+        return;
+    }
+
+    char *env = getenv("SMALLSH_JOBS");
+    long n = env ? strtol(env, NULL, 10) : 0;
+    if (n < 1)
+        return;
+
+    // Server: the pipe is inherited by children, like make's own
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        warn("jobserver");
+        return;
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        int hi = fcntl(fds[i], F_DUPFD, SHELL_FD_MAX + 1);
+        if (hi >= 0)
+        {
+            close(fds[i]);
+            fds[i] = hi;
+        }
+    }
+    for (long i = 1; i < n; ++i)
+    {
+        if (write(fds[1], "+", 1) != 1)
+            break;
+    }
+
+    char path[64];
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fds[0]);
+    jobserver_rfd = shell_fd_move(open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC));
+    jobserver_wfd = fds[1];
+    if (jobserver_rfd < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        jobserver_wfd = -1;
+        return;
+    }
+
+    char *makeflags;
+    if (asprintf(&makeflags, "%s -j%ld --jobserver-auth=%d,%d", flags ? flags : "",
+                 n, fds[0], fds[1]) < 0)
+        err(1, "asprintf");
+    setenv("MAKEFLAGS", makeflags, 1);
+    free(makeflags);
+}
+
+/*
+ * Take a jobserver token for job j: the implicit token if no other job
+ * holds it, or one read from the jobserver. Returns 1 if j may start
+ * (always, without a jobserver), or 0 if no token is available.
+ */
+int jobserver_acquire(struct job *j)
+{
+    unsigned char token;
+
+    jobserver_init();
+    if (jobserver_rfd < 0)
+        return 1;
+    if (!jobserver_implicit)
+    {
+        jobserver_implicit = 1;
+        j->token = JOB_IMPLICIT_TOKEN;
+        return 1;
+    }
+    ssize_t n;
+    while ((n = read(jobserver_rfd, &token, 1)) < 0 && errno == EINTR)
+        ;
+    // 0 is the end of the pipe, once all its writers have closed it: no token either
+    if (n != 1)
+        return 0;
+    j->token = token;
+    return 1;
+}
+
+/*
+ * Return the jobserver token held by job j, if any
+ */
+void jobserver_release(struct job *j)
+{
+    unsigned char token = j->token;
+
+    if (j->token == JOB_IMPLICIT_TOKEN)
+        jobserver_implicit = 0;
+    else if (j->token >= 0)
+    {
+        while (write(jobserver_wfd, &token, 1) < 0 && errno == EINTR)
+            ;
+    }
+    j->token = JOB_NO_TOKEN;
+}
+
+/*
+ * Pressure on resource ("cpu", "memory" or "io") as a percentage: the
+ * "some avg10" share of time tasks stalled on it, from /proc/pressure.
+ * Without PSI, CPU pressure is estimated as the share of runnable tasks
+ * beyond the number of CPUs in the 1-minute load average, and memory
+ * pressure as the share of memory not available according to MemAvailable.
+ * Returns -1 if it cannot be determined.
+ */
+double pressure(char const *resource)
+{
+    char path[64];
+    double avg10 = -1;
+
+    snprintf(path, sizeof path, "/proc/pressure/%s", resource);
+    FILE *f = fopen(path, "re");
+    if (f)
+    {
+        if (fscanf(f, "some avg10=%lf", &avg10) != 1)
+            avg10 = -1;
+        fclose(f);
+        if (avg10 >= 0)
+            return avg10;
+    }
+
+    if (strcmp(resource, "cpu") == 0)
+    {
+        double load;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (getloadavg(&load, 1) != 1 || ncpu < 1)
+            return -1;
+        return load > ncpu ? 100 * (load - ncpu) / load : 0;
+    }
+    if (strcmp(resource, "memory") == 0)
+    {
+        char line[128];
+        long total = -1, avail = -1;
+        if (!(f = fopen("/proc/meminfo", "re")))
+            return -1;
+        while (fgets(line, sizeof line, f) && (total < 0 || avail < 0))
+        {
+            sscanf(line, "MemTotal: %ld", &total);
+            sscanf(line, "MemAvailable: %ld", &avail);
+        }
+        fclose(f);
+        if (total <= 0 || avail < 0)
+            return -1;
+        return 100 * (1 - (double)avail / total);
+    }
+    return -1;
+}
+
+/*
+ * Add a background job for pid, started from argv
+ */
+struct job *job_add(pid_t pid, char **argv)
+{
+    if (njobs == 0)
+        next_job_id = 1;
+    if (njobs == jobs_cap)
+    {
+        jobs_cap = jobs_cap ? jobs_cap * 2 : 16;
+        void *tmp = realloc(jobs, sizeof *jobs * jobs_cap);
+        if (!tmp)
+            err(1, "realloc");
+        jobs = tmp;
+    }
+
+    struct job *j = calloc(1, sizeof *j);
+    if (!j)
+        err(1, "calloc");
+    j->id = next_job_id++;
+    j->pid = pid;
+    j->token = JOB_NO_TOKEN;
+    limits_current(&j->limits);
+    for (int i = 0; i < 2; ++i)
+    {
+        j->cap[i].job = j;
+        j->cap[i].fd = -1;
+    }
+
+    // Command line, for job listings
+    build_str(NULL, NULL);
+    for (size_t i = 0; argv[i]; ++i)
+    {
+        if (i)
+            build_str(" ", NULL);
+        build_str(argv[i], NULL);
+    }
+    j->cmd = build_str(NULL, NULL);
+    if (!j->cmd)
+        j->cmd = strdup("");
+
+    jobs[njobs++] = j;
+    return j;
+}
+
+/*
+ * Remove job j from the job table and free it
+ */
+void job_remove(struct job *j)
+{
+    for (size_t i = 0; i < njobs; ++i)
+    {
+        if (jobs[i] != j)
+            continue;
+        memmove(jobs + i, jobs + i + 1, sizeof *jobs * (njobs - i - 1));
+        --njobs;
+        break;
+    }
+    if (j->pending)
+    {
+        --ndelayed;
+        pending_free(j->pending);
+    }
+    jobserver_release(j);
+    coproc_close(j);
+    ring_free(&j->out);
+    if (j->cgroup)
+        rmdir(j->cgroup);
+    free(j->cgroup);
+    free(j->cmd);
+    free(j);
+}
+
+/*
+ * Find a job by specification: %n for job number n, or a pid.
+ * NULL or "%+" is the most recent job.
+ */
+struct job *job_find(char const *spec)
+{
+    if (njobs == 0)
+        return NULL;
+    if (!spec || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0)
+        return jobs[njobs - 1];
+
+    char *end;
+    long n = strtol(spec + (*spec == '%'), &end, 10);
+    if (*end != '\0')
+        return NULL;
+    for (size_t i = 0; i < njobs; ++i)
+    {
+        if (*spec == '%' ? jobs[i]->id == n : jobs[i]->pid == n)
+            return jobs[i];
+    }
+    return NULL;
+}
+
+/*
+ * Record that a background job has been reaped. Jobs without captured
+ * output are removed; captured ones are kept until their output is shown.
+ */
+void job_done(pid_t pid, int status)
+{
+    for (size_t i = 0; i < njobs; ++i)
+    {
+        struct job *j = jobs[i];
+        if (j->pid != pid)
+            continue;
+        j->done = 1;
+        j->status = status;
+        jobserver_release(j);
+        coproc_done(j);
+        if (!j->captured && !j->coproc)
+        {
+            job_remove(j);
+            return;
+        }
+
+        // Bound the number of finished jobs kept for their output
+        size_t ndone = 0;
+        for (size_t k = njobs; k-- > 0;)
+        {
+            if (jobs[k]->done && ++ndone > MAX_DONE_JOBS && capture_closed(jobs[k]) && !jobs[k]->coproc)
+                job_remove(jobs[k]);
+        }
+        return;
+    }
+}
+
+/*
+ * Built-in commands: coproc NAME cmd [args...]
+ * Start cmd as a background job with its stdin and stdout on pipes, so that
+ * a long-lived helper can answer many requests without being started again.
+ * NAME[0] is the descriptor to read its output from, NAME[1] the one to write
+ * its input to, and NAME_PID its process ID. The redirections of the command
+ * apply to cmd, after the pipes.
+ */
+void builtin_coproc(char **argv, size_t argc)
+{
+    if (argc < 3 || !is_name(argv[1]))
+    {
+        fprintf(stderr, "smallsh: coproc: usage: coproc NAME cmd [args...]\n");
+        set_status(1);
+        return;
+    }
+    for (size_t i = 0; i < njobs; ++i)
+    {
+        if (jobs[i]->coproc && !jobs[i]->done && strcmp(jobs[i]->coproc, argv[1]) == 0)
+        {
+            fprintf(stderr, "smallsh: coproc: %s: already running\n", argv[1]);
+            set_status(1);
+            return;
+        }
+    }
+    // A finished coprocess of the same name gives up the output left unread
+    for (size_t i = njobs; i-- > 0;)
+    {
+        struct job *j = jobs[i];
+        if (!j->coproc || strcmp(j->coproc, argv[1]) != 0)
+            continue;
+        coproc_close(j);
+        if (!j->captured)
+            job_remove(j);
+    }
+
+    // The shell's ends of the pipes are moved above the descriptors exec may use
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0)
+        err(1, "pipe2");
+    if (pipe2(out, O_CLOEXEC) < 0)
+        err(1, "pipe2");
+    int rfd = fcntl(out[0], F_DUPFD_CLOEXEC, SHELL_FD_MAX + 1);
+    int wfd = fcntl(in[1], F_DUPFD_CLOEXEC, SHELL_FD_MAX + 1);
+    close(out[0]);
+    close(in[1]);
+    struct redir *r = malloc(sizeof *r * (nredirs + 2));
+    if (rfd < 0 || wfd < 0 || !r)
+        err(1, "fcntl");
+    r[0] = (struct redir){.fd = STDIN_FILENO, .op = REDIR_DUP, .src = in[0]};
+    r[1] = (struct redir){.fd = STDOUT_FILENO, .op = REDIR_DUP, .src = out[1]};
+    memcpy(r + 2, redirs, sizeof *r * nredirs);
+
+    // A coprocess counts against the jobserver and the pressure thresholds
+    // like other jobs, after those delayed before it. Its pipes are used by
+    // the next lines, so it is waited for rather than delayed.
+    struct job *j = job_add(0, argv + 2);
+    int64_t interval = DRAIN_MIN_NS;
+    for (size_t before = ndelayed;; before = ndelayed)
+    {
+        bg_handler();
+        if (ndelayed == 0 && admit_job(j))
+            break;
+        interval = jobs_pause(ndelayed < before ? DRAIN_MIN_NS : interval);
+    }
+
+    // The job closes the pipe to its input when it is reaped, even right away
+    if (!(j->coproc = strdup(argv[1])))
+        err(1, "strdup");
+    j->coproc_fds[0] = rfd;
+    j->coproc_fds[1] = wfd;
+    int rc = job_start(j, argv + 2, r, nredirs + 2);
+    free(r);
+    close(in[0]);
+    close(out[1]);
+    if (rc < 0)
+    {
+        set_status(1);
+        return;
+    }
+
+    size_t i = 0;
+    while (i < njobs && jobs[i] != j)
+        ++i;
+    if (i < njobs && j->coproc)
+    {
+        // Reaped already, it leaves only its output to read
+        char num[21];
+        size_t len = strlen(argv[1]);
+        var_unset(argv[1]);
+        struct var *v = array_get(argv[1], len, VAR_ARRAY);
+        for (int k = 0; k < 2 && j->coproc_fds[k] >= 0; ++k)
+        {
+            snprintf(num, sizeof num, "%d", j->coproc_fds[k]);
+            array_push(v, NULL, strdup(num));
+        }
+    }
+    if (i < njobs && !j->done)
+    {
+        char num[21];
+        size_t len = strlen(argv[1]);
+        char *pid_name = malloc(len + 5);
+        if (!pid_name)
+            err(1, "malloc");
+        snprintf(pid_name, len + 5, "%s_PID", argv[1]);
+        snprintf(num, sizeof num, "%jd", (intmax_t)j->pid);
+        var_set(pid_name, num);
+        free(pid_name);
+    }
+    set_status(0);
+}
+
+/*
+ * Close the shell's ends of the pipes of coprocess job j and unset its
+ * variables
+ */
+void coproc_close(struct job *j)
+{
+    if (!j->coproc)
+        return;
+    for (int k = 0; k < 2; ++k)
+        if (j->coproc_fds[k] >= 0)
+            close(j->coproc_fds[k]);
+    size_t len = strlen(j->coproc);
+    char *pid_name = malloc(len + 5);
+    if (!pid_name)
+        err(1, "malloc");
+    snprintf(pid_name, len + 5, "%s_PID", j->coproc);
+    var_unset(j->coproc);
+    var_unset(pid_name);
+    free(pid_name);
+    free(j->coproc);
+    j->coproc = NULL;
+}
+
+/*
+ * Once coprocess job j has finished, close the end of the pipe to its input
+ * and unset NAME[1] and NAME_PID. The end to read its output from stays
+ * open, with NAME[0] set, until it is closed or read to end of file.
+ */
+void coproc_done(struct job *j)
+{
+    if (!j->coproc)
+        return;
+    if (j->coproc_fds[0] < 0)
+    {
+        coproc_close(j);
+        return;
+    }
+    if (j->coproc_fds[1] >= 0)
+    {
+        close(j->coproc_fds[1]);
+        coproc_unset(j, 1);
+    }
+    size_t len = strlen(j->coproc);
+    char *pid_name = malloc(len + 5);
+    if (!pid_name)
+        err(1, "malloc");
+    snprintf(pid_name, len + 5, "%s_PID", j->coproc);
+    var_unset(pid_name);
+    free(pid_name);
+}
+
+/*
+ * Forget descriptor k of coprocess job j, and unset NAME[k] if it still
+ * holds it
+ */
+void coproc_unset(struct job *j, int k)
+{
+    char num[21], *elem = malloc(strlen(j->coproc) + 4);
+    if (!elem)
+        err(1, "malloc");
+    sprintf(elem, "%s[%d]", j->coproc, k);
+    snprintf(num, sizeof num, "%d", j->coproc_fds[k]);
+    char const *val = var_get(elem);
+    if (val && strcmp(val, num) == 0)
+        var_unset(elem);
+    free(elem);
+    j->coproc_fds[k] = -1;
+}
+
+/*
+ * If fd is the shell's end of a pipe to a coprocess, forget it, so that
+ * exec fd>&- can close it (to send end of file to the coprocess). A
+ * finished coprocess is removed along with its last descriptor.
+ * Returns whether it was.
+ */
+int coproc_forget(int fd)
+{
+    for (size_t i = 0; i < njobs; ++i)
+    {
+        struct job *j = jobs[i];
+        for (int k = 0; j->coproc && k < 2; ++k)
+        {
+            if (j->coproc_fds[k] != fd)
+                continue;
+            coproc_unset(j, k);
+            if (j->done && j->coproc_fds[0] < 0 && j->coproc_fds[1] < 0)
+            {
+                coproc_close(j);
+                if (!j->captured)
+                    job_remove(j);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * After reading to end of file from fd, close it if it is the output of a
+ * coprocess
+ */
+void coproc_eof(int fd)
+{
+    if (fd > SHELL_FD_MAX && coproc_forget(fd))
+        close(fd);
+}
+
+/*
+ * Built-in commands: echo [-n] [-e] [args...]
+ * Write the arguments separated by spaces, and a newline unless -n is given,
+ * to the stdout buffer. With -e, \\, \a, \b, \n, \r, \t and \c (no further
+ * output) are recognized.
+ */
+void builtin_echo(char **argv, size_t argc)
+{
+    int newline = 1, escapes = 0;
+    size_t i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] && strspn(argv[i] + 1, "ne") == strlen(argv[i] + 1); ++i)
+    {
+        newline &= !strchr(argv[i], 'n');
+        escapes |= strchr(argv[i], 'e') != NULL;
+    }
+    for (size_t first = i; i < argc; ++i)
+    {
+        char const *s = argv[i];
+        if (i > first)
+            out_write(STDOUT_FILENO, " ", 1);
+        while (escapes && *s)
+        {
+            size_t k = strcspn(s, "\\");
+            out_write(STDOUT_FILENO, s, k);
+            s += k;
+            if (!*s)
+                break;
+            char const *from = "\\abnrt", *to = "\\\a\b\n\r\t", *c = s[1] ? strchr(from, s[1]) : NULL;
+            if (s[1] == 'c')
+            {
+                set_status(0);
+                return;
+            }
+            if (c)
+                out_write(STDOUT_FILENO, to + (c - from), 1);
+            else
+                out_write(STDOUT_FILENO, s, s[1] ? 2 : 1);
+            s += s[1] ? 2 : 1;
+        }
+        out_write(STDOUT_FILENO, s, strlen(s));
+    }
+    if (newline)
+        out_write(STDOUT_FILENO, "\n", 1);
+    set_status(0);
+}
+
+/*
+ * Built-in commands: jobs
+ * List background jobs with their state.
+ */
+void builtin_jobs(char **argv, size_t argc)
+{
+    for (size_t i = 0; i < njobs; ++i)
+    {
+        struct job *j = jobs[i];
+        char state[32] = "Running";
+        if (j->pending)
+        {
+            out_printf(STDOUT_FILENO, "[%d] %-8s %-12s %s\n", j->id, "-", "Delayed", j->cmd);
+            continue;
+        }
+        if (j->done && WIFSIGNALED(j->status))
+            snprintf(state, sizeof state, "Signaled %d", WTERMSIG(j->status));
+        else if (j->done)
+            snprintf(state, sizeof state, "Done %d", WEXITSTATUS(j->status));
+        out_printf(STDOUT_FILENO, "[%d] %-8jd %-12s %s\n", j->id, (intmax_t)j->pid, state, j->cmd);
+    }
+    if (ndelayed > 0)
+        out_printf(STDOUT_FILENO, "%zu delayed\n", ndelayed);
+    set_status(0);
+}
+
+/*
+ * Whether background job output capture is enabled with SMALLSH_CAPTURE
+ */
+int capture_enabled()
+{
+    char *env = getenv("SMALLSH_CAPTURE");
+    return env && *env && strcmp(env, "0") != 0;
+}
+
+/*
+ * Start capturing the output of job j from the read ends of its stdout
+ * and stderr pipes. The capture thread is started on first use.
+ */
+void capture_start(struct job *j, int fds[2])
+{
+    if (!capture_thread_started)
+    {
+        capture_epoll = shell_fd_move(epoll_create1(EPOLL_CLOEXEC));
+        if (capture_epoll < 0)
+            err(1, "epoll_create1");
+
+        // Keep signals for the main thread
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        int rc = pthread_create(&capture_thread, NULL, capture_loop, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (rc != 0)
+            errx(1, "pthread_create: %s", strerror(rc));
+        pthread_detach(capture_thread);
+        capture_thread_started = 1;
+    }
+
+    j->captured = 1;
+    for (int i = 0; i < 2; ++i)
+    {
+        j->cap[i].fd = fds[i];
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &j->cap[i]};
+        if (epoll_ctl(capture_epoll, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+            err(1, "epoll_ctl");
+    }
+}
+
+/*
+ * Whether both capture pipes of job j have been closed
+ */
+int capture_closed(struct job *j)
+{
+    pthread_mutex_lock(&capture_lock);
+    int closed = j->cap[0].fd < 0 && j->cap[1].fd < 0;
+    pthread_mutex_unlock(&capture_lock);
+    return closed;
+}
+
+/*
+ * Capture thread: move output from job pipes into their ring buffers
+ */
+void *capture_loop(void *arg)
+{
+    struct epoll_event ev[64];
+    char buf[65536];
+
+    for (;;)
+    {
+        int n = epoll_wait(capture_epoll, ev, sizeof ev / sizeof *ev, -1);
+        for (int i = 0; i < n; ++i)
+        {
+            struct capture *c = ev[i].data.ptr;
+            ssize_t len = read(c->fd, buf, sizeof buf);
+            if (len < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+
+            pthread_mutex_lock(&capture_lock);
+            if (len > 0)
+                ring_write(&c->job->out, buf, len);
+            else
+            {
+                // End of output
+                epoll_ctl(capture_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                c->fd = -1;
+            }
+            pthread_cond_broadcast(&capture_cond);
+            pthread_mutex_unlock(&capture_lock);
+        }
+    }
+    return arg;
+}
+
+/*
+ * Append n bytes to ring buffer r. When the in-memory buffer is full, its
+ * contents move to a larger mmap'd spill file; when that is full too, the
+ * oldest bytes are overwritten.
+ */
+void ring_write(struct ring *r, char const *data, size_t n)
+{
+    if (!r->buf)
+    {
+        r->buf = malloc(RING_SIZE);
+        if (!r->buf)
+            err(1, "malloc");
+        r->cap = RING_SIZE;
+    }
+    if (r->len + n > r->cap && !r->spilled)
+        ring_spill(r);
+
+    r->total += n;
+    if (n > r->cap)
+    {
+        // Only the tail fits
+        data += n - r->cap;
+        n = r->cap;
+    }
+    if (r->len + n > r->cap)
+    {
+        // Drop the oldest bytes
+        size_t drop = r->len + n - r->cap;
+        r->head = (r->head + drop) % r->cap;
+        r->len -= drop;
+    }
+
+    size_t tail = (r->head + r->len) % r->cap;
+    size_t first = n < r->cap - tail ? n : r->cap - tail;
+    memcpy(r->buf + tail, data, first);
+    memcpy(r->buf, data + first, n - first);
+    r->len += n;
+}
+
+/*
+ * Move the contents of ring buffer r to an unlinked, mmap'd spill file
+ * of SPILL_SIZE bytes. On failure r keeps its in-memory buffer.
+ */
+void ring_spill(struct ring *r)
+{
+    r->spilled = 1;
+
+    char const *dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+        dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    char *map = MAP_FAILED;
+    if (ftruncate(fd, SPILL_SIZE) == 0)
+        map = mmap(NULL, SPILL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    size_t first = r->len < r->cap - r->head ? r->len : r->cap - r->head;
+    memcpy(map, r->buf + r->head, first);
+    memcpy(map + first, r->buf, r->len - first);
+    free(r->buf);
+    r->buf = map;
+    r->cap = SPILL_SIZE;
+    r->head = 0;
+}
+
+/*
+ * Copy up to n bytes of ring buffer r, starting at absolute offset *pos,
+ * into dst and advance *pos. Bytes already overwritten are skipped.
+ * Returns the number of bytes copied.
+ */
+size_t ring_read(struct ring const *r, uint64_t *pos, char *dst, size_t n)
+{
+    uint64_t oldest = r->total - r->len;
+    if (*pos < oldest)
+        *pos = oldest;
+    size_t avail = r->total - *pos;
+    if (n > avail)
+        n = avail;
+    if (n == 0)
+        return 0;
+    size_t start = (r->head + (*pos - oldest)) % r->cap;
+    size_t first = n < r->cap - start ? n : r->cap - start;
+    memcpy(dst, r->buf + start, first);
+    memcpy(dst + first, r->buf, n - first);
+    *pos += n;
+    return n;
+}
+
+/*
+ * Free the buffer of ring buffer r
+ */
+void ring_free(struct ring *r)
+{
+    if (r->spilled && r->cap == SPILL_SIZE)
+        munmap(r->buf, SPILL_SIZE);
+    else
+        free(r->buf);
+    *r = (struct ring){0};
+}
+
+/*
+ * SIGINT handler that records the interrupt for a builtin to notice
+ */
+void SIGINT_interrupt_handler(int signo)
+{
+    interrupted = 1;
+}
+
+/*
+ * Built-in commands: output
+ * output [-f] [%n]
+ * Print the captured output of a background job. With -f, keep streaming
+ * new output until the job closes its stdout and stderr, or until SIGINT.
+ * The output of a finished job is discarded once it has been shown.
+ */
+void builtin_output(char **argv, size_t argc)
+{
+    int follow = argc > 1 && strcmp(argv[1], "-f") == 0;
+    char const *spec = argc > 1 + follow ? argv[1 + follow] : NULL;
+    struct job *j = job_find(spec);
+
+    if (argc > 2 + follow || !j)
+    {
+        fprintf(stderr, "smallsh: output: %s: no such job\n", spec ? spec : "%+");
+        set_status(1);
+        return;
+    }
+    if (!j->captured)
+    {
+        fprintf(stderr, "smallsh: output: %%%d: output not captured\n", j->id);
+        set_status(1);
+        return;
+    }
+
+    // Let SIGINT stop following
+    struct sigaction action = {0}, old;
+    action.sa_handler = SIGINT_interrupt_handler;
+    sigaction(SIGINT, &action, &old);
+    interrupted = 0;
+
+    char buf[65536];
+    uint64_t pos = 0;
+    int closed = 0;
+    while (!interrupted)
+    {
+        pthread_mutex_lock(&capture_lock);
+        size_t n = ring_read(&j->out, &pos, buf, sizeof buf);
+        closed = j->cap[0].fd < 0 && j->cap[1].fd < 0;
+        if (n == 0 && follow && !closed)
+        {
+            // Wait for more output
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if (ts.tv_nsec >= 1000000000)
+            {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&capture_cond, &capture_lock, &ts);
+        }
+        pthread_mutex_unlock(&capture_lock);
+
+        // After the buffered output of builtins, and written at once for -f
+        if (n > 0)
+            out_flush();
+        if (n > 0 && write_all(STDOUT_FILENO, buf, n) < 0)
+            break;
+        if (n == 0 && (!follow || closed))
+            break;
+    }
+    sigaction(SIGINT, &old, NULL);
+
+    if (j->done && closed && !interrupted && !j->coproc)
+        job_remove(j);
+    set_status(interrupted ? 130 : 0);
+}
+
+/*
+ * Append k bytes of src to the string *s of length *n, growing it geometrically.
+ * The string stays NUL-terminated. Returns 0, or -1 if out of memory.
+ */
+int str_append(char **s, size_t *n, size_t *cap, char const *src, size_t k)
+{
+    if (*n + k + 1 > *cap)
+    {
+        size_t c = *cap ? *cap : 64;
+        while (c < *n + k + 1)
+            c *= 2;
+        char *p = realloc(*s, c);
+        if (!p)
+            return -1;
+        *s = p;
+        *cap = c;
+    }
+    memcpy(*s + *n, src, k);
+    *n += k;
+    (*s)[*n] = '\0';
+    return 0;
+}
+
+/*
+ * Parse the options of read and mapfile: -u fd, and the flag option -flag.
+ * Returns the index of the first operand, or 0 after printing an error.
+ */
+size_t read_options(char **argv, size_t argc, char flag, int *set, int *fd)
+{
+    size_t i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i)
+    {
+        char *end;
+        if (strcmp(argv[i], "--") == 0)
+            return i + 1;
+        if (argv[i][1] == flag && argv[i][2] == '\0')
+            *set = 1;
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+        {
+            long n = strtol(argv[++i], &end, 10);
+            if (*argv[i] == '\0' || *end || n < 0 || n > INT_MAX || fcntl(n, F_GETFD) < 0)
+            {
+                fprintf(stderr, "smallsh: %s: %s: invalid file descriptor\n", argv[0], argv[i]);
+                return 0;
+            }
+            *fd = n;
+        }
+        else
+        {
+            fprintf(stderr, "smallsh: %s: usage: %s [-%c] [-u fd] [name...]\n", argv[0], argv[0], flag);
+            return 0;
+        }
+    }
+    return i;
+}
+
+/*
+ * Read a line from fd and append it, without its newline, to *line.
+ * Regular files are read a block at a time with pread through read_bufs,
+ * and the descriptor is then seeked to just after the newline. Other descriptors
+ * are read a byte at a time, so that no input after the line is consumed.
+ * Returns 1 if a newline was read, 0 at end of input, -1 on error.
+ */
+int read_line(int fd, char **line, size_t *n, size_t *cap)
+{
+    struct stat st;
+    off_t cur = lseek(fd, 0, SEEK_CUR);
+
+    if (cur < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        char c;
+        ssize_t r;
+        while ((r = read(fd, &c, 1)) == 1 || (r < 0 && errno == EINTR))
+        {
+            if (r < 0)
+                continue;
+            if (c == '\n')
+                return 1;
+            if (str_append(line, n, cap, &c, 1) < 0)
+                return -1;
+        }
+        return r < 0 ? -1 : 0;
+    }
+
+    struct read_buf local, *b = &local;
+    if (fd < READ_BUF_FDS)
+    {
+        if (!read_bufs[fd] && !(read_bufs[fd] = malloc(sizeof *read_bufs[fd])))
+            return -1;
+        b = read_bufs[fd];
+    }
+    if (b == &local || b->dev != st.st_dev || b->ino != st.st_ino || b->size != st.st_size ||
+        b->mtime.tv_sec != st.st_mtim.tv_sec || b->mtime.tv_nsec != st.st_mtim.tv_nsec ||
+        b->off + (off_t)b->pos != cur)
+    {
+        // Stale or no read-ahead: start a new block at the current offset
+        b->dev = st.st_dev;
+        b->ino = st.st_ino;
+        b->size = st.st_size;
+        b->mtime = st.st_mtim;
+        b->off = cur;
+        b->pos = b->len = 0;
+    }
+
+    int result = 0;
+    for (;;)
+    {
+        if (b->pos == b->len)
+        {
+            b->off += b->len;
+            b->pos = b->len = 0;
+            ssize_t r = pread(fd, b->buf, sizeof b->buf, b->off);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+            {
+                result = r < 0 ? -1 : 0;
+                break;
+            }
+            b->len = r;
+        }
+        char *start = b->buf + b->pos;
+        char *nl = memchr(start, '\n', b->len - b->pos);
+        size_t k = nl ? (size_t)(nl - start) : b->len - b->pos;
+        if (str_append(line, n, cap, start, k) < 0)
+        {
+            result = -1;
+            break;
+        }
+        b->pos += k + (nl != NULL);
+        if (nl)
+        {
+            result = 1;
+            break;
+        }
+    }
+    if (lseek(fd, b->off + b->pos, SEEK_SET) < 0)
+        b->pos = b->len = 0;
+    return result;
+}
+
+/*
+ * IFS class of c: 0 if it is not in ifs, 1 for IFS whitespace, 2 otherwise
+ */
+int ifs_class(char c, char const *ifs)
+{
+    if (c == '\0' || !strchr(ifs, c))
+        return 0;
+    return c == ' ' || c == '\t' || c == '\n' ? 1 : 2;
+}
+
+/*
+ * Built-in commands: read [-r] [-u fd] [name...]
+ * Read a line from fd (default stdin) and split it into fields on $IFS.
+ * Each name is set to one field, the last to the rest of the line (default
+ * REPLY). Without -r, a backslash quotes the next character and a backslash
+ * at the end of a line continues it. $? is 1 at end of input.
+ */
+void builtin_read(char **argv, size_t argc)
+{
+    int raw = 0, fd = STDIN_FILENO;
+    size_t first = read_options(argv, argc, 'r', &raw, &fd);
+    char *reply[] = {"REPLY"};
+    char **names = argv + first;
+    size_t nnames = argc - first;
+
+    if (first == 0)
+    {
+        set_status(1);
+        return;
+    }
+    out_flush_input(fd);
+    if (nnames == 0)
+    {
+        names = reply;
+        nnames = 1;
+    }
+    for (size_t i = 0; i < nnames; ++i)
+    {
+        if (!is_name(names[i]))
+        {
+            fprintf(stderr, "smallsh: read: %s: not a valid identifier\n", names[i]);
+            set_status(1);
+            return;
+        }
+    }
+
+    char *line = NULL;
+    size_t n = 0, cap = 0;
+    int r = read_line(fd, &line, &n, &cap);
+    while (r == 1 && !raw)
+    {
+        // A line ending in an unquoted backslash continues on the next one
+        size_t slashes = 0;
+        while (slashes < n && line[n - 1 - slashes] == '\\')
+            ++slashes;
+        if (slashes % 2 == 0)
+            break;
+        --n;
+        r = read_line(fd, &line, &n, &cap);
+    }
+    if (r < 0)
+    {
+        fprintf(stderr, "smallsh: read: %s\n", strerror(errno));
+        free(line);
+        set_status(1);
+        return;
+    }
+
+    char const *ifs = var_get("IFS");
+    if (!ifs)
+        ifs = " \t\n";
+    char *field = malloc(n + 1);
+    if (!field)
+        err(1, "malloc");
+    size_t p = 0;
+    for (size_t i = 0; i < nnames; ++i)
+    {
+        int last = i + 1 == nnames;
+        size_t len = 0, keep = 0;
+        while (p < n && ifs_class(line[p], ifs) == 1)
+            ++p;
+        while (p < n)
+        {
+            int class = ifs_class(line[p], ifs);
+            if (!raw && line[p] == '\\' && p + 1 < n)
+            {
+                field[len++] = line[p + 1];
+                p += 2;
+                keep = len;
+                continue;
+            }
+            if (class && !last)
+                break;
+            field[len++] = line[p++];
+            if (class != 1)
+                keep = len;
+        }
+        // The delimiter: IFS whitespace around at most one other IFS character
+        while (p < n && ifs_class(line[p], ifs) == 1)
+            ++p;
+        if (p < n && ifs_class(line[p], ifs) == 2)
+            ++p;
+        field[keep] = '\0';
+        var_set(names[i], field);
+    }
+    free(field);
+    free(line);
+    if (r == 0)
+        coproc_eof(fd);
+    set_status(r == 1 ? 0 : 1);
+}
+
+/*
+ * Built-in commands: mapfile [-t] [-u fd] [name]
+ * Read all lines from fd (default stdin) into the indexed array name
+ * (default MAPFILE), replacing its elements.
+ * With -t, the trailing newlines are removed. The rest of a regular file is
+ * mapped with mmap and split with memchr; other input is read in blocks.
+ */
+void builtin_mapfile(char **argv, size_t argc)
+{
+    int strip = 0, fd = STDIN_FILENO;
+    size_t first = read_options(argv, argc, 't', &strip, &fd);
+    char const *name = first && first < argc ? argv[first] : "MAPFILE";
+    if (first)
+        out_flush_input(fd);
+
+    if (first == 0 || argc > first + 1)
+    {
+        if (first)
+            fprintf(stderr, "smallsh: mapfile: too many arguments\n");
+        set_status(1);
+        return;
+    }
+    if (!is_name(name))
+    {
+        fprintf(stderr, "smallsh: mapfile: %s: not a valid identifier\n", name);
+        set_status(1);
+        return;
+    }
+
+    struct stat st;
+    off_t cur = lseek(fd, 0, SEEK_CUR);
+    char *map = MAP_FAILED, *data = NULL;
+    size_t len = 0, cap = 0, maplen = 0;
+    if (cur >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > cur)
+    {
+        off_t base = cur & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+        maplen = st.st_size - base;
+        map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, base);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, maplen, MADV_SEQUENTIAL);
+            data = map + (cur - base);
+            len = st.st_size - cur;
+            lseek(fd, st.st_size, SEEK_SET);
+        }
+    }
+    if (map == MAP_FAILED)
+    {
+        char buf[65536];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof buf)) != 0)
+        {
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0)
+            {
+                fprintf(stderr, "smallsh: mapfile: %s\n", strerror(errno));
+                free(data);
+                set_status(1);
+                return;
+            }
+            if (str_append(&data, &len, &cap, buf, r) < 0)
+                err(1, "realloc");
+        }
+    }
+
+    // Replace the array with the lines, in one vector
+    struct var *v = nvars ? var_find(name, strlen(name), 0) : NULL;
+    if (v && v->type == VAR_ASSOC)
+        var_unset(name);
+    v = array_get(name, strlen(name), VAR_ARRAY);
+    array_clear(v);
+    for (char const *p = data, *end = data + len; p < end;)
+    {
+        char const *nl = memchr(p, '\n', end - p);
+        size_t k = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+        char *line = strndup(p, k - (strip && nl));
+        if (!line)
+            err(1, "strndup");
+        array_push(v, NULL, line);
+        p += k;
+    }
+
+    if (map != MAP_FAILED)
+        munmap(map, maplen);
+    else
+        free(data);
+    coproc_eof(fd);
+    set_status(0);
+}
+
+/*
+ * Built-in commands: declare -a name... and declare -A name...
+ * Make each name an indexed (-a) or associative (-A) array. The value of a
+ * scalar of that name becomes element 0.
+ */
+void builtin_declare(char **argv, size_t argc)
+{
+    enum var_type type = argc > 1 && strcmp(argv[1], "-A") == 0 ? VAR_ASSOC : VAR_ARRAY;
+    int status = 0;
+    if (argc < 3 || (strcmp(argv[1], "-a") != 0 && strcmp(argv[1], "-A") != 0))
+    {
+        fprintf(stderr, "smallsh: declare: usage: declare -a|-A name...\n");
+        set_status(1);
+        return;
+    }
+    for (size_t i = 2; i < argc; ++i)
+    {
+        struct var *v = nvars ? var_find(argv[i], strlen(argv[i]), 0) : NULL;
+        if (!is_name(argv[i]))
+            fprintf(stderr, "smallsh: declare: %s: not a valid identifier\n", argv[i]);
+        else if (v && v->type != VAR_SCALAR && v->type != type)
+            fprintf(stderr, "smallsh: declare: %s: cannot convert between indexed and associative arrays\n",
+                    argv[i]);
+        else
+        {
+            array_get(argv[i], strlen(argv[i]), type);
+            continue;
+        }
+        status = 1;
+    }
+    set_status(status);
+}
+
+/*
+ * Built-in commands: unset name...
+ * Unset each variable, array or array element name[sub]
+ */
+void builtin_unset(char **argv, size_t argc)
+{
+    int status = 0;
+    for (size_t i = 1; i < argc; ++i)
+    {
+        size_t len = strcspn(argv[i], "[");
+        char *name = strndup(argv[i], len);
+        if (!name)
+            err(1, "strndup");
+        if (len > 0 && is_name(name) && (argv[i][len] == '\0' || argv[i][strlen(argv[i]) - 1] == ']'))
+            var_unset(argv[i]);
+        else
+        {
+            fprintf(stderr, "smallsh: unset: %s: not a valid identifier\n", argv[i]);
+            status = 1;
+        }
+        free(name);
+    }
+    set_status(status);
+}
+
+/*
+ * Directory containing path, as a new string: "." for a plain name
+ */
+char *path_parent(char const *path)
+{
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/')
+        --n;
+    while (n > 0 && path[n - 1] != '/')
+        --n;
+    while (n > 1 && path[n - 1] == '/')
+        --n;
+    char *dir = n == 0 ? strdup(".") : strndup(path, n);
+    if (!dir)
+        err(1, "strdup");
+    return dir;
+}
+
+/*
+ * Wait for an inotify event on fd for up to timeout milliseconds (-1 for no
+ * limit) and read the pending events into buf. Returns the number of bytes
+ * read, 0 on timeout, or -1 if interrupted by SIGINT or on error.
+ */
+ssize_t inotify_wait(int fd, char *buf, size_t size, int timeout)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    out_flush();
+    int rc = poll(&pfd, 1, timeout);
+    if (rc <= 0)
+        return rc;
+    ssize_t n = read(fd, buf, size);
+    if (n < 0 && errno == EAGAIN)
+        return inotify_wait(fd, buf, size, timeout);
+    return n;
+}
+
+/*
+ * Built-in commands: waitfor [--timeout seconds] path
+ * Wait until path exists, watching the deepest existing directory on the
+ * way to it with inotify. $? is 0 once it exists, 1 on timeout, and 130
+ * if interrupted by SIGINT.
+ */
+void builtin_waitfor(char **argv, size_t argc)
+{
+    double timeout = -1;
+    size_t i = 1;
+    if (argc > 2 && strcmp(argv[1], "--timeout") == 0)
+    {
+        char *end;
+        timeout = strtod(argv[2], &end);
+        if (*argv[2] == '\0' || *end || timeout < 0)
+        {
+            fprintf(stderr, "smallsh: waitfor: %s: invalid timeout\n", argv[2]);
+            set_status(1);
+            return;
+        }
+        i = 3;
+    }
+    if (i + 1 != argc)
+    {
+        fprintf(stderr, "smallsh: waitfor: usage: waitfor [--timeout seconds] path\n");
+        set_status(1);
+        return;
+    }
+    char const *path = argv[i];
+    if (access(path, F_OK) == 0)
+    {
+        set_status(0);
+        return;
+    }
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0)
+    {
+        fprintf(stderr, "smallsh: waitfor: inotify: %s\n", strerror(errno));
+        set_status(1);
+        return;
+    }
+    struct sigaction action = {0}, old;
+    action.sa_handler = SIGINT_interrupt_handler;
+    sigaction(SIGINT, &action, &old);
+    interrupted = 0;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int status = 1;
+    for (;;)
+    {
+        // Watch the deepest existing directory for the next component
+        char *dir = path_parent(path);
+        struct stat st;
+        while (stat(dir, &st) < 0 && strcmp(dir, ".") != 0 && strcmp(dir, "/") != 0)
+        {
+            char *up = path_parent(dir);
+            free(dir);
+            dir = up;
+        }
+        int wd = inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd < 0)
+        {
+            fprintf(stderr, "smallsh: waitfor: %s: %s\n", dir, strerror(errno));
+            free(dir);
+            break;
+        }
+        free(dir);
+        if (access(path, F_OK) == 0)
+        {
+            status = 0;
+            break;
+        }
+
+        int wait = -1;
+        if (timeout >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = timeout - (now.tv_sec - start.tv_sec) - (now.tv_nsec - start.tv_nsec) / 1e9;
+            wait = left > 0 ? (int)(left * 1000 + 0.5) : 0;
+        }
+        ssize_t n = inotify_wait(fd, buf, sizeof buf, wait);
+        if (n <= 0)
+        {
+            if (interrupted)
+                status = 130;
+            else if (n < 0)
+                fprintf(stderr, "smallsh: waitfor: %s\n", strerror(errno));
+            break;
+        }
+        inotify_rm_watch(fd, wd);
+    }
+    close(fd);
+    sigaction(SIGINT, &old, NULL);
+    set_status(status);
+}
+
+/*
+ * Built-in commands: watch path... -- cmd [args...]
+ * Run cmd, then again each time one of the paths changes, until SIGINT.
+ * A directory is watched for changes to its entries; a file through its
+ * parent directory, so that it is still watched after being replaced.
+ * Events arriving within WATCH_SETTLE_MS of each other cause a single run.
+ */
+void builtin_watch(char **argv, size_t argc)
+{
+    size_t sep = 1;
+    while (sep < argc && strcmp(argv[sep], "--") != 0)
+        ++sep;
+    if (sep == 1 || sep + 1 >= argc)
+    {
+        fprintf(stderr, "smallsh: watch: usage: watch path... -- cmd [args...]\n");
+        set_status(1);
+        return;
+    }
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0)
+    {
+        fprintf(stderr, "smallsh: watch: inotify: %s\n", strerror(errno));
+        set_status(1);
+        return;
+    }
+    // wds[i] watches argv[i + 1]; names[i] is its last component, or NULL for a directory
+    int *wds = malloc(sizeof *wds * sep);
+    char const **names = malloc(sizeof *names * sep);
+    if (!wds || !names)
+        err(1, "malloc");
+    uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    for (size_t i = 1; i < sep; ++i)
+    {
+        struct stat st;
+        char *dir = NULL;
+        names[i - 1] = NULL;
+        if (stat(argv[i], &st) < 0 || !S_ISDIR(st.st_mode))
+        {
+            dir = path_parent(argv[i]);
+            names[i - 1] = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        }
+        wds[i - 1] = inotify_add_watch(fd, dir ? dir : argv[i], mask | IN_ONLYDIR);
+        if (wds[i - 1] < 0)
+        {
+            fprintf(stderr, "smallsh: watch: %s: %s\n", argv[i], strerror(errno));
+            free(dir);
+            free(wds);
+            free(names);
+            close(fd);
+            set_status(1);
+            return;
+        }
+        free(dir);
+    }
+
+    struct sigaction action = {0}, old;
+    action.sa_handler = SIGINT_interrupt_handler;
+    sigaction(SIGINT, &action, &old);
+    interrupted = 0;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!interrupted)
+    {
+        execute_cmds(argv + sep + 1, argc - sep - 1);
+        bg_handler();
+
+        // Wait for a change to a watched path, then for the changes to settle
+        int changed = 0, wait = -1;
+        ssize_t n = 0;
+        while (!interrupted && (n = inotify_wait(fd, buf, sizeof buf, wait)) > 0)
+        {
+            for (char *p = buf; p < buf + n && !changed;)
+            {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                for (size_t i = 0; i + 1 < sep; ++i)
+                    if (ev->wd == wds[i] && (!names[i] || (ev->len && strcmp(ev->name, names[i]) == 0)))
+                        changed = 1;
+                p += sizeof *ev + ev->len;
+            }
+            if (changed)
+                wait = WATCH_SETTLE_MS;
+        }
+        if (n < 0 && !interrupted)
+        {
+            fprintf(stderr, "smallsh: watch: %s\n", strerror(errno));
+            break;
+        }
+    }
+    sigaction(SIGINT, &old, NULL);
+    free(wds);
+    free(names);
+    close(fd);
+    if (interrupted)
+        set_status(130);
+}
+
+/*
+ * Whether the file builtins are enabled with SMALLSH_FS_BUILTINS
+ */
+int fs_builtins_enabled()
+{
+    char *env = getenv("SMALLSH_FS_BUILTINS");
+    return env && *env && strcmp(env, "0") != 0;
+}
+
+/*
+ * Run argv as a file builtin if it is one and all its options are supported.
+ * Returns -1 when the command is to be run as an external command instead:
+ * the builtins are disabled, the command runs in the background, or it uses
+ * an option not listed in fs_cmds.
+ */
+int builtin_fs(char **argv, size_t argc)
+{
+    struct fs_cmd const *cmd = NULL;
+    for (size_t i = 0; i < sizeof fs_cmds / sizeof *fs_cmds; ++i)
+        if (strcmp(argv[0], fs_cmds[i].name) == 0)
+            cmd = &fs_cmds[i];
+    if (!cmd || bg_flag || !fs_builtins_enabled())
+        return -1;
+
+    int flags = 0;
+    size_t i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        for (char const *o = argv[i] + 1; *o; ++o)
+        {
+            char const *known = strchr(cmd->options, *o);
+            if (!known || *o == '-')
+                return -1;
+            flags |= 1 << (known - cmd->options);
+        }
+    }
+    if (argc - i < cmd->min_operands)
+        return -1;
+
+    if (save_fds() < 0)
+        return 0;
+    set_status(cmd->run(flags, argv + i, argc - i));
+    restore_fds();
+    return 0;
+}
+
+/*
+ * Print an error of file builtin name about path, from errno
+ */
+int fs_error(char const *name, char const *path)
+{
+    fprintf(stderr, "smallsh: %s: %s: %s\n", name, path, strerror(errno));
+    return 1;
+}
+
+/*
+ * dir/base, where base is the last component of path, as a new string
+ */
+char *path_into(char const *dir, char const *path)
+{
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/')
+        --n;
+    size_t start = n;
+    while (start > 0 && path[start - 1] != '/')
+        --start;
+    char *ret;
+    if (asprintf(&ret, "%s/%.*s", dir, (int)(n - start), path + start) < 0)
+        err(1, "asprintf");
+    return ret;
+}
+
+/*
+ * Whether path names a directory, following symbolic links
+ */
+int is_dir(char const *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Built-in commands: mkdir [-p] dir...
+ */
+int fs_mkdir(int flags, char **ops, size_t n)
+{
+    int status = 0;
+    for (size_t i = 0; i < n; ++i)
+        if ((flags & FS_OPT(0) ? make_dirs(ops[i]) : mkdirat(AT_FDCWD, ops[i], 0777)) < 0)
+            status = fs_error("mkdir", ops[i]);
+    return status;
+}
+
+/*
+ * Built-in commands: touch [-c] file...
+ * Set the times of each file to now, creating it unless -c is given.
+ */
+int fs_touch(int flags, char **ops, size_t n)
+{
+    int status = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (utimensat(AT_FDCWD, ops[i], NULL, 0) == 0 || (errno == ENOENT && (flags & FS_OPT(0))))
+            continue;
+        int fd = errno == ENOENT ? openat(AT_FDCWD, ops[i], O_WRONLY | O_CREAT | O_NOCTTY | O_NONBLOCK | O_CLOEXEC, 0666) : -1;
+        if (fd < 0)
+            status = fs_error("touch", ops[i]);
+        else
+            close(fd);
+    }
+    return status;
+}
+
+/*
+ * Built-in commands: ln [-s] [-f] target [link], ln [-s] [-f] target... dir
+ * Create a hard link, or with -s a symbolic link, replacing an existing
+ * link name with -f.
+ */
+int fs_ln(int flags, char **ops, size_t n)
+{
+    int status = 0;
+    int into = n == 1 || n > 2 || is_dir(ops[n - 1]);
+    size_t ntargets = n == 1 ? 1 : n - 1;
+    for (size_t i = 0; i < ntargets; ++i)
+    {
+        char *link = into ? path_into(n == 1 ? "." : ops[n - 1], ops[i]) : strdup(ops[1]);
+        if (!link)
+            err(1, "strdup");
+        for (int tries = 0; tries < 2; ++tries)
+        {
+            int rc = flags & FS_OPT(0) ? symlinkat(ops[i], AT_FDCWD, link)
+                                       : linkat(AT_FDCWD, ops[i], AT_FDCWD, link, 0);
+            if (rc == 0)
+                break;
+            if (tries == 0 && errno == EEXIST && (flags & FS_OPT(1)) && unlinkat(AT_FDCWD, link, 0) == 0)
+                continue;
+            status = fs_error("ln", link);
+            break;
+        }
+        free(link);
+    }
+    return status;
+}
+
+/*
+ * Copy the regular file src to dst, with copy_file_range so that file systems
+ * can share or copy the data without it passing through this process
+ */
+int copy_file(char const *src, char const *dst)
+{
+    struct stat st, dst_st;
+    int in = openat(AT_FDCWD, src, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return fs_error("cp", src);
+    if (fstat(in, &st) < 0)
+    {
+        close(in);
+        return fs_error("cp", src);
+    }
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino)
+    {
+        fprintf(stderr, "smallsh: cp: %s and %s are the same file\n", src, dst);
+        close(in);
+        return 1;
+    }
+    int out = openat(AT_FDCWD, dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (out < 0)
+    {
+        close(in);
+        return fs_error("cp", dst);
+    }
+
+    ssize_t r = 0;
+    off_t done = 0;
+    while (done < st.st_size && (r = copy_file_range(in, NULL, out, NULL, st.st_size - done, 0)) > 0)
+        done += r;
+    if (r < 0 && done == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        r = copy_fd(in, out);
+    int status = r < 0 ? fs_error("cp", dst) : 0;
+    close(in);
+    if (close(out) < 0 && status == 0)
+        status = fs_error("cp", dst);
+    return status;
+}
+
+/*
+ * Built-in commands: cp src dst, cp src... dir
+ * Copy regular files. Directories need cp -r, which is run as an external command.
+ */
+int fs_cp(int flags, char **ops, size_t n)
+{
+    int status = 0;
+    int into = n > 2 || is_dir(ops[n - 1]);
+    for (size_t i = 0; i + 1 < n; ++i)
+    {
+        if (is_dir(ops[i]))
+        {
+            fprintf(stderr, "smallsh: cp: %s: is a directory (not copied)\n", ops[i]);
+            status = 1;
+            continue;
+        }
+        char *dst = into ? path_into(ops[n - 1], ops[i]) : ops[n - 1];
+        status |= copy_file(ops[i], dst);
+        if (into)
+            free(dst);
+    }
+    return status;
+}
+
+/*
+ * Built-in commands: mv [-f] src dst, mv [-f] src... dir
+ * Rename with renameat. A move to another file system is handed to the
+ * external mv, which copies.
+ */
+int fs_mv(int flags, char **ops, size_t n)
+{
+    int status = 0;
+    int into = n > 2 || is_dir(ops[n - 1]);
+    for (size_t i = 0; i + 1 < n; ++i)
+    {
+        char *dst = into ? path_into(ops[n - 1], ops[i]) : ops[n - 1];
+        if (renameat(AT_FDCWD, ops[i], AT_FDCWD, dst) < 0)
+        {
+            if (errno != EXDEV)
+                status = fs_error("mv", ops[i]);
+            else
+            {
+                // Redirections are already applied to this process
+                char *argv[] = {"mv", "-f", "--", ops[i], dst, NULL};
+                int wstatus;
+                pid_t pid = spawn_cmd(argv, NULL, 0);
+                if (pid < 0)
+                    status = 1;
+                else
+                {
+                    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+                        ;
+                    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+                        status = 1;
+                }
+            }
+        }
+        if (into)
+            free(dst);
+    }
+    return status;
+}
+
+/*
+ * Built-in commands: rm [-r] [-R] [-f] path...
+ * Remove files, and with -r directory trees, using rm_tree
+ */
+int fs_rm(int flags, char **ops, size_t n)
+{
+    int recursive = flags & (FS_OPT(0) | FS_OPT(1)), force = flags & FS_OPT(2);
+    int status = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        char const *base = strrchr(ops[i], '/') ? strrchr(ops[i], '/') + 1 : ops[i];
+        if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 || strspn(ops[i], "/") == strlen(ops[i]))
+        {
+            fprintf(stderr, "smallsh: rm: %s: refusing to remove\n", ops[i]);
+            status = 1;
+            continue;
+        }
+        if (unlinkat(AT_FDCWD, ops[i], 0) == 0 || (force && errno == ENOENT))
+            continue;
+        if ((errno != EISDIR && errno != EPERM) || !recursive || !is_dir(ops[i]))
+            status = fs_error("rm", ops[i]);
+        else
+            status |= rm_tree(ops[i]);
+    }
+    return status;
+}
+
+/*
+ * Remove the directory tree at path. Directories are emptied by a pool of
+ * up to RM_THREADS threads, started as subdirectories are found; each
+ * directory is removed when its last subdirectory is.
+ * Returns 0, or 1 if anything could not be removed.
+ */
+int rm_tree(char const *path)
+{
+    struct rm_pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.max_threads = cpus > RM_THREADS ? RM_THREADS : cpus > 1 ? cpus - 1 : 0;
+
+    struct rm_task *root = calloc(1, sizeof *root);
+    if (!root || !(root->path = strdup(path)) || !(root->name = strdup(path)))
+        err(1, "calloc");
+    root->fd = -1;
+    root->pending = 1;
+    pool.head = root;
+
+    rm_worker(&pool);
+    for (size_t i = 0; i < pool.nthreads; ++i)
+        pthread_join(pool.threads[i], NULL);
+    return pool.status;
+}
+
+/*
+ * Take directories from the pool and empty them, until the tree is removed
+ */
+void *rm_worker(void *arg)
+{
+    struct rm_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->head && !pool->done)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->done)
+            break;
+        struct rm_task *t = pool->head;
+        pool->head = t->next;
+        pthread_mutex_unlock(&pool->lock);
+        rm_dir(pool, t);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Unlink the files in directory t and queue its subdirectories. t is opened
+ * relative to its parent's descriptor, without following a symbolic link,
+ * so a link swapped in for a directory being removed is not followed.
+ */
+void rm_dir(struct rm_pool *pool, struct rm_task *t)
+{
+    int pfd = t->parent ? t->parent->fd : AT_FDCWD;
+    int dfd = openat(pfd, t->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int lfd = dfd < 0 ? -1 : fcntl(dfd, F_DUPFD_CLOEXEC, 0);
+    DIR *d = lfd < 0 ? NULL : fdopendir(lfd);
+    if (!d)
+    {
+        rm_fail(pool, t->path);
+        if (dfd >= 0)
+            close(dfd);
+        if (lfd >= 0)
+            close(lfd);
+        rm_finish(pool, t);
+        return;
+    }
+    t->fd = dfd;
+
+    struct dirent *de;
+    while ((de = readdir(d)))
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        struct stat st;
+        int dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN && fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            dir = S_ISDIR(st.st_mode);
+        if (!dir && unlinkat(dfd, de->d_name, 0) == 0)
+            continue;
+        if (!dir && errno != EISDIR)
+        {
+            char *p = path_into(t->path, de->d_name);
+            rm_fail(pool, p);
+            free(p);
+            continue;
+        }
+
+        struct rm_task *child = calloc(1, sizeof *child);
+        if (!child || !(child->name = strdup(de->d_name)))
+            err(1, "calloc");
+        child->path = path_into(t->path, de->d_name);
+        child->fd = -1;
+        child->parent = t;
+        child->pending = 1;
+        __atomic_add_fetch(&t->pending, 1, __ATOMIC_RELAXED);
+
+        // Queue it, with another thread to take it if the pool can grow
+        int grow = 0;
+        pthread_mutex_lock(&pool->lock);
+        child->next = pool->head;
+        pool->head = child;
+        if (pool->nthreads < pool->max_threads && child->next)
+            grow = 1;
+        pthread_cond_signal(&pool->cond);
+        if (grow)
+        {
+            sigset_t all, old;
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &old);
+            if (pthread_create(&pool->threads[pool->nthreads], NULL, rm_worker, pool) == 0)
+                ++pool->nthreads;
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    closedir(d);
+    rm_finish(pool, t);
+}
+
+/*
+ * Drop one reference to directory t. The last one closes it and removes it
+ * from its parent's descriptor, then drops one reference to its parent;
+ * removing the top directory ends the pool.
+ */
+void rm_finish(struct rm_pool *pool, struct rm_task *t)
+{
+    while (t && __atomic_sub_fetch(&t->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        struct rm_task *parent = t->parent;
+        if (t->fd >= 0)
+            close(t->fd);
+        if (unlinkat(parent ? parent->fd : AT_FDCWD, t->name, AT_REMOVEDIR) < 0)
+            rm_fail(pool, t->path);
+        if (!parent)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->done = 1;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        free(t->name);
+        free(t->path);
+        free(t);
+        t = parent;
+    }
+}
+
+/*
+ * Report that path could not be removed, from errno
+ */
+void rm_fail(struct rm_pool *pool, char const *path)
+{
+    int saved = errno;
+    pthread_mutex_lock(&pool->lock);
+    errno = saved;
+    fs_error("rm", path);
+    pool->status = 1;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Whether the text builtins are enabled with SMALLSH_TEXT_BUILTINS
+ */
+int text_builtins_enabled()
+{
+    char *env = getenv("SMALLSH_TEXT_BUILTINS");
+    return env && *env && strcmp(env, "0") != 0;
+}
+
+/*
+ * Run argv as a text builtin if it is wc -l, head, tail or grep -F and all
+ * its options are supported. Returns -1 when the command is to be run as an
+ * external command instead, as for builtin_fs.
+ */
+int builtin_text(char **argv, size_t argc)
+{
+    struct text_cmd c = {.cmd = argv[0], .lines = 10};
+    size_t first;
+    if (bg_flag || !text_builtins_enabled() || text_args(&c, argv, argc, &first) < 0)
+        return -1;
+    if (save_fds() < 0)
+        return 0;
+
+    char *stdin_only[] = {"-"};
+    char **files = first < argc ? argv + first : stdin_only;
+    size_t nfiles = first < argc ? argc - first : 1;
+    uint64_t total = 0, sizes = 0;
+    int errors = 0, selected = 0, width = 1;
+    c.prefix = nfiles > 1;
+
+    // wc aligns the counts of several files to their total size, or to 7
+    // columns if one is not a regular file
+    for (size_t i = 0; *c.cmd == 'w' && c.prefix && i < nfiles; ++i)
+    {
+        struct stat st;
+        if ((strcmp(files[i], "-") == 0 ? fstat(STDIN_FILENO, &st) : stat(files[i], &st)) < 0)
+            continue;
+        if (S_ISREG(st.st_mode))
+            sizes += st.st_size;
+        else if (width < 7)
+            width = 7;
+    }
+    for (int digits = 1; sizes >= 10; sizes /= 10)
+        if (++digits > width)
+            width = digits;
+
+    for (size_t i = 0; i < nfiles && !(c.quiet && selected); ++i)
+    {
+        c.name = files[i];
+        if (strcmp(files[i], "-") == 0 && *c.cmd != 'w')
+            c.name = *c.cmd == 'g' ? "(standard input)" : "standard input";
+        if (text_file(&c, files[i]) != 0)
+        {
+            errors = 1;
+            continue;
+        }
+        selected |= c.count > 0;
+        total += c.count;
+        if (*c.cmd == 'w')
+            out_printf(STDOUT_FILENO, "%*" PRIu64 "%s%s\n", width, c.count, first < argc ? " " : "",
+                       first < argc ? c.name : "");
+        else if (c.count_only && !c.quiet)
+            out_printf(STDOUT_FILENO, "%s%s%" PRIu64 "\n", c.prefix ? c.name : "", c.prefix ? ":" : "",
+                       c.count);
+    }
+    if (*c.cmd == 'w' && c.prefix)
+        out_printf(STDOUT_FILENO, "%*" PRIu64 " total\n", width, total);
+    free(c.keep);
+
+    // grep: 0 if a line was selected, 1 if none was, 2 on an error
+    if (*c.cmd == 'g')
+        set_status(errors && !(c.quiet && selected) ? 2 : !selected);
+    else
+        set_status(errors);
+    restore_fds();
+    return 0;
+}
+
+/*
+ * Parse the options of text builtin c->cmd into c, and set *first to the
+ * index of its first file operand. Returns -1 if the command, or one of its
+ * options, is not supported.
+ */
+int text_args(struct text_cmd *c, char **argv, size_t argc, size_t *first)
+{
+    int grep = strcmp(c->cmd, "grep") == 0, lines = *c->cmd == 'h' || *c->cmd == 't';
+    int flags = 0;
+    if (!grep && strcmp(c->cmd, "wc") != 0 && strcmp(c->cmd, "head") != 0 && strcmp(c->cmd, "tail") != 0)
+        return -1;
+
+    size_t i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i)
+    {
+        char const *o = argv[i] + 1, *n = NULL;
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        if (lines)
+        {
+            // -n N, -nN, and the old form -N; tail -n +N counts from the start
+            if (*o == 'n')
+                n = o[1] ? o + 1 : i + 1 < argc ? argv[++i] : NULL;
+            else if (isdigit((unsigned char)*o))
+                n = o;
+            if (!n)
+                return -1;
+            c->from_start = *c->cmd == 't' && *n == '+';
+            n += c->from_start;
+            char *end;
+            errno = 0;
+            c->lines = strtoull(n, &end, 10);
+            if (!isdigit((unsigned char)*n) || *end || errno)
+                return -1;
+            continue;
+        }
+        char const *letters = grep ? "Fcqvn" : "l";
+        for (; *o; ++o)
+        {
+            char const *known = strchr(letters, *o);
+            if (!known)
+                return -1;
+            flags |= 1 << (known - letters);
+        }
+    }
+    if (*c->cmd == 'w' && !flags)
+        return -1;
+    if (grep)
+    {
+        // Without -F, a pattern without special characters is a fixed string too
+        if (i >= argc || strchr(argv[i], '\n') || (!(flags & 1) && strpbrk(argv[i], ".[]*^$\\")))
+            return -1;
+        c->pattern = argv[i++];
+        c->pattern_len = strlen(c->pattern);
+        c->count_only = (flags & 2) != 0;
+        c->quiet = (flags & 4) != 0;
+        c->invert = (flags & 8) != 0;
+        c->number = (flags & 16) != 0;
+    }
+    *first = i;
+    return 0;
+}
+
+/*
+ * Run text builtin c on the file path, or on stdin for "-", printing the
+ * header of head and tail before each of several files.
+ * Returns 0, or 1 after reporting an error.
+ */
+int text_file(struct text_cmd *c, char const *path)
+{
+    int std = strcmp(path, "-") == 0;
+    int fd = std ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return fs_error(c->cmd, path);
+    if (c->prefix && (*c->cmd == 'h' || *c->cmd == 't'))
+        out_printf(STDOUT_FILENO, "%s==> %s <==\n", c->shown++ ? "\n" : "", c->name);
+
+    c->left = c->from_start && c->lines ? c->lines - 1 : c->lines;
+    c->count = c->lineno = 0;
+    c->keep_len = c->keep_trimmed = 0;
+    int rc = text_scan(c, fd, *c->cmd == 'w' ? text_wc : *c->cmd == 'h' ? text_head :
+                              *c->cmd == 't' ? text_tail : text_grep);
+    if (rc < 0)
+        fs_error(c->cmd, path);
+    else if (c->keep_len > 0)
+    {
+        size_t k = tail_start(c->keep, c->keep_len, c->lines);
+        out_write(STDOUT_FILENO, c->keep + k, c->keep_len - k);
+    }
+    if (!std)
+        close(fd);
+    return rc < 0;
+}
+
+/*
+ * Pass the input of fd, from its offset, to fn in chunks of whole lines but
+ * for a last line without a newline. A regular file is mapped and passed as
+ * one chunk, with c->whole set, and its offset is left after the bytes fn
+ * used, as an external command would leave it. Other input is read in
+ * blocks of TEXT_BUF_SIZE. fn returns how many bytes of its chunk it used:
+ * fewer than all of them stops the scan.
+ * Returns 0, or -1 with errno set if reading failed.
+ */
+int text_scan(struct text_cmd *c, int fd, size_t (*fn)(struct text_cmd *, char const *, size_t))
+{
+    struct stat st;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    c->whole = 0;
+    if (off >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > off)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            // tail reads back from the end
+            if (fn != text_tail || c->from_start)
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+            c->whole = 1;
+            size_t used = fn(c, map + off, st.st_size - off);
+            munmap(map, st.st_size);
+            lseek(fd, off + used, SEEK_SET);
+            return 0;
+        }
+    }
+
+    size_t cap = TEXT_BUF_SIZE, len = 0;
+    char *buf = malloc(cap);
+    if (!buf)
+        err(1, "malloc");
+    for (;;)
+    {
+        ssize_t r = read(fd, buf + len, cap - len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+        {
+            int e = errno;
+            free(buf);
+            errno = e;
+            return -1;
+        }
+        len += r;
+
+        // Pass on the lines read, and at the end of input what is left
+        size_t k = len;
+        if (r > 0)
+        {
+            char *nl = memrchr(buf, '\n', len);
+            k = nl ? (size_t)(nl + 1 - buf) : 0;
+        }
+        if ((k > 0 && fn(c, buf, k) < k) || r == 0)
+            break;
+        memmove(buf, buf + k, len - k);
+        len -= k;
+        if (len == cap)
+        {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (!buf)
+                err(1, "realloc");
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/*
+ * Number of newlines in [s, s + n), counted eight bytes at a time: each
+ * byte of a word that is '\n' becomes 1 in place, and these are summed by
+ * byte over up to 255 words, then across the bytes.
+ */
+size_t count_lines(char const *s, size_t n)
+{
+    uint64_t const ones = 0x0101010101010101ULL, low7 = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t const pairs = 0x00ff00ff00ff00ffULL;
+    size_t count = 0, i = 0;
+    while (i + 8 <= n)
+    {
+        uint64_t sums = 0;
+        for (size_t k = 0; k < 255 && i + 8 <= n; ++k, i += 8)
+        {
+            uint64_t w;
+            memcpy(&w, s + i, 8);
+            w ^= ones * '\n';
+            // The high bit of each byte is clear only if the byte is zero
+            w = ((w & low7) + low7) | w;
+            sums += (~w >> 7) & ones;
+        }
+        sums = (sums & pairs) + ((sums >> 8) & pairs);
+        count += (sums * 0x0001000100010001ULL) >> 48;
+    }
+    for (; i < n; ++i)
+        count += s[i] == '\n';
+    return count;
+}
+
+/*
+ * Offset just past the first *lines newlines of [s, s + n), or n if there
+ * are fewer. The lines passed are taken off *lines.
+ */
+size_t skip_lines(char const *s, size_t n, uint64_t *lines)
+{
+    char const *p = s, *end = s + n;
+    while (*lines > 0 && p < end)
+    {
+        char const *nl = memchr(p, '\n', end - p);
+        if (!nl)
+            return n;
+        p = nl + 1;
+        --*lines;
+    }
+    return p - s;
+}
+
+/*
+ * Offset of the start of the last lines lines of [s, s + n), or 0 if there
+ * are fewer, found back from the end with memrchr. A newline at the very
+ * end starts no line.
+ */
+size_t tail_start(char const *s, size_t n, uint64_t lines)
+{
+    size_t end = n > 0 && s[n - 1] == '\n' ? n - 1 : n;
+    if (lines == 0)
+        return n;
+    while (end > 0)
+    {
+        char const *nl = memrchr(s, '\n', end);
+        if (!nl)
+            return 0;
+        if (--lines == 0)
+            return nl + 1 - s;
+        end = nl - s;
+    }
+    return 0;
+}
+
+/*
+ * wc -l: count the newlines
+ */
+size_t text_wc(struct text_cmd *c, char const *s, size_t n)
+{
+    c->count += count_lines(s, n);
+    return n;
+}
+
+/*
+ * head: write lines until c->left have been written
+ */
+size_t text_head(struct text_cmd *c, char const *s, size_t n)
+{
+    size_t k = skip_lines(s, n, &c->left);
+    if (k > 0)
+        out_write(STDOUT_FILENO, s, k);
+    return k;
+}
+
+/*
+ * tail: write the last lines of a mapped file, found from its end, or keep
+ * those of other input for text_file to write at its end, cutting the kept
+ * input back each time it has doubled. With -n +N, skip c->left lines and
+ * write the rest.
+ */
+size_t text_tail(struct text_cmd *c, char const *s, size_t n)
+{
+    size_t k = c->from_start ? skip_lines(s, n, &c->left) : c->whole ? tail_start(s, n, c->lines) : n;
+    if (c->from_start || c->whole)
+    {
+        if (k < n)
+            out_write(STDOUT_FILENO, s + k, n - k);
+        return n;
+    }
+
+    if (c->keep_len + n > c->keep_cap)
+    {
+        c->keep_cap = c->keep_cap ? c->keep_cap : TEXT_BUF_SIZE;
+        while (c->keep_len + n > c->keep_cap)
+            c->keep_cap *= 2;
+        c->keep = realloc(c->keep, c->keep_cap);
+        if (!c->keep)
+            err(1, "realloc");
+    }
+    memcpy(c->keep + c->keep_len, s, n);
+    c->keep_len += n;
+    if (c->keep_len > TEXT_BUF_SIZE && c->keep_len > 2 * c->keep_trimmed)
+    {
+        k = tail_start(c->keep, c->keep_len, c->lines);
+        memmove(c->keep, c->keep + k, c->keep_len - k);
+        c->keep_len -= k;
+        c->keep_trimmed = c->keep_len;
+    }
+    return n;
+}
+
+/*
+ * grep: find the pattern with memmem and select the line it is in, or with
+ * -v the lines between those. Stops at the first line selected with -q.
+ */
+size_t text_grep(struct text_cmd *c, char const *s, size_t n)
+{
+    char const *p = s, *end = s + n;
+    while (p < end && !(c->quiet && c->count))
+    {
+        char const *m = memmem(p, end - p, c->pattern, c->pattern_len);
+        char const *start = m ? memrchr(p, '\n', m - p) : NULL;
+        char const *next = m ? memchr(m, '\n', end - m) : NULL;
+        start = !m ? end : start ? start + 1 : p;
+        next = !m ? end : next ? next + 1 : end;
+        if (c->invert)
+        {
+            grep_out(c, p, start - p);
+            c->lineno += m != NULL;
+        }
+        else
+        {
+            if (c->number)
+                c->lineno += count_lines(p, start - p);
+            grep_out(c, start, next - start);
+        }
+        p = next;
+    }
+    return p - s;
+}
+
+/*
+ * Select the lines [s, s + n) for grep: count them, or write them with the
+ * file name and line number prefixes asked for. Without -c or -n, c->count
+ * only tells whether lines were selected.
+ */
+void grep_out(struct text_cmd *c, char const *s, size_t n)
+{
+    if (n == 0)
+        return;
+    int partial = s[n - 1] != '\n';
+    if (c->count_only || c->quiet)
+    {
+        c->count += count_lines(s, n) + partial;
+        return;
+    }
+    if (!c->prefix && !c->number)
+    {
+        out_write(STDOUT_FILENO, s, n);
+        if (partial)
+            out_write(STDOUT_FILENO, "\n", 1);
+        c->count += 1;
+        return;
+    }
+    for (char const *end = s + n; s < end;)
+    {
+        char const *nl = memchr(s, '\n', end - s);
+        size_t len = nl ? (size_t)(nl - s) : (size_t)(end - s);
+        c->count += 1;
+        c->lineno += 1;
+        if (c->prefix)
+            out_printf(STDOUT_FILENO, "%s:", c->name);
+        if (c->number)
+            out_printf(STDOUT_FILENO, "%" PRIu64 ":", c->lineno);
+        out_write(STDOUT_FILENO, s, len);
+        out_write(STDOUT_FILENO, "\n", 1);
+        s = nl ? nl + 1 : end;
+    }
+}
+
+/*
+ * Whether word has characters for pathname expansion: *, ?, or a [ closed
+ * by a later ], not escaped by \
+ */
+int glob_chars(char const *word)
+{
+    for (char const *s = word; *s; ++s)
+    {
+        if (*s == '\\' && s[1])
+            ++s;
+        else if (*s == '*' || *s == '?' || (*s == '[' && strchr(s + 1, ']')))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Replace each word of args from first on that has characters for
+ * pathname expansion by the paths it matches, if any. If escaped, the words
+ * are in the form of word_pats, and those left as they are are unescaped.
+ */
+void glob_args(size_t first, int escaped)
+{
+    size_t k = first;
+    for (; k < nargs && !glob_chars(args[k]); ++k)
+        if (escaped)
+            glob_unescape(args[k]);
+    if (k == nargs)
+        return;
+
+    size_t ntail = nargs - k;
+    char **tail = malloc(sizeof *tail * ntail);
+    if (!tail)
+        err(1, "malloc");
+    memcpy(tail, args + k, sizeof *tail * ntail);
+    nargs = k;
+    for (size_t i = 0; i < ntail; ++i)
+    {
+        if (glob_chars(tail[i]) && glob_word(tail[i], &args, &nargs, &args_cap) > 0)
+            free(tail[i]);
+        else
+        {
+            if (escaped)
+                glob_unescape(tail[i]);
+            vec_push(&args, &nargs, &args_cap, tail[i]);
+        }
+    }
+    free(tail);
+}
+
+/*
+ * Remove the \ quoting the next character from s, in place
+ */
+void glob_unescape(char *s)
+{
+    char *d = s;
+    for (; *s; ++s)
+    {
+        if (*s == '\\' && s[1])
+            ++s;
+        *d++ = *s;
+    }
+    *d = '\0';
+}
+
+/*
+ * Append the paths matching the pattern word to the vector *out of *n
+ * words and *cap allocated, sorted. Directories are read by a pool of
+ * workers that steal each other's tasks, started as subdirectories to read
+ * are queued. Returns the number of paths added.
+ */
+size_t glob_word(char const *word, char ***out, size_t *n, size_t *cap)
+{
+    struct glob_pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+    size_t len = strlen(word), first = *n;
+    pool.comps = malloc(sizeof *pool.comps * (len / 2 + 1));
+    pool.globstar = malloc(len / 2 + 1);
+    if (!pool.comps || !pool.globstar)
+        err(1, "malloc");
+
+    // One pattern per component; a trailing / matches directories only
+    for (char const *s = word, *e; *s; s = e)
+    {
+        while (*s == '/')
+            ++s;
+        if (!*s)
+            break;
+        e = strchrnul(s, '/');
+        pat_build(&pool.comps[pool.ncomps], s, e - s);
+        pool.globstar[pool.ncomps++] = e - s == 2 && memcmp(s, "**", 2) == 0;
+    }
+    pool.dir_only = len > 1 && word[len - 1] == '/';
+
+    if (pool.ncomps > 0)
+    {
+        for (size_t i = 0; i < GLOB_THREADS; ++i)
+        {
+            pool.workers[i].pool = &pool;
+            pthread_mutex_init(&pool.workers[i].lock, NULL);
+        }
+        pool.nworkers = 1;
+        char *root = strdup(word[0] == '/' ? "/" : "");
+        if (!root)
+            err(1, "strdup");
+        glob_push(&pool.workers[0], root, 0);
+        glob_run(&pool.workers[0]);
+        for (size_t i = 1; i < pool.nworkers; ++i)
+            pthread_join(pool.workers[i].thread, NULL);
+
+        // Merge the matches of the workers, sorted and without duplicates
+        for (size_t i = 0; i < pool.nworkers; ++i)
+        {
+            struct glob_worker *w = &pool.workers[i];
+            for (size_t k = 0; k < w->nmatches; ++k)
+                vec_push(out, n, cap, w->matches[k]);
+            free(w->matches);
+            free(w->tasks);
+        }
+        for (size_t i = 0; i < GLOB_THREADS; ++i)
+            pthread_mutex_destroy(&pool.workers[i].lock);
+        qsort(*out + first, *n - first, sizeof **out, glob_cmp);
+        size_t kept = first;
+        for (size_t i = first; i < *n; ++i)
+        {
+            if (kept > first && strcmp((*out)[kept - 1], (*out)[i]) == 0)
+                free((*out)[i]);
+            else
+                (*out)[kept++] = (*out)[i];
+        }
+        *n = kept;
+    }
+
+    for (size_t i = 0; i < pool.ncomps; ++i)
+    {
+        free(pool.comps[i].src);
+        free(pool.comps[i].tok);
+    }
+    free(pool.comps);
+    free(pool.globstar);
+    return *n - first;
+}
+
+/*
+ * Order strings by strcmp, for qsort
+ */
+int glob_cmp(void const *a, void const *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Queue the task of reading dir for component comp on worker w, and wake
+ * an idle worker to steal it, or start one if the pool can grow
+ */
+void glob_push(struct glob_worker *w, char *dir, size_t comp)
+{
+    struct glob_pool *pool = w->pool;
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom == w->cap && w->top > 0)
+    {
+        memmove(w->tasks, w->tasks + w->top, sizeof *w->tasks * (w->bottom - w->top));
+        w->bottom -= w->top;
+        w->top = 0;
+    }
+    if (w->bottom == w->cap)
+    {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->tasks = realloc(w->tasks, sizeof *w->tasks * w->cap);
+        if (!w->tasks)
+            err(1, "realloc");
+    }
+    w->tasks[w->bottom++] = (struct glob_task){.dir = dir, .comp = comp};
+    pthread_mutex_unlock(&w->lock);
+
+    size_t queued = __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    int grow = queued > 1 && __atomic_load_n(&pool->nworkers, __ATOMIC_SEQ_CST) < GLOB_THREADS;
+    if (!grow && __atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->cond);
+    if (grow && pool->nworkers < GLOB_THREADS)
+    {
+        struct glob_worker *nw = &pool->workers[pool->nworkers];
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        if (pthread_create(&nw->thread, NULL, glob_run, nw) == 0)
+            __atomic_store_n(&pool->nworkers, pool->nworkers + 1, __ATOMIC_SEQ_CST);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Take a task for worker w: the last one it queued, or else the first one
+ * queued by another worker. Returns 0 if there is none.
+ */
+int glob_take(struct glob_worker *w, struct glob_task *t)
+{
+    struct glob_pool *pool = w->pool;
+    size_t nworkers = __atomic_load_n(&pool->nworkers, __ATOMIC_SEQ_CST);
+    size_t self = w - pool->workers;
+    for (size_t k = 0; k < nworkers; ++k)
+    {
+        struct glob_worker *v = &pool->workers[(self + k) % nworkers];
+        int found = 0;
+        pthread_mutex_lock(&v->lock);
+        if (v->bottom > v->top)
+        {
+            *t = k == 0 ? v->tasks[--v->bottom] : v->tasks[v->top++];
+            if (v->top == v->bottom)
+                v->top = v->bottom = 0;
+            found = 1;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (found)
+        {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            return 1;
+        }
+    }
+    return 0;
+}
 
+/*
+ * Worker: run tasks until all of the walk is done
+ */
+void *glob_run(void *arg)
+{
+    struct glob_worker *w = arg;
+    struct glob_pool *pool = w->pool;
     for (;;)
     {
-        // Setup signal handler
-        SIGTSTP_setup();
-        SIGINT_setup();
-
-    /* Input */
-    prompt:;
-
-        // Manage background process
-        if (bg_handler())
-            errx(1, "bg_handler");
-
-        // Input is stdin: Interactive mode -> Print prompt
-        if (input == stdin)
-            print_prompt();
-
-        // Otherwise, read from a file: Non-interactive mode
-
-        // Read a line from input
-        ssize_t line_len = getline(&line, &n, input);
-        if (line_len < 0)
+        struct glob_task t;
+        if (glob_take(w, &t))
         {
-            // Handle EOF
-            if (feof(input))
-                return 0;
-            // Handle EINTR
-            if (errno == EINTR)
+            glob_dir(w, &t);
+            free(t.dir);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0)
             {
-                clearerr(stdin);
-                goto smallsh;
+                pthread_mutex_lock(&pool->lock);
+                pool->done = 1;
+                pthread_cond_broadcast(&pool->cond);
+                pthread_mutex_unlock(&pool->lock);
             }
-            err(1, "getline %s", input_fn);
+            continue;
         }
 
-        // Done reading, set SIGINT to SIG_IGN
-        SIGINT_action.sa_handler = SIG_IGN;
-        sigaction(SIGINT, &SIGINT_action, NULL);
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        while (!pool->done && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        int done = pool->done;
+        pthread_mutex_unlock(&pool->lock);
+        if (done)
+            return NULL;
+    }
+}
 
-        /* Word Splitting */
-        size_t nwords = wordsplit(line);
-        if (nwords == 0)
-            goto prompt;
+/*
+ * Match the entries of directory t->dir against component t->comp of the
+ * pattern: add the paths matching the last component, and queue the
+ * directories matching others. A literal component is looked up without
+ * reading the directory. ** matches no directory, or any directory below
+ * t->dir; a symbolic link to a directory is matched but not walked. Entries starting with . are
+ * only matched by a component starting with ., and never by **.
+ */
+void glob_dir(struct glob_worker *w, struct glob_task const *t)
+{
+    struct glob_pool *pool = w->pool;
+    struct pattern const *p = &pool->comps[t->comp];
+    int last = t->comp + 1 == pool->ncomps, star = pool->globstar[t->comp];
+    struct stat st;
 
-        /* Expansion */
-        for (size_t i = 0; i < nwords; ++i)
+    if (p->literal)
+    {
+        char *name = malloc(p->ntok + 1);
+        if (!name)
+            err(1, "malloc");
+        for (size_t i = 0; i < p->ntok; ++i)
+            name[i] = p->tok[i].c;
+        char *path = glob_join(t->dir, name, p->ntok);
+        free(name);
+        if (!last)
+            glob_push(w, path, t->comp + 1);
+        else if ((pool->dir_only ? stat(path, &st) : lstat(path, &st)) == 0 &&
+                 (!pool->dir_only || S_ISDIR(st.st_mode)))
+            glob_match(w, path);
+        else
+            free(path);
+        return;
+    }
+
+    if (star && !last)
+    {
+        char *dir = strdup(t->dir);
+        if (!dir)
+            err(1, "strdup");
+        glob_push(w, dir, t->comp + 1);
+    }
+    int fd = open(*t->dir ? t->dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    int dot = p->ntok > 0 && p->tok[0].type == PAT_CHAR && p->tok[0].c == '.';
+    uint64_t buf[GLOB_BUF_SIZE / sizeof(uint64_t)];
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0)
+    {
+        for (long off = 0; off < nread;)
         {
-            char *exp_word = expand(words[i]);
-            free(words[i]);
-            words[i] = exp_word;
-        }
+            struct linux_dirent64 const *de = (void const *)((char const *)buf + off);
+            off += de->d_reclen;
+            char const *name = de->d_name;
+            size_t len = strlen(name);
+            if (name[0] == '.' && (star || !dot || len == 1 || (len == 2 && name[1] == '.')))
+                continue;
+            if (!star && !pat_match(p, name, len))
+                continue;
 
-        /* Parsing */
-        char **words_argv = malloc(sizeof(*words) * (nwords + 1));
-        if (!words_argv)
-            err(1, "malloc");
-        size_t words_argc = parse_command(nwords, words_argv);
+            // d_type saves a stat, except for symbolic links and file systems without it
+            char *path = glob_join(t->dir, name, len);
+            int dir = de->d_type == DT_DIR;
+            if ((!last || pool->dir_only || star) &&
+                (de->d_type == DT_UNKNOWN || (de->d_type == DT_LNK && !star)))
+                dir = (star ? lstat(path, &st) : stat(path, &st)) == 0 && S_ISDIR(st.st_mode);
 
-        /* Execution */
-        execute_cmds(words_argv, words_argc);
+            if (star && last && (!pool->dir_only || dir))
+            {
+                char *match = strdup(path);
+                if (!match)
+                    err(1, "strdup");
+                glob_match(w, match);
+            }
+            if (star && dir)
+                glob_push(w, path, t->comp);
+            else if (star && !last && de->d_type == DT_LNK && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+                glob_push(w, path, t->comp + 1); // Matched, but not walked
+            else if (!star && !last && dir)
+                glob_push(w, path, t->comp + 1);
+            else if (!star && last && (!pool->dir_only || dir))
+                glob_match(w, path);
+            else
+                free(path);
+        }
+    }
+    close(fd);
+}
 
-        // Clean up
-        for (size_t i = 0; i < nwords; ++i)
-            words[i] = 0;
-        free(words_argv);
+/*
+ * dir/name for the first len bytes of name, with no / added after an
+ * empty dir or one ending in /, as a new string
+ */
+char *glob_join(char const *dir, char const *name, size_t len)
+{
+    size_t dlen = strlen(dir);
+    char *path = malloc(dlen + len + 2);
+    if (!path)
+        err(1, "malloc");
+    memcpy(path, dir, dlen);
+    if (dlen > 0 && dir[dlen - 1] != '/')
+        path[dlen++] = '/';
+    memcpy(path + dlen, name, len);
+    path[dlen + len] = '\0';
+    return path;
+}
+
+/*
+ * Add path to the matches of worker w, with a / after a directory matched
+ * by a pattern ending in /
+ */
+void glob_match(struct glob_worker *w, char *path)
+{
+    if (w->pool->dir_only)
+    {
+        size_t len = strlen(path);
+        char *tmp = realloc(path, len + 2);
+        if (!tmp)
+            err(1, "realloc");
+        path = tmp;
+        memcpy(path + len, "/", 2);
     }
+    vec_push(&w->matches, &w->nmatches, &w->matches_cap, path);
 }
 
 /*
- * Setup SIGTSTP signal handler:
- * Store default SIGTSTP action in SIGTSTP_default
- * Set SIGTSTP action to SIG_IGN
+ * Nanoseconds of CPU time in ru, user and system
  */
-void SIGTSTP_setup()
+int64_t rusage_ns(struct rusage const *ru)
 {
-    sigaction(SIGTSTP, NULL, &SIGTSTP_default);
+    return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000LL +
+           (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000LL;
+}
 
-    SIGTSTP_action.sa_handler = SIG_IGN;
-    sigfillset(&SIGTSTP_action.sa_mask);
-    sigaction(SIGTSTP, &SIGTSTP_action, &SIGTSTP_default);
+/*
+ * Nanoseconds on the monotonic clock
+ */
+int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 /*
- * Setup SIGINT signal handler:
- * Store default SIGINT action in SIGINT_default
- * Set SIGINT action to SIGINT_handler
+ * Start profiling script line lineno, with text line
  */
-void SIGINT_setup()
+void profile_start(size_t lineno, char const *line)
 {
-    // Save default SIGINT action
-    sigaction(SIGINT, NULL, &SIGINT_default);
-    // Add new SIGINT handler
-    SIGINT_action.sa_handler = SIGINT_handler;
-    sigfillset(&SIGINT_action.sa_mask);
-    sigaction(SIGINT, &SIGINT_action, &SIGINT_default);
+    if (lineno >= profile_cap)
+    {
+        size_t cap = profile_cap ? profile_cap : 64;
+        while (cap <= lineno)
+            cap *= 2;
+        struct prof_line *p = realloc(profile_lines, sizeof *p * cap);
+        if (!p)
+            err(1, "realloc");
+        memset(p + profile_cap, 0, sizeof *p * (cap - profile_cap));
+        profile_lines = p;
+        profile_cap = cap;
+    }
+    struct prof_line *p = &profile_lines[lineno];
+    if (!p->text)
+    {
+        p->text = strndup(line, strcspn(line, "\n"));
+        if (!p->text)
+            err(1, "strndup");
+    }
+
+    struct rusage ru;
+    profile_cur = p;
+    profile_mark.wall = monotonic_ns();
+    getrusage(RUSAGE_SELF, &ru);
+    profile_mark.shell = rusage_ns(&ru);
+    getrusage(RUSAGE_CHILDREN, &ru);
+    profile_mark.children = rusage_ns(&ru);
+    profile_mark.forks = spawn_count;
 }
 
 /*
- * SIGINT_handler:
- * Print a new line to stderr
+ * Add the cost of the line being profiled since profile_start
  */
-void SIGINT_handler(int signo)
+void profile_end()
 {
-    fprintf(stderr, "\n");
+    struct prof_line *p = profile_cur;
+    struct rusage ru;
+    if (!p)
+        return;
+    profile_cur = NULL;
+    p->count += 1;
+    p->wall += monotonic_ns() - profile_mark.wall;
+    getrusage(RUSAGE_SELF, &ru);
+    p->shell += rusage_ns(&ru) - profile_mark.shell;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    p->children += rusage_ns(&ru) - profile_mark.children;
+    p->forks += spawn_count - profile_mark.forks;
 }
 
 /*
- * Print prompt: ps1
+ * Order lines by decreasing wall time, then by line number
  */
-void print_prompt()
+int profile_cmp(void const *a, void const *b)
 {
-    char *ps1 = getenv("PS1");
-    if (!ps1)
-        ps1 = "";
-    fprintf(stderr, "%s", ps1);
+    struct prof_line const *x = *(struct prof_line *const *)a, *y = *(struct prof_line *const *)b;
+    if (x->wall != y->wall)
+        return x->wall < y->wall ? 1 : -1;
+    return x < y ? -1 : x > y;
 }
 
-char *words[MAX_WORDS] = {0};
+/*
+ * At exit, write the report of the profiled lines to profile_path, sorted by
+ * cost, and their costs as collapsed stacks to profile_path.folded
+ */
+void profile_write()
+{
+    profile_end();
+    FILE *out = fopen(profile_path, "w");
+    char *folded_path = NULL;
+    FILE *folded = NULL;
+    if (asprintf(&folded_path, "%s.folded", profile_path) >= 0)
+        folded = fopen(folded_path, "w");
+    if (!out || !folded)
+    {
+        warn("%s", out ? folded_path : profile_path);
+        if (out)
+            fclose(out);
+        free(folded_path);
+        return;
+    }
 
-/* Splits a string into words delimited by whitespace. Recognizes
- * comments as '#' at the beginning of a word, and backslash escapes.
- *
- * Returns number of words parsed, and updates the words[] array
- * with pointers to the words, each as an allocated string.
+    struct prof_line **sorted = malloc(sizeof *sorted * (profile_cap + 1));
+    size_t n = 0;
+    struct prof_line total = {0};
+    if (!sorted)
+        err(1, "malloc");
+    for (size_t i = 0; i < profile_cap; ++i)
+    {
+        struct prof_line *p = &profile_lines[i];
+        if (p->count == 0)
+            continue;
+        sorted[n++] = p;
+        total.count += p->count;
+        total.wall += p->wall;
+        total.shell += p->shell;
+        total.children += p->children;
+        total.forks += p->forks;
+    }
+    qsort(sorted, n, sizeof *sorted, profile_cmp);
+
+    fprintf(out, "%6s %8s %10s %6s %10s %10s %8s  %s\n",
+            "line", "count", "wall ms", "%", "shell ms", "child ms", "forks", "command");
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct prof_line *p = sorted[i];
+        fprintf(out, "%6zu %8" PRIu64 " %10.3f %6.1f %10.3f %10.3f %8" PRIu64 "  %.60s\n",
+                (size_t)(p - profile_lines), p->count, p->wall / 1e6,
+                total.wall ? 100.0 * p->wall / total.wall : 0.0,
+                p->shell / 1e6, p->children / 1e6, p->forks, p->text);
+    }
+    fprintf(out, "%6s %8" PRIu64 " %10.3f %6.1f %10.3f %10.3f %8" PRIu64 "\n", "total", total.count,
+            total.wall / 1e6, 100.0, total.shell / 1e6, total.children / 1e6, total.forks);
+
+    // One frame for the script, one per line, and where the time went, in microseconds
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct prof_line *p = sorted[i];
+        int64_t other = p->wall - p->shell - p->children;
+        int64_t parts[] = {p->shell, p->children, other > 0 ? other : 0};
+        char const *names[] = {"shell", "children", "wait"};
+        for (char *c = p->text; *c; ++c)
+            if (*c == ';')
+                *c = ',';
+        for (size_t k = 0; k < 3; ++k)
+            if (parts[k] >= 1000)
+                fprintf(folded, "%s;%zu: %s;%s %" PRId64 "\n", profile_script,
+                        (size_t)(p - profile_lines), p->text, names[k], parts[k] / 1000);
+    }
+
+    free(sorted);
+    free(folded_path);
+    fclose(out);
+    fclose(folded);
+}
+
+/*
+ * Open the journal at journal_path, moved out of the way of descriptors
+ * opened by exec. With --resume, load the lines that succeeded up to the
+ * first one that did not, and truncate the journal after them; otherwise
+ * start it afresh.
  */
-size_t wordsplit(char const *line)
+void journal_open()
 {
-    size_t wlen = 0;
-    size_t wind = 0;
+    int fd = open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC | (journal_resume ? 0 : O_TRUNC), 0666);
+    if (fd < 0)
+        err(1, "%s", journal_path);
+    journal_fd = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MAX + 1);
+    close(fd);
+    if (journal_fd < 0)
+        err(1, "%s", journal_path);
+    journal_synced_at = monotonic_ns();
+    atexit(journal_sync);
+    if (!journal_resume)
+        return;
 
-    char const *c = line;
-    for (; *c && isspace(*c); ++c)
-        ; /* discard leading space */
+    struct stat st;
+    if (fstat(journal_fd, &st) < 0)
+        err(1, "%s", journal_path);
+    char *buf = malloc(st.st_size + 1);
+    ssize_t len = 0, k = 0;
+    if (!buf)
+        err(1, "malloc");
+    while (len < st.st_size && (k = read(journal_fd, buf + len, st.st_size - len)) > 0)
+        len += k;
+    if (k < 0)
+        err(1, "%s", journal_path);
+    buf[len] = '\0';
 
-    for (; *c;)
+    // A record cut short by a crash ends the journal, as does a failure
+    size_t cap = 0;
+    char *pos = buf, *nl;
+    for (; (nl = strchr(pos, '\n')); pos = nl + 1)
     {
-        if (wind == MAX_WORDS)
+        struct journal_rec r;
+        int end = 0;
+        if (sscanf(pos, "%zu %" SCNx64 " %n", &r.lineno, &r.hash, &end) != 2 || end == 0)
             break;
-        /* read a word */
-        if (*c == '#')
+        if (strncmp(pos + end, "&\n", 2) == 0)
+            r.status = JOURNAL_BACKGROUND;
+        else if (strncmp(pos + end, "0\n", 2) == 0)
+            r.status = 0;
+        else
             break;
-        for (; *c && !isspace(*c); ++c)
+        if (njournal_recs == cap)
         {
-            if (*c == '\\')
-                ++c;
-            void *tmp = realloc(words[wind], sizeof **words * (wlen + 2));
-            if (!tmp)
+            cap = cap ? cap * 2 : 1024;
+            journal_recs = realloc(journal_recs, sizeof *journal_recs * cap);
+            if (!journal_recs)
                 err(1, "realloc");
-            words[wind] = tmp;
-            words[wind][wlen++] = *c;
-            words[wind][wlen] = '\0';
         }
-        ++wind;
-        wlen = 0;
-        for (; *c && isspace(*c); ++c)
-            ;
+        journal_recs[njournal_recs++] = r;
     }
-    return wind;
+    if (ftruncate(journal_fd, pos - buf) < 0 || lseek(journal_fd, 0, SEEK_END) < 0)
+        err(1, "%s", journal_path);
+    free(buf);
 }
 
-/* Find next instance of a parameter within a word. Sets
- * start and end pointers to the start and end of the parameter
- * token.
+/*
+ * Decide what to do with line lineno of nwords words in words[]. While
+ * resuming, a line must match the next line of the journal, and the script
+ * up to it must not have changed. It is skipped, with $? set to 0, unless
+ * it changes the state of the shell: assignments, cd, declare, unset,
+ * read, mapfile, exec with only redirections and ((...)) are run again.
+ * So are lines started in the background, which may not have completed.
+ * A coprocess cannot be restored, so the script is not resumed past one.
  */
-char param_scan(char const *word, char const **start, char const **end)
+enum journal_action journal_check(size_t lineno, size_t nwords)
 {
-    static char const *prev;
-    if (!word)
-        word = prev;
+    if (journal_next == njournal_recs)
+        return JOURNAL_RUN;
+    struct journal_rec const *r = &journal_recs[journal_next];
+    if (r->lineno != lineno || r->hash != journal_hash)
+        errx(1, "%s: line %zu: the script has changed since it was journaled, not resuming",
+             journal_path, lineno);
+    if (strcmp(words[0], "coproc") == 0)
+        errx(1, "%s: line %zu: a coprocess cannot be restored, not resuming", journal_path, lineno);
+    if (++journal_next == njournal_recs)
+        fprintf(stderr, "smallsh: %s: resuming after line %zu\n", journal_path, lineno);
 
-    char ret = 0;
-    *start = 0;
-    *end = 0;
-    for (char const *s = word; *s && !ret; ++s)
+    if (r->status == JOURNAL_BACKGROUND)
+        return JOURNAL_REPLAY;
+
+    static char const *const state[] = {"cd", "declare", "unset", "read", "mapfile"};
+    int assigns = 1;
+    for (size_t i = 0; i < nwords; ++i)
+        assigns &= assign_name(words[i]) > 0;
+    for (size_t i = 0; !assigns && i < sizeof state / sizeof *state; ++i)
+        assigns = strcmp(words[0], state[i]) == 0;
+    if (!assigns && strcmp(words[0], "exec") == 0)
     {
-        s = strchr(s, '$');
-        if (!s)
-            break;
-        switch (s[1])
-        {
-        case '$':
-        case '!':
-        case '?':
-            ret = s[1];
-            *start = s;
-            *end = s + 2;
-            break;
-        case '{':;
-            char *e = strchr(s + 2, '}');
-            if (e)
-            {
-                ret = s[1];
-                *start = s;
-                *end = e + 1;
-            }
-            break;
-        }
+        // exec N> file and the like set up descriptors later lines write to
+        struct redir rd[2];
+        size_t i = 1;
+        for (int n; i < nwords && (n = parse_redir(words[i], rd)) > 0; ++i)
+            if (rd[0].op < REDIR_DUP)
+                ++i;
+        assigns = i >= nwords;
     }
-    prev = *end;
-    return ret;
+    if (assigns || strncmp(words[0], "((", 2) == 0)
+        return JOURNAL_REPLAY;
+    set_status(0);
+    return JOURNAL_SKIP;
 }
 
-/* Simple string-builder function. Builds up a base
- * string by appending supplied strings/character ranges
- * to it.
+/*
+ * Append the record of line lineno, completed with status $?, or started
+ * in the background, to the journal. Records reach the disk with one
+ * fdatasync per batch of JOURNAL_SYNC_RECORDS, or after JOURNAL_SYNC_NS.
  */
-char *build_str(char const *start, char const *end)
+void journal_record(size_t lineno, int background)
 {
-    static size_t base_len = 0;
-    static char *base = 0;
+    char rec[64];
+    char const *status = background ? "&" : getenv("?");
+    int n = snprintf(rec, sizeof rec, "%zu %016" PRIx64 " %s\n", lineno, journal_hash, status ? status : "0");
+    if (write_all(journal_fd, rec, n) < 0)
+        err(1, "%s", journal_path);
+    if (++journal_unsynced >= JOURNAL_SYNC_RECORDS || monotonic_ns() - journal_synced_at >= JOURNAL_SYNC_NS)
+        journal_sync();
+}
 
-    if (!start)
+/*
+ * Wait up to what is left of JOURNAL_SYNC_NS for the foreground command
+ * pid to exit, then sync the records written before it, so that they do
+ * not wait for a long command to become durable
+ */
+void journal_wait(pid_t pid)
+{
+    if (journal_unsynced == 0)
+        return;
+    int pfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pfd >= 0)
     {
-        /* Reset; new base string, return old one */
-        char *ret = base;
-        base = NULL;
-        base_len = 0;
-        return ret;
+        struct pollfd p = {.fd = pfd, .events = POLLIN};
+        int64_t left;
+        int n = 0;
+        while ((left = JOURNAL_SYNC_NS - (monotonic_ns() - journal_synced_at)) > 0 &&
+               (n = poll(&p, 1, (left + 999999) / 1000000)) < 0 && errno == EINTR)
+            ;
+        close(pfd);
+        if (n > 0)
+            return;
     }
-    /* Append [start, end) to base string
-     * If end is NULL, append whole start string to base string.
-     * Returns a newly allocated string that the caller must free.
-     */
-    size_t n = end ? end - start : strlen(start);
-    size_t newsize = sizeof *base * (base_len + n + 1);
-    void *tmp = realloc(base, newsize);
-    if (!tmp)
-        err(1, "realloc");
-    base = tmp;
-    memcpy(base + base_len, start, n);
-    base_len += n;
-    base[base_len] = '\0';
+    journal_sync();
+}
 
-    return base;
+/*
+ * Make the records written so far durable
+ */
+void journal_sync()
+{
+    if (journal_unsynced == 0)
+        return;
+    if (fdatasync(journal_fd) < 0)
+        warn("%s", journal_path);
+    journal_unsynced = 0;
+    journal_synced_at = monotonic_ns();
 }
 
-/* Expands all instances of $! $$ $? and ${param} in a string
- * Returns a newly allocated string that the caller must free
+/*
+ * Compile the script at path into the program out, or into its C source if
+ * out ends in .c. Lines of commands whose words have no parameters,
+ * process substitutions or patterns are parsed now, into argument vectors
+ * and redirections run as they are; other lines are kept as their words,
+ * to be expanded when run. Returns the exit status for main.
  */
-char *expand(char const *word)
+int compile_script(char const *path, char const *out)
 {
-    char const *pos = word;
-    char const *start, *end;
-    char c = param_scan(pos, &start, &end);
-    build_str(NULL, NULL);
-    build_str(pos, start);
+    FILE *in = fopen(path, "re");
+    if (!in)
+        err(1, "%s", path);
+    size_t out_len = strlen(out);
+    int source = out_len > 2 && strcmp(out + out_len - 2, ".c") == 0;
+    char c_path[] = "/tmp/smallsh-XXXXXX.c";
+    FILE *c = NULL;
+    if (source)
+        c = fopen(out, "w");
+    else
+    {
+        int fd = mkstemps(c_path, 2);
+        if (fd >= 0 && !(c = fdopen(fd, "w")))
+            close(fd);
+    }
+    if (!c)
+        err(1, "%s", source ? out : c_path);
 
-    while (c)
+    fputs("/* Compiled by smallsh --compile */\n\n"
+          "#include <stddef.h>\n\n"
+          "void compiled_init(int argc, char **argv);\n"
+          "void compiled_cmd(char **argv, size_t argc, int const *r, char **targets, size_t nr, int bg);\n"
+          "void compiled_line(char **w, size_t nwords);\n"
+          "int compiled_end();\n\n"
+          "struct line\n{\n    char **words;\n    size_t n;\n    int parsed;\n"
+          "    int const *r;\n    char **t;\n    size_t nr;\n    int bg;\n};\n",
+          c);
+
+    // The lines, as data, then a table of them run in order by main
+    char *line = NULL, *table = NULL;
+    size_t n = 0, lineno = 0, len = 0, cap = 0;
+    char *cmd[MAX_WORDS + 1];
+    while (getline(&line, &n, in) >= 0)
     {
-        switch (c)
-        {
-        case '$':
-        {
-            // Process ID
-            char *pid = getenv("$");
-            if (!pid)
-                build_str("", NULL);
-            else
-                build_str(pid, NULL);
-            break;
-        }
-        case '!':
-        {
-            // Background PID most recent bg process, default "" if no background process ID available
-            char *pid = getenv("!");
-            if (!pid)
-                build_str("", NULL);
-            else
-                build_str(pid, NULL);
-            break;
+        ++lineno;
+        size_t nwords = wordsplit(line);
+        if (nwords == 0)
+            continue;
+
+        // Lines that expand or assign are kept as words, others are parsed now
+        int expands = 0, assigns = 1;
+        for (size_t i = 0; i < nwords; ++i)
+        {
+            expands |= strchr(words[i], '$') || ((words[i][0] == '<' || words[i][0] == '>') && words[i][1] == '(') ||
+                       glob_chars(word_pats[i] ? word_pats[i] : words[i]);
+            assigns &= assign_name(words[i]) > 0;
         }
+        int parsed = !expands && !assigns;
+        size_t argc = parsed ? parse_command(words, nwords, cmd) : 0;
+        char used[MAX_WORDS];
+        memset(used, !parsed, nwords);
+        for (size_t i = 0; i < argc; ++i)
+            used[compile_word(words, nwords, cmd[i])] = 1;
+        for (size_t i = 0; parsed && i < nredirs; ++i)
+            if (redirs[i].target)
+                used[compile_word(words, nwords, redirs[i].target)] = 1;
 
-        case '?':
+        // The words used, as arrays the commands may write to
+        fprintf(c, "\n// line %zu\n", lineno);
+        int first = 1;
+        for (size_t i = 0; i < nwords; ++i)
         {
-            // Exit status of the last fg command, 0 by default
-            char *status = getenv("?");
-            if (!status)
-                build_str("0", NULL);
-            else
-                build_str(status, NULL);
-            break;
+            if (!used[i])
+                continue;
+            // Words kept to be expanded keep their escaped pattern characters
+            fprintf(c, first ? "static char l%zu_%zu[] = " : ", l%zu_%zu[] = ", lineno, i);
+            compile_string(c, !parsed && word_pats[i] ? word_pats[i] : words[i]);
+            first = 0;
         }
+        if (!first)
+            fputs(";\n", c);
 
-        case '{':
+        char entry[128];
+        if (!parsed)
         {
-            // Environment variable
-            char *env_var = malloc(sizeof(char) * (end - start + 1));
-            if (!env_var)
-                err(1, "malloc");
-            strncpy(env_var, start + 2, end - start - 3);
-            env_var[end - start - 3] = '\0';
-            char *env_val = getenv(env_var);
-            if (env_val)
-                build_str(env_val, NULL);
-            free(env_var);
-            break;
+            // Expanded, or assigned, when run
+            fprintf(c, "static char *l%zu[] = {", lineno);
+            for (size_t i = 0; i < nwords; ++i)
+                fprintf(c, "%sl%zu_%zu", i ? ", " : "", lineno, i);
+            fputs("};\n", c);
+            snprintf(entry, sizeof entry, "    {l%zu, %zu, 0, NULL, NULL, 0, 0},\n", lineno, nwords);
+        }
+        else
+        {
+            fprintf(c, "static char *l%zu[] = {", lineno);
+            for (size_t i = 0; i < argc; ++i)
+                fprintf(c, "l%zu_%zu, ", lineno, compile_word(words, nwords, cmd[i]));
+            fputs("NULL};\n", c);
+            if (nredirs > 0)
+            {
+                // Redirections as descriptor, operator and source descriptor
+                fprintf(c, "static int const l%zu_r[] = {", lineno);
+                for (size_t i = 0; i < nredirs; ++i)
+                    fprintf(c, "%s%d, %d, %d", i ? ", " : "", redirs[i].fd, (int)redirs[i].op, redirs[i].src);
+                fprintf(c, "};\nstatic char *l%zu_t[] = {", lineno);
+                for (size_t i = 0; i < nredirs; ++i)
+                {
+                    if (redirs[i].target)
+                        fprintf(c, "%sl%zu_%zu", i ? ", " : "", lineno, compile_word(words, nwords, redirs[i].target));
+                    else
+                        fprintf(c, "%sNULL", i ? ", " : "");
+                }
+                fputs("};\n", c);
+                snprintf(entry, sizeof entry, "    {l%zu, %zu, 1, l%zu_r, l%zu_t, %zu, %d},\n",
+                         lineno, argc, lineno, lineno, nredirs, bg_flag);
+            }
+            else
+                snprintf(entry, sizeof entry, "    {l%zu, %zu, 1, NULL, NULL, 0, %d},\n", lineno, argc, bg_flag);
         }
+        if (str_append(&table, &len, &cap, entry, strlen(entry)) < 0)
+            err(1, "realloc");
+
+        for (size_t i = 0; i < nwords; ++i)
+        {
+            free(words[i]);
+            free(word_pats[i]);
+            words[i] = word_pats[i] = 0;
         }
-        pos = end;
-        c = param_scan(pos, &start, &end);
-        build_str(pos, start);
     }
-    return build_str(start, NULL);
+    if (ferror(in))
+        err(1, "%s", path);
+    fprintf(c, "\nstatic struct line const lines[] = {\n%s    {NULL, 0, 0, NULL, NULL, 0, 0}\n};\n\n"
+               "int main(int argc, char *argv[])\n{\n"
+               "    compiled_init(argc, argv);\n"
+               "    for (struct line const *l = lines; l->words; ++l)\n"
+               "    {\n"
+               "        if (l->parsed)\n"
+               "            compiled_cmd(l->words, l->n, l->r, l->t, l->nr, l->bg);\n"
+               "        else\n"
+               "            compiled_line(l->words, l->n);\n"
+               "    }\n"
+               "    return compiled_end();\n}\n",
+            table ? table : "");
+    free(table);
+    free(line);
+    fclose(in);
+    if (fclose(c) != 0)
+        err(1, "%s", source ? out : c_path);
+    if (source)
+        return 0;
+
+    int status = compile_build(c_path, out);
+    unlink(c_path);
+    return status;
 }
 
 /*
- * Copy the pointers from words to args, skipping over redirection characters and &.
+ * Write s to c as a C string literal
  */
-size_t parse_command(size_t nwords, char **words_argv)
+void compile_string(FILE *c, char const *s)
 {
-    size_t words_argc = 0;
-    for (size_t i = 0; i < nwords; ++i)
+    fputc('"', c);
+    for (unsigned char const *p = (unsigned char const *)s; *p; ++p)
     {
-        // Skip over redirection characters
-        if (strcmp(words[i], ">") == 0 || strcmp(words[i], "<") == 0 || strcmp(words[i], ">>") == 0)
-        {
-            ++i;
-            continue;
-        }
-        words_argv[words_argc] = words[i];
-        ++words_argc;
+        // ? is escaped, as ??/ and friends are trigraphs
+        if (*p == '"' || *p == '\\' || *p == '?')
+            fprintf(c, "\\%c", *p);
+        else if (isprint(*p))
+            fputc(*p, c);
+        else
+            fprintf(c, "\\%03o", *p);
     }
+    fputc('"', c);
+}
 
-    // Check if bg process
-    if (strcmp(words_argv[words_argc - 1], "&") == 0)
+/*
+ * Index of word among the n words w
+ */
+size_t compile_word(char *const *w, size_t n, char const *word)
+{
+    size_t i = 0;
+    while (i < n && w[i] != word)
+        ++i;
+    return i;
+}
+
+/*
+ * Build the program out from the C source at c_path with $CC (cc by
+ * default), linking it with the shell runtime: $SMALLSH_LIB, or
+ * libsmallsh.a next to this executable. Returns 0, or 1 if it failed.
+ */
+int compile_build(char const *c_path, char const *out)
+{
+    char const *lib = getenv("SMALLSH_LIB");
+    char *found = NULL;
+    if (!lib || !*lib)
     {
-        bg_flag = 1;
-        words_argv[words_argc - 1] = NULL;
-        --words_argc;
+        char exe[PATH_MAX];
+        ssize_t len = readlink("/proc/self/exe", exe, sizeof exe - 1);
+        if (len < 0)
+            err(1, "/proc/self/exe");
+        exe[len] = '\0';
+        *strrchr(exe, '/') = '\0';
+        if (asprintf(&found, "%s/libsmallsh.a", exe) < 0)
+            err(1, "asprintf");
+        lib = found;
     }
-    else
+    if (access(lib, R_OK) < 0)
     {
-        bg_flag = 0;
-        words_argv[words_argc] = NULL;
+        warn("%s", lib);
+        free(found);
+        return 1;
     }
 
-    return words_argc;
+    // $CC may hold options after the compiler
+    char *cc_argv[MAX_WORDS + 8] = {0};
+    char const *cc = getenv("CC");
+    size_t ncc = wordsplit_into(cc && *cc ? cc : "cc", cc_argv, MAX_WORDS);
+    size_t argc = ncc;
+    char const *rest[] = {"-o", out, c_path, lib, "-pthread"};
+    for (size_t i = 0; i < sizeof rest / sizeof *rest; ++i)
+        cc_argv[argc++] = (char *)rest[i];
+    cc_argv[argc] = NULL;
+
+    pid_t pid;
+    int status = 1;
+    int rc = ncc ? posix_spawnp(&pid, cc_argv[0], NULL, NULL, cc_argv, environ) : EINVAL;
+    if (rc != 0)
+    {
+        errno = rc;
+        warn("%s", ncc ? cc_argv[0] : "CC");
+    }
+    else if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        status = 0;
+    else
+        status = 1;
+    for (size_t i = 0; i < ncc; ++i)
+        free(cc_argv[i]);
+    free(found);
+    return status;
 }
 
 /*
- * Built-in commands: cd
+ * Runtime of compiled scripts, in libsmallsh.a: start the shell as main
+ * does, with no arguments for the program
  */
-void builtin_cd(char **argv, size_t argc)
+void compiled_init(int argc, char **argv)
 {
-    if (argc == 1)
+    out_init();
+    if (argc > 1)
+        errx(1, "too many arguments");
+}
+
+/*
+ * Prepare to run a line of a compiled script, as the main loop does after
+ * reading one in non-interactive mode
+ */
+void compiled_begin()
+{
+    if (bg_handler())
+        errx(1, "bg_handler");
+}
+
+/*
+ * Run a parsed command of a compiled script: argv, with the nr redirections
+ * given as triples of descriptor, operator and source descriptor in r and
+ * their file names in targets, in the background if bg is set
+ */
+void compiled_cmd(char **argv, size_t argc, int const *r, char **targets, size_t nr, int bg)
+{
+    compiled_begin();
+    for (size_t i = 0; i < nr; ++i)
+        redirs[i] = (struct redir){.fd = r[3 * i], .op = r[3 * i + 1], .target = targets[i], .src = r[3 * i + 2]};
+    nredirs = nr;
+    bg_flag = bg;
+    execute_cmds(argv, argc);
+}
+
+/*
+ * Run a line of a compiled script from its nwords words w, which are
+ * expanded and parsed as the main loop does
+ */
+void compiled_line(char **w, size_t nwords)
+{
+    compiled_begin();
+    for (size_t i = 0; i < nwords; ++i)
     {
-        // No argument, cd to home directory
-        char *home = getenv("HOME");
-        if (home)
-            chdir(home);
-        else
+        // A word with a \ is stored in the form of word_pats
+        words[i] = w[i];
+        if (strchr(w[i], '\\'))
         {
-            fprintf(stderr, "smallsh: cd: HOME not set\n");
-            setenv("?", "1", 1);
+            word_pats[i] = w[i];
+            if (!(words[i] = strdup(w[i])))
+                err(1, "strdup");
+            glob_unescape(words[i]);
         }
     }
-    else if (argc > 2)
+    run_line(nwords);
+    for (size_t i = 0; i < nwords; ++i)
     {
-        // More than one argument
-        fprintf(stderr, "smallsh: cd: too many arguments\n");
-        setenv("?", "1", 1);
+        if (word_pats[i])
+            free(words[i]);
+        words[i] = word_pats[i] = NULL;
     }
-    else
+}
+
+/*
+ * End of a compiled script: the end of input
+ */
+int compiled_end()
+{
+    jobs_drain();
+    return 0;
+}
+
+/*
+ * Parse a size with an optional K, M, G or T suffix (powers of 1024) into *out.
+ * Returns 0, or -1 if s is not a positive size.
+ */
+int parse_size(char const *s, uint64_t *out)
+{
+    char *end;
+    errno = 0;
+    uint64_t n = strtoull(s, &end, 10);
+    char const *units = "KMGT";
+    char const *u = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (u)
     {
-        // Just one argument
-        if (chdir(argv[1]) != 0)
-        {
-            fprintf(stderr, "smalssh: chdir failed\n");
-            setenv("?", "1", 1);
-        }
+        for (char const *p = units; p <= u; ++p)
+            n = n > UINT64_MAX / 1024 ? UINT64_MAX : n * 1024;
+        ++end;
     }
+    if (!isdigit((unsigned char)*s) || *end || errno || n == 0)
+        return -1;
+    *out = n;
+    return 0;
 }
 
 /*
- * Built-in commands: exit
+ * Limits for commands started now: the SMALLSH_LIMIT_* defaults, overridden
+ * by the limit builtin running the command
  */
-void builtin_exit(char **argv, size_t argc)
+void limits_current(struct limits *l)
 {
-    if (argc > 2)
+    static char const *const names[] = {"SMALLSH_LIMIT_MEM", "SMALLSH_LIMIT_CPU",
+                                        "SMALLSH_LIMIT_NOFILE", "SMALLSH_LIMIT_CPU_MAX"};
+    uint64_t *fields[] = {&l->mem, &l->cpu, &l->nofile, &l->cpu_max};
+    uint64_t const *over[] = {&limit_override.mem, &limit_override.cpu,
+                              &limit_override.nofile, &limit_override.cpu_max};
+    for (size_t i = 0; i < 4; ++i)
     {
-        fprintf(stderr, "smallsh: exit: too many arguments\n");
-        setenv("?", "1", 1);
+        char const *env = getenv(names[i]);
+        *fields[i] = *over[i];
+        if (!*over[i] && env && *env && parse_size(env, fields[i]) < 0)
+            *fields[i] = 0;
     }
-    int exit_code;
-    if (argc == 2)
+}
+
+/*
+ * Built-in commands: limit [--mem size] [--cpu seconds] [--nofile n] [--cpu-max percent] cmd [args...]
+ * Run cmd with resource limits, in addition to the SMALLSH_LIMIT_* defaults
+ */
+void builtin_limit(char **argv, size_t argc)
+{
+    static char const *const options[] = {"--mem", "--cpu", "--nofile", "--cpu-max"};
+    struct limits saved = limit_override;
+    uint64_t *fields[] = {&limit_override.mem, &limit_override.cpu,
+                          &limit_override.nofile, &limit_override.cpu_max};
+    size_t i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i += 2)
     {
-        char *endptr;
-        exit_code = strtol(argv[1], &endptr, 0);
-        if (*endptr != '\0')
+        size_t k = 0;
+        if (strcmp(argv[i], "--") == 0)
         {
-            fprintf(stderr, "smallsh: exit: %s: integer argument required\n", argv[1]);
-            setenv("?", "1", 1);
+            ++i;
+            break;
+        }
+        if (i + 1 == argc)
+        {
+            fprintf(stderr, "smallsh: limit: %s: missing value\n", argv[i]);
+            limit_override = saved;
+            set_status(1);
+            return;
+        }
+        while (k < 4 && strcmp(argv[i], options[k]) != 0)
+            ++k;
+        if (k == 4 || parse_size(argv[i + 1], fields[k]) < 0)
+        {
+            fprintf(stderr, "smallsh: limit: %s %s: invalid limit\n", argv[i], argv[i + 1]);
+            limit_override = saved;
+            set_status(1);
+            return;
         }
     }
-    else
+    if (i >= argc)
     {
-        // If no argument is provided, use $?
-        char *status = getenv("?");
-        if (!status)
-            exit_code = 0;
-        else
-            exit_code = strtol(status, NULL, 0);
+        fprintf(stderr, "smallsh: limit: usage: limit [--mem size] [--cpu seconds] [--nofile n] "
+                        "[--cpu-max percent] cmd [args...]\n");
+        limit_override = saved;
+        set_status(1);
+        return;
     }
-    exit(exit_code);
+    execute_cmds(argv + i, argc - i);
+    limit_override = saved;
 }
 
 /*
- * Execute commands
- * If the command is a built-in command, execute it directly.
- * Otherwise, execute it as a non-built-in command.
+ * Set resource limit resource to value in this process, keeping the hard
+ * limit at least slack above it
  */
-void execute_cmds(char **words_argv, size_t words_argc)
+void set_limit(int resource, uint64_t value, uint64_t slack)
 {
-
-    if (strcmp(words_argv[0], "cd") == 0)
-        builtin_cd(words_argv, words_argc);
-    else if (strcmp(words[0], "exit") == 0)
-        builtin_exit(words_argv, words_argc);
-    else
-        execute_nonbuiltin_cmds(words_argv);
+    struct rlimit rl;
+    getrlimit(resource, &rl);
+    if (rl.rlim_max != RLIM_INFINITY && value > rl.rlim_max)
+        value = rl.rlim_max;
+    rl.rlim_cur = value;
+    if (rl.rlim_max == RLIM_INFINITY || value + slack < rl.rlim_max)
+        rl.rlim_max = value + slack;
+    setrlimit(resource, &rl);
 }
 
-/* Execute non-built-in commands. */
-void execute_nonbuiltin_cmds(char **words_argv)
+/*
+ * Start argv with fork and exec instead of posix_spawn, for what has to be
+ * done in the child: join cgroup (if not NULL), apply the redirections and
+ * set the resource limits. Other threads may hold locks when the shell
+ * forks, so all that could take one is done in the parent: the command is
+ * found, and the files of the redirections and the cgroup.procs file of
+ * cgroup are opened. The child only writes, dup2s, sets limits and calls
+ * execve, and reports a failure through a close-on-exec pipe.
+ * Returns 0 and sets *pid, an error number, or -1 if a redirection failed
+ * and has been reported.
+ */
+int spawn_fork(pid_t *pid, char **argv, struct redir const *r, size_t nr,
+               struct limits const *l, char const *cgroup)
 {
-    pid_t pid = fork();
-    int status;
-    int fd = STDIN_FILENO;
+    char path[PATH_MAX];
+    int e = spawn_find(argv[0], path, sizeof path);
+    if (e != 0)
+        return e;
 
-    switch (pid)
+    // Opened files go above the descriptors the redirections replace
+    int *files = malloc(sizeof *files * (nr + 1)), above = SHELL_FD_MAX, procs = -1, rc = 0, p[2];
+    if (!files)
+        err(1, "malloc");
+    for (size_t i = 0; i < nr; ++i)
     {
-    case -1:
-        fprintf(stderr, "Fork: %s", words_argv[0]);
-        exit(EXIT_FAILURE);
-        break;
-
-    case 0:
-        /* Child process */
-
-        // Set to default signal handling
-        sigaction(SIGINT, &SIGINT_default, NULL);
-        sigaction(SIGTSTP, &SIGTSTP_default, NULL);
-
-        // Handle redirection in words
-        for (int i = 0; words[i] != NULL; i++)
-        {
-            if (strcmp(words[i], ">") == 0)
-            {
-                if (!words[i + 1])
-                    err(1, "no file for redirection output");
-                fd = open(words[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0777);
-                if (fd < 0)
-                    err(1, "open file for redirection output");
-                if (dup2(fd, fileno(stdout)) < 0)
-                    err(1, "dup2");
-                close(fd);
-            }
-            else if (strcmp(words[i], "<") == 0)
-            {
-                if (!words[i + 1])
-                    err(1, "no file for redirection output");
-                fd = open(words[i + 1], O_RDONLY);
-                if (fd < 0)
-                    err(1, "open file for redirection input");
-                if (dup2(fd, fileno(stdin)) < 0)
-                    err(1, "dup2");
-                close(fd);
-            }
-            else if (strcmp(words[i], ">>") == 0)
-            {
-                if (!words[i + 1])
-                    err(1, "no file for redirection output");
-                fd = open(words[i + 1], O_WRONLY | O_CREAT | O_APPEND, 0777);
-                if (fd < 0)
-                    err(1, "open file for redirection output append");
-                if (dup2(fd, fileno(stdout)) < 0)
-                    err(1, "dup2");
-                close(fd);
-            }
-        }
-
-        // Check if contain /
-        if (strchr(words_argv[0], '/') != NULL)
+        files[i] = -1;
+        if (r[i].fd > above)
+            above = r[i].fd;
+    }
+    for (size_t i = 0; i < nr && rc == 0; ++i)
+    {
+        if (r[i].op >= REDIR_DUP)
+            continue;
+        int fd = r[i].op == REDIR_APPEND ? append_cache_get(r[i].target) : -1;
+        int opened = fd < 0;
+        if (opened && (fd = open(r[i].target, redir_flags[r[i].op] | O_CLOEXEC, 0777)) < 0)
         {
-            // Contain /, use the path
-            execv(words_argv[0], words_argv);
-            perror("execv");
-            exit(EXIT_FAILURE);
+            warn("%s", r[i].target);
+            rc = -1;
+            break;
         }
+        files[i] = fcntl(fd, F_DUPFD_CLOEXEC, above + 1);
+        if (opened)
+            close(fd);
+        if (files[i] < 0)
+            rc = errno;
+    }
+    if (rc == 0 && cgroup)
+    {
+        char procs_path[PATH_MAX];
+        snprintf(procs_path, sizeof procs_path, "%s/cgroup.procs", cgroup);
+        if ((procs = open(procs_path, O_WRONLY | O_CLOEXEC)) < 0)
+            warn("%s", cgroup);
         else
         {
-            // Not contain /, search the PATH
-            execvp(words_argv[0], words_argv);
-            perror("execvp");
-            exit(EXIT_FAILURE);
+            int hi = fcntl(procs, F_DUPFD_CLOEXEC, above + 1);
+            close(procs);
+            procs = hi;
         }
-        break;
+    }
 
-    default:
-        /* Parent process */
-        if (bg_flag != 0)
+    pid_t child = -1;
+    if (rc == 0 && pipe2(p, O_CLOEXEC) < 0)
+        rc = errno;
+    else if (rc == 0 && (child = fork()) < 0)
+    {
+        rc = errno;
+        close(p[0]);
+        close(p[1]);
+    }
+    if (child == 0)
+    {
+        close(p[0]);
+        // Default signal handling, as with POSIX_SPAWN_SETSIGDEF
+        if (interactive && SIGINT_default.sa_handler != SIG_IGN)
+            signal(SIGINT, SIG_DFL);
+        if (interactive && SIGTSTP_default.sa_handler != SIG_IGN)
+            signal(SIGTSTP, SIG_DFL);
+        if (procs >= 0)
+            write(procs, "0", 1);
+        for (size_t i = 0; i < nr && e == 0; ++i)
         {
-            // Background process, do not wait for it to finish
-            waitpid(pid, &status, WNOHANG | WUNTRACED);
-            // Set $! to the pid of the last background process
-            sprintf(int_buf, "%d", pid);
-            setenv("!", int_buf, 1);
+            if (r[i].op == REDIR_CLOSE)
+                close(r[i].fd);
+            else if (r[i].op == REDIR_DUP && r[i].src == r[i].fd)
+                e = fcntl(r[i].fd, F_SETFD, 0) < 0 ? errno : 0;
+            else if (dup2(r[i].op == REDIR_DUP ? r[i].src : files[i], r[i].fd) < 0)
+                e = errno;
         }
-        else
+        if (e == 0)
         {
-            // Foreground process, wait for it to finish or stop
-            pid = waitpid(pid, &status, WUNTRACED);
-
-            if (WIFSIGNALED(status))
-            {
-                // Terminated by a signal
-                status = 128 + WTERMSIG(status);
-                sprintf(int_buf, "%d", status);
-                setenv("?", int_buf, 1);
-            }
-            else if (WIFSTOPPED(status))
-            {
-                // Stopped by a signal
-                fprintf(stderr, "Child process %d stopped. Continuing.\n", pid);
-                if (kill(pid, SIGCONT) < 0)
-                {
-                    perror("kill");
-                    exit(EXIT_FAILURE);
-                }
-                sprintf(int_buf, "%d", pid);
-                setenv("!", int_buf, 1);
-            }
-            else if (WIFEXITED(status))
-            {
-                // Exited normally
-                status = WEXITSTATUS(status);
-                sprintf(int_buf, "%d", status);
-                setenv("?", int_buf, 1);
-            }
+            if (l->mem)
+                set_limit(RLIMIT_AS, l->mem, 0);
+            if (l->cpu)
+                set_limit(RLIMIT_CPU, l->cpu, 1); // SIGXCPU first, then SIGKILL
+            if (l->nofile)
+                set_limit(RLIMIT_NOFILE, l->nofile, 0);
+            execve(path, argv, environ);
+            e = errno;
         }
-        break;
+        write(p[1], &e, sizeof e);
+        _exit(127);
+    }
+
+    for (size_t i = 0; i < nr; ++i)
+        if (files[i] >= 0)
+            close(files[i]);
+    free(files);
+    if (procs >= 0)
+        close(procs);
+    if (rc != 0)
+        return rc;
+
+    ssize_t n;
+    close(p[1]);
+    while ((n = read(p[0], &e, sizeof e)) < 0 && errno == EINTR)
+        ;
+    close(p[0]);
+    if (n == sizeof e)
+    {
+        waitpid(child, NULL, 0);
+        return e;
+    }
+    *pid = child;
+    return 0;
+}
+
+/*
+ * Find command name for spawn_fork as posix_spawnp would, through the shared
+ * path cache when it is enabled, and copy its path to path.
+ * Returns 0, or an error number.
+ */
+int spawn_find(char const *name, char *path, size_t size)
+{
+    if (strchr(name, '/'))
+        return snprintf(path, size, "%s", name) < (int)size ? 0 : ENAMETOOLONG;
+    struct path_cache *c = path_cache_get();
+    char const *env = getenv("PATH");
+    uint64_t h = fnv1a(FNV_OFFSET, env ? env : "", env ? strlen(env) : 0);
+    if (c && path_cache_find(c, h, name, path) == 0)
+    {
+        if (access(path, X_OK) == 0)
+            return 0;
+        path_cache_store(c, h, name, NULL);
+    }
+    int found = path_search(name, path, size);
+    if (found < 0)
+        return ENOENT;
+    if (c && found == 0)
+        path_cache_store(c, h, name, path);
+    return 0;
+}
+
+/*
+ * Create a cgroup for job j under SMALLSH_CGROUP, a writable cgroup v2
+ * directory, with memory.max and cpu.max from its limits. A foreground
+ * command is job 0. Returns its path, or NULL if cgroups are not in use
+ * or it failed; a cpu-max limit, which only a cgroup enforces, is then
+ * reported as not applied.
+ */
+char *cgroup_create(struct job *j)
+{
+    char const *parent = getenv("SMALLSH_CGROUP");
+    char *path = NULL, *file = NULL;
+    if (!parent || !*parent)
+    {
+        if (j->limits.cpu_max)
+            warnx("cpu-max: not applied without SMALLSH_CGROUP");
+        return NULL;
+    }
+    if (asprintf(&file, "%s/cgroup.controllers", parent) < 0 || access(file, F_OK) < 0 ||
+        asprintf(&path, "%s/smallsh-%jd-%d", parent, (intmax_t)getpid(), j->id) < 0)
+    {
+        warnx("%s: not a cgroup v2 directory", parent);
+        free(file);
+        return NULL;
+    }
+    free(file);
+
+    // Let child cgroups use the memory and cpu controllers
+    cgroup_write(parent, "cgroup.subtree_control", "+memory +cpu");
+    if (mkdir(path, 0755) < 0)
+    {
+        warn("%s", path);
+        free(path);
+        return NULL;
+    }
+    char value[64];
+    if (j->limits.mem)
+    {
+        snprintf(value, sizeof value, "%" PRIu64, j->limits.mem);
+        cgroup_write(path, "memory.max", value);
+    }
+    if (j->limits.cpu_max)
+    {
+        snprintf(value, sizeof value, "%" PRIu64 " 100000", j->limits.cpu_max * 1000);
+        if (cgroup_write(path, "cpu.max", value) < 0)
+            warnx("cpu-max: not applied, %s/cpu.max cannot be written", path);
+    }
+    return path;
+}
+
+/*
+ * Write value to the file name in cgroup directory dir. Returns 0 or -1.
+ */
+int cgroup_write(char const *dir, char const *name, char const *value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = write_all(fd, value, strlen(value));
+    close(fd);
+    return rc;
+}
+
+/*
+ * Value of key in the flat-keyed cgroup file name in dir, or of the file
+ * itself if key is NULL. Returns -1 if not found.
+ */
+int64_t cgroup_read(char const *dir, char const *name, char const *key)
+{
+    char path[PATH_MAX], buf[4096];
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    if (!key)
+        return strtoll(buf, NULL, 10);
+    size_t klen = strlen(key);
+    for (char *line = buf; line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+        if (strncmp(line, key, klen) == 0 && line[klen] == ' ')
+            return strtoll(line + klen + 1, NULL, 10);
+    return -1;
+}
+
+/*
+ * Read the accounting of the cgroup of job pid into report, for its exit
+ * message, and remove the cgroup. report is empty for jobs without one.
+ */
+void job_accounting(pid_t pid, char *report, size_t size)
+{
+    report[0] = '\0';
+    for (size_t i = 0; i < njobs; ++i)
+    {
+        struct job *j = jobs[i];
+        if (j->pid != pid || !j->cgroup)
+            continue;
+        int64_t usec = cgroup_read(j->cgroup, "cpu.stat", "usage_usec");
+        int64_t peak = cgroup_read(j->cgroup, "memory.peak", NULL);
+        int64_t ooms = cgroup_read(j->cgroup, "memory.events", "oom_kill");
+        // Controllers that are not enabled have no files; leave their values out
+        size_t n = 0;
+        if (usec >= 0)
+            n += snprintf(report + n, size - n, " CPU %.2fs.", usec / 1e6);
+        if (peak >= 0 && n < size)
+            n += snprintf(report + n, size - n, " Peak memory %.1f MiB.", peak / 1048576.0);
+        if (ooms > 0 && n < size)
+            snprintf(report + n, size - n, " Killed for memory.");
+        rmdir(j->cgroup);
+        free(j->cgroup);
+        j->cgroup = NULL;
+        return;
     }
 }
 
@@ -657,25 +8968,41 @@ int bg_handler()
     pid_t pid;
     int status;
     int signal;
+    size_t reaped = 0;
+
+    // Nothing to reap or start before the first child
+    if (spawn_count == 0 && ndelayed == 0)
+        return 0;
 
     // Check if any background process has finished
     while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
     {
+        if (!WIFSTOPPED(status) && procsub_reap(pid))
+            continue;
+        if (!WIFSTOPPED(status))
+            ++reaped;
         pid_t pgid = getpgrp();
+        if (!ppgid)
+            ppgid = pgid;
         if (pgid == ppgid)
         {
+            char report[128];
+            if (!WIFSTOPPED(status))
+                job_accounting(pid, report, sizeof report);
             if (WIFEXITED(status))
             {
                 // Exited
+                job_done(pid, status);
                 status = WEXITSTATUS(status);
-                fprintf(stderr, "Child process %jd done. Exit status %d.\n", (intmax_t)pid, status);
+                fprintf(stderr, "Child process %jd done. Exit status %d.%s\n", (intmax_t)pid, status, report);
                 fflush(stderr);
             }
             else if (WIFSIGNALED(status))
             {
                 // Terminated by signal
+                job_done(pid, status);
                 signal = WTERMSIG(status);
-                fprintf(stderr, "Child process %jd done. Signaled %d.\n", (intmax_t)pid, signal);
+                fprintf(stderr, "Child process %jd done. Signaled %d.%s\n", (intmax_t)pid, signal, report);
                 fflush(stderr);
             }
             else if (WIFSTOPPED(status))
@@ -691,5 +9018,9 @@ int bg_handler()
             }
         }
     }
+
+    // Start delayed jobs: one for each finished child, plus one
+    if (ndelayed > 0)
+        jobs_admit(reaped + 1);
     return 0;
 }
\ No newline at end of file